@@ -27,6 +27,8 @@
 #include "pcgsolver/sparse_matrix.h"
 #include "pcgsolver/blas_wrapper.h"
 #include "GeometricLevelGen.h"
+#include "TimingUtilities.h"
+#include "PipelinedCG.h"
 /*
 given A_L, R_L, P_L, b,compute x using
 Multigrid Cycles.
@@ -119,30 +121,49 @@ void RBGS(const FixedSparseMatrix<T> &A,
 	}
 }
 
+// r is scratch space for the fine residual
 template<class T>
 void restriction(const FixedSparseMatrix<T> &R,
 	const FixedSparseMatrix<T> &A,
 	const vector<T>            &x,
 	const vector<T>            &b_curr,
-	vector<T>                  &b_next)
+	vector<T>                  &b_next,
+	vector<T>                  &r)
 {
 	b_next.assign(b_next.size(),0);
-	vector<T> r = b_curr;
+	r = b_curr;
 	multiply_and_subtract(A,x,r);
 	multiply(R,r,b_next);
-	r.resize(0);
 }
 template<class T>
+void restriction(const FixedSparseMatrix<T> &R,
+	const FixedSparseMatrix<T> &A,
+	const vector<T>            &x,
+	const vector<T>            &b_curr,
+	vector<T>                  &b_next)
+{
+	vector<T> r;
+	restriction(R,A,x,b_curr,b_next,r);
+}
+// xx is scratch space for the interpolated correction
+template<class T>
 void prolongatoin(const FixedSparseMatrix<T> &P,
 	const vector<T>            &x_curr,
-	vector<T>                  &x_next)
+	vector<T>                  &x_next,
+	vector<T>                  &xx)
 {
-	static vector<T> xx;
 	xx.resize(x_next.size());
 	xx.assign(xx.size(),0);
 	multiply(P,x_curr,xx);//xx = P*x_curr;
 	add_scaled(1.0,xx,x_next);
-	xx.resize(0);
+}
+template<class T>
+void prolongatoin(const FixedSparseMatrix<T> &P,
+	const vector<T>            &x_curr,
+	vector<T>                  &x_next)
+{
+	vector<T> xx;
+	prolongatoin(P,x_curr,x_next,xx);
 }
 template<class T>
 void amgVCycle(vector<FixedSparseMatrix<T> > &A_L,
@@ -455,6 +476,69 @@ void amgVCycleCompressed(vector<FixedSparseMatrix<T> > &A_L,
 		b_L[i].shrink_to_fit();
 	}
 }
+/*
+Scratch vectors of the V-cycle. The caller owns them, so that concurrent
+solves share no memory and repeated cycles do not reallocate.
+*/
+template<class T>
+struct AMGVCycleWorkspace
+{
+	vector<vector<T> > x_L;
+	vector<vector<T> > b_L;
+	vector<T>          r;
+	vector<T>          xx;
+};
+
+template<class T>
+void amgVCycleCompressed(vector<FixedSparseMatrix<T> > &A_L,
+	vector<FixedSparseMatrix<T> > &R_L,
+	vector<FixedSparseMatrix<T> > &P_L,
+	vector<vector<bool> >         &p_L,
+	vector<T>                      &x,
+	const vector<T>                &b,
+	AMGVCycleWorkspace<T>          &ws)
+{
+	int total_level = A_L.size();
+	// level 0 works in place on x and b
+	ws.x_L.resize(total_level);
+	ws.b_L.resize(total_level);
+	for(int i=1;i<total_level;i++)
+	{
+		int unknowns = A_L[i].n;
+		ws.x_L[i].assign(unknowns,0);
+		ws.b_L[i].assign(unknowns,0);
+	}
+	auto x_L = [&](int i) -> vector<T>& { return i == 0 ? x : ws.x_L[i]; };
+	auto b_L = [&](int i) -> const vector<T>& { return i == 0 ? b : ws.b_L[i]; };
+
+	for (int i=0;i<total_level-1;i++)
+	{
+		RBGS_with_pattern((A_L[i]),b_L(i),x_L(i),(p_L[i]),4);
+		restriction((R_L[i]),(A_L[i]),x_L(i),b_L(i),ws.b_L[i+1],ws.r);
+	}
+	int i = total_level-1;
+	RBGS_with_pattern((A_L[i]),b_L(i),x_L(i),(p_L[i]),200);
+	for (int i=total_level-2;i>=0;i--)
+	{
+		prolongatoin((P_L[i]),x_L(i+1),x_L(i),ws.xx);
+		RBGS_with_pattern((A_L[i]),b_L(i),x_L(i),(p_L[i]),4);
+	}
+}
+
+template<class T>
+void amgPrecondCompressed(vector<FixedSparseMatrix<T> > &A_L,
+	vector<FixedSparseMatrix<T> > &R_L,
+	vector<FixedSparseMatrix<T> > &P_L,
+	vector<vector<bool>  >        &p_L,
+	vector<T>                      &x,
+	const vector<T>                &b,
+	AMGVCycleWorkspace<T>          &ws)
+{
+	x.resize(b.size());
+	x.assign(x.size(),0);
+	amgVCycleCompressed(A_L,R_L,P_L,p_L,x,b,ws);
+}
+
 template<class T>
 void amgPrecondCompressed(vector<FixedSparseMatrix<T> > &A_L,
 	vector<FixedSparseMatrix<T> > &R_L,
@@ -481,12 +565,12 @@ bool AMGPCGSolveCompressed(const SparseMatrix<T> &matrix,
 	int &iterations_out,
 	int ni, int nj, int nk) 
 {
-	static FixedSparseMatrix<T> fixed_matrix;
+	FixedSparseMatrix<T> fixed_matrix;
 	fixed_matrix.construct_from_matrix(matrix);
-	static vector<FixedSparseMatrix<T> > A_L;
-	static vector<FixedSparseMatrix<T> > R_L;
-	static vector<FixedSparseMatrix<T> > P_L;
-	static vector<vector<bool> >          p_L;
+	vector<FixedSparseMatrix<T> > A_L;
+	vector<FixedSparseMatrix<T> > R_L;
+	vector<FixedSparseMatrix<T> > P_L;
+	vector<vector<bool> >          p_L;
 	vector<T>                      m,z,s,r;
 	int total_level;
 	levelGen<T> amg_levelGen;
@@ -605,77 +689,293 @@ bool AMGPCGSolveCompressed(const SparseMatrix<T> &matrix,
 	return false;
 }
 
+// copy a matrix into another precision, reusing the storage of dst
+template<class S, class T>
+void convertFixedSparseMatrix(const FixedSparseMatrix<T> &src, FixedSparseMatrix<S> &dst)
+{
+	dst.n = src.n;
+	dst.rowstart = src.rowstart;
+	dst.colindex = src.colindex;
+	dst.value.resize(src.value.size());
+	for(size_t i=0;i<src.value.size();i++)
+		dst.value[i] = (S)src.value[i];
+}
+
+enum AMG_SETUP_KIND
+{
+	AMG_SETUP_FULL,
+	AMG_SETUP_PARTIAL,
+	AMG_SETUP_NUMERIC
+};
+
+/*
+Solver state of AMGPCGSolveSparse: the Galerkin hierarchy, kept between
+solves and keyed on the DOF pattern (Dof_ijk) of every level, and all the
+workspace of the PCG and the V-cycle. Nothing is shared between instances,
+so every FluidSim3D owns one and several of them can solve concurrently.
+
+- identical pattern: R, P and the sparsity of every A_L are reused and only
+  the Galerkin products are refreshed numerically.
+- pattern changed in less than rebuild_threshold of the cells: R/P and the
+  symbolic products are rebuilt only for the levels whose pattern changed;
+  once a coarse level comes out with the cached pattern, all levels below it
+  go through the numeric refresh.
+- otherwise the hierarchy is rebuilt from scratch.
+
+With single_precision set, the hierarchy is still built in T, but the V-cycle
+runs on a float copy of every level (A_Lf, R_Lf, P_Lf), so that the
+preconditioner moves half the bytes. The outer PCG stays in T.
+
+With pipelined_cg set, AMGPCGSolveSparse runs the single-reduction CG of
+PipelinedCG.h instead of the textbook loop.
+*/
 template<class T>
-bool AMGPCGSolveSparse(const SparseMatrix<T> &matrix, 
+struct AMGSparseHierarchy
+{
+	vector<FixedSparseMatrix<T> > A_L;
+	vector<FixedSparseMatrix<T> > R_L;
+	vector<FixedSparseMatrix<T> > P_L;
+	vector<vector<bool> >         p_L;
+	vector<vector<Vector3i> >     D_L;
+	int total_level;
+	int ni, nj, nk;
+
+	T rebuild_threshold;
+
+	bool single_precision;
+	bool pipelined_cg;
+	vector<FixedSparseMatrix<float> > A_Lf;
+	vector<FixedSparseMatrix<float> > R_Lf;
+	vector<FixedSparseMatrix<float> > P_Lf;
+	vector<float>                     xf, bf;
+
+	// workspace
+	AMGVCycleWorkspace<T>     ws;
+	AMGVCycleWorkspace<float> wsf;
+	vector<T>                 pcg_m, pcg_z, pcg_s, pcg_r, pcg_q;
+
+	// statistics of the last setup
+	double setup_time;
+	AMG_SETUP_KIND last_setup;
+	int rebuilt_levels;
+
+	// max-norm residual before and after every iteration of the last solve
+	vector<double> residual_history;
+
+	AMGSparseHierarchy()
+	: total_level(0), ni(0), nj(0), nk(0), rebuild_threshold(0.05),
+	single_precision(false), pipelined_cg(false), setup_time(0), last_setup(AMG_SETUP_FULL), rebuilt_levels(0)
+	{}
+
+	void clear()
+	{
+		A_L.clear(); R_L.clear(); P_L.clear(); p_L.clear(); D_L.clear();
+		A_Lf.clear(); R_Lf.clear(); P_Lf.clear();
+		total_level = 0;
+	}
+
+	// number of cells in the symmetric difference of two dof lists sorted by linear index
+	static size_t count_changed(const vector<Vector3i> &a, const vector<Vector3i> &b, int ni, int nj)
+	{
+		size_t ia = 0, ib = 0, changed = 0;
+		while(ia < a.size() && ib < b.size())
+		{
+			long la = a[ia][0] + (long)ni*(a[ia][1] + (long)nj*a[ia][2]);
+			long lb = b[ib][0] + (long)ni*(b[ib][1] + (long)nj*b[ib][2]);
+			if(la == lb) { ++ia; ++ib; }
+			else if(la < lb) { ++ia; ++changed; }
+			else { ++ib; ++changed; }
+		}
+		return changed + (a.size() - ia) + (b.size() - ib);
+	}
+
+	void setup(const SparseMatrix<T> &matrix, const vector<Vector3i> &Dof_ijk, int ni_, int nj_, int nk_)
+	{
+		FixedSparseMatrix<T> fixed;
+		fixed.construct_from_matrix(matrix);
+		setup(fixed,Dof_ijk,ni_,nj_,nk_);
+	}
+
+	// the matrix is swapped into A_L[0]; on return it holds the storage of
+	// the previous finest level, so that a caller-owned buffer is recycled
+	void setup(FixedSparseMatrix<T> &matrix, const vector<Vector3i> &Dof_ijk, int ni_, int nj_, int nk_)
+	{
+		double t0 = timingutils::seconds();
+		levelGen<T> amg_levelGen;
+
+		bool reuse = total_level > 0 && ni == ni_ && nj == nj_ && nk == nk_;
+		if(reuse)
+		{
+			size_t changed = count_changed(D_L[0], Dof_ijk, ni, nj);
+			size_t base = std::max(D_L[0].size(), Dof_ijk.size());
+			reuse = (T)changed <= rebuild_threshold * (T)base;
+		}
+		if(!reuse) clear();
+		ni = ni_; nj = nj_; nk = nk_;
+
+		A_L.resize(std::max((size_t)1, A_L.size()));
+		D_L.resize(std::max((size_t)1, D_L.size()));
+		p_L.resize(std::max((size_t)1, p_L.size()));
+		A_L[0].swap(matrix);
+		bool pattern_changed = !reuse || D_L[0] != Dof_ijk;
+		if(pattern_changed) D_L[0] = Dof_ijk;
+
+		rebuilt_levels = 0;
+		int nni = ni, nnj = nj, nnk = nk;
+		int l = 0;
+		while (A_L[l].n > 4096)
+		{
+			if((int)A_L.size() < l+2)
+			{
+				A_L.resize(l+2);
+				D_L.resize(l+2);
+				p_L.resize(l+2);
+			}
+			if((int)R_L.size() < l+1)
+			{
+				R_L.resize(l+1);
+				P_L.resize(l+1);
+			}
+
+			bool refreshed = !pattern_changed &&
+				amg_levelGen.refreshGalerkinNumeric(A_L[l],R_L[l],P_L[l],A_L[l+1]);
+
+			if(!refreshed)
+			{
+				if(pattern_changed)
+				{
+					vector<Vector3i> Dof_ijk_coarse;
+					amg_levelGen.generateRPSparseDirect(R_L[l],P_L[l],p_L[l],
+						D_L[l],Dof_ijk_coarse,nni,nnj,nnk);
+					pattern_changed = (Dof_ijk_coarse != D_L[l+1]);
+					D_L[l+1].swap(Dof_ijk_coarse);
+				}
+				FixedSparseMatrix<T> temp;
+				multiplyMat((A_L[l]),(P_L[l]),temp,(T)1.0);
+				multiplyMat((R_L[l]),temp,(A_L[l+1]),(T)0.5);
+				++rebuilt_levels;
+			}
+
+			nni = ceil((float)nni/2.0);
+			nnj = ceil((float)nnj/2.0);
+			nnk = ceil((float)nnk/2.0);
+			++l;
+		}
+		total_level = l+1;
+		A_L.resize(total_level);
+		D_L.resize(total_level);
+		p_L.resize(total_level);
+		R_L.resize(total_level-1);
+		P_L.resize(total_level-1);
+
+		if(pattern_changed)
+			amg_levelGen.generatePatternSparse(D_L[l],p_L[l]);
+
+		if(single_precision)
+		{
+			A_Lf.resize(total_level);
+			R_Lf.resize(total_level-1);
+			P_Lf.resize(total_level-1);
+			for(int i=0;i<total_level;i++)
+				convertFixedSparseMatrix(A_L[i],A_Lf[i]);
+			for(int i=0;i<total_level-1;i++)
+			{
+				convertFixedSparseMatrix(R_L[i],R_Lf[i]);
+				convertFixedSparseMatrix(P_L[i],P_Lf[i]);
+			}
+		}
+		else
+		{
+			A_Lf.clear(); R_Lf.clear(); P_Lf.clear();
+		}
+
+		if(!reuse) last_setup = AMG_SETUP_FULL;
+		else if(rebuilt_levels > 0) last_setup = AMG_SETUP_PARTIAL;
+		else last_setup = AMG_SETUP_NUMERIC;
+
+		setup_time = timingutils::seconds() - t0;
+	}
+
+	// x = M^{-1} b with one V-cycle, in float if single_precision is set
+	void precondition(vector<T> &x, const vector<T> &b)
+	{
+		if(single_precision)
+		{
+			bf.assign(b.begin(), b.end());
+			amgPrecondCompressed(A_Lf,R_Lf,P_Lf,p_L,xf,bf,wsf);
+			x.assign(xf.begin(), xf.end());
+		}
+		else
+		{
+			amgPrecondCompressed(A_L,R_L,P_L,p_L,x,b,ws);
+		}
+	}
+};
+
+// matrix is consumed by the hierarchy setup, see AMGSparseHierarchy::setup
+template<class T>
+bool AMGPCGSolveSparse(FixedSparseMatrix<T> &matrix, 
 	const std::vector<T> &rhs, 
 	std::vector<T> &result, 
 	vector<Vector3i> &Dof_ijk,
+	AMGSparseHierarchy<T> &hierarchy,
 	T tolerance_factor,
 	int max_iterations,
 	T &residual_out, 
 	int &iterations_out,
-	int ni, int nj, int nk) 
+	int ni, int nj, int nk,
+	bool use_initial_guess = false) 
 {
-	static FixedSparseMatrix<T> fixed_matrix;
-	fixed_matrix.construct_from_matrix(matrix);
-	static vector<FixedSparseMatrix<T> > A_L;
-	static vector<FixedSparseMatrix<T> > R_L;
-	static vector<FixedSparseMatrix<T> > P_L;
-	static vector<vector<bool> >          p_L;
-	vector<T>                      m,z,s,r;
-	int total_level;
-	levelGen<T> amg_levelGen;
+	vector<T> &m = hierarchy.pcg_m;
+	vector<T> &z = hierarchy.pcg_z;
+	vector<T> &s = hierarchy.pcg_s;
+	vector<T> &r = hierarchy.pcg_r;
 #ifdef AMG_VERBOSE
 	std::cout << "[AMG: generate levels]" << std::endl;
 #endif
-	amg_levelGen.generateLevelsGalerkinCoarseningSparse
-		(A_L,R_L,P_L,p_L,total_level,fixed_matrix,Dof_ijk,ni,nj,nk);
+	hierarchy.setup(matrix,Dof_ijk,ni,nj,nk);
+	const FixedSparseMatrix<T> &fixed_matrix = hierarchy.A_L[0];
 
-	unsigned int n=matrix.n;
+	unsigned int n=fixed_matrix.n;
 	if(m.size()!=n){ m.resize(n); s.resize(n); z.resize(n); r.resize(n); }
-	zero(result);
 	r=rhs;
 	residual_out=BLAS::abs_max(r);
+	hierarchy.residual_history.assign(1, residual_out);
 	if(residual_out==0) {
+		zero(result);
 		iterations_out=0;
-
-
-		for (int i=0; i<total_level; i++)
-		{
-			A_L[i].clear();
-		}
-		for (int i=0; i<total_level-1; i++)
-		{
-
-			R_L[i].clear();
-			P_L[i].clear();
-
-		}
-
 		return true;
 	}
+	// the tolerance stays relative to the rhs, so that a good initial
+	// guess saves iterations instead of tightening the criterion
 	double tol=tolerance_factor*residual_out;
+	if(use_initial_guess && result.size()==n) {
+		multiply_and_subtract(fixed_matrix, result, r); // r = b - A*x0
+		residual_out=BLAS::abs_max(r);
+		hierarchy.residual_history[0]=residual_out;
+		if(residual_out<=tol) {
+			iterations_out=0;
+			return true;
+		}
+	} else {
+		result.resize(n);
+		zero(result);
+	}
+	if(hierarchy.pipelined_cg) {
+		return pipelinedcg::solve(result, r, z, m, s, hierarchy.pcg_q,
+			[&](vector<T> &u, const vector<T> &b) { hierarchy.precondition(u,b); },
+			[&](const vector<T> &u, vector<T> &w) { multiply(fixed_matrix,u,w); },
+			(T)tol, pipelinedcg::RN_INF, max_iterations, residual_out, iterations_out, &hierarchy.residual_history);
+	}
 #ifdef AMG_VERBOSE
 	std::cout << "[AMG: preconditioning]" << std::endl;
 #endif
-	amgPrecondCompressed(A_L,R_L,P_L,p_L,z,r);
+	hierarchy.precondition(z,r);
 #ifdef AMG_VERBOSE
   std::cout << "[AMG: first precond done]"<< std::endl;
 #endif
 	double rho=BLAS::dot(z, r);
 	if(rho==0 || rho!=rho) {
-		for (int i=0; i<total_level; i++)
-		{
-			A_L[i].clear();
-
-		}
-		for (int i=0; i<total_level-1; i++)
-		{
-
-			R_L[i].clear();
-			P_L[i].clear();
-
-		}
 		iterations_out=0;
 		return false;
 	}
@@ -693,29 +993,16 @@ bool AMGPCGSolveSparse(const SparseMatrix<T> &matrix,
 		BLAS::add_scaled(alpha, s, result);
 		BLAS::add_scaled(-alpha, z, r);
 		residual_out=BLAS::abs_max(r);
+		hierarchy.residual_history.push_back(residual_out);
 
 		if(residual_out<=tol) {
 			iterations_out=iteration+1;
-
-			for (int i=0; i<total_level; i++)
-			{
-				A_L[i].clear();
-
-			}
-			for (int i=0; i<total_level-1; i++)
-			{
-
-				R_L[i].clear();
-				P_L[i].clear();
-
-			}
-
 			return true; 
 		}
 #ifdef AMG_VERBOSE
 		std::cout << "[AMG: iterative preconditioning]" << std::endl;
 #endif
-		amgPrecondCompressed(A_L,R_L,P_L,p_L,z,r);
+		hierarchy.precondition(z,r);
 #ifdef AMG_VERBOSE
     std::cout << "[AMG: second precond done]"<< std::endl;
 #endif
@@ -725,19 +1012,26 @@ bool AMGPCGSolveSparse(const SparseMatrix<T> &matrix,
 		rho=rho_new;
 	}
 	iterations_out=iteration;
-	for (int i=0; i<total_level; i++)
-	{
-		A_L[i].clear();
-
-	}
-	for (int i=0; i<total_level-1; i++)
-	{
-
-		R_L[i].clear();
-		P_L[i].clear();
-
-	}
 	return false;
 }
 
+template<class T>
+bool AMGPCGSolveSparse(const SparseMatrix<T> &matrix, 
+	const std::vector<T> &rhs, 
+	std::vector<T> &result, 
+	vector<Vector3i> &Dof_ijk,
+	AMGSparseHierarchy<T> &hierarchy,
+	T tolerance_factor,
+	int max_iterations,
+	T &residual_out, 
+	int &iterations_out,
+	int ni, int nj, int nk,
+	bool use_initial_guess = false) 
+{
+	FixedSparseMatrix<T> fixed;
+	fixed.construct_from_matrix(matrix);
+	return AMGPCGSolveSparse(fixed,rhs,result,Dof_ijk,hierarchy,tolerance_factor,max_iterations,
+		residual_out,iterations_out,ni,nj,nk,use_initial_guess);
+}
+
 #endif
@@ -37,6 +37,53 @@ using namespace mathutils::shallowflow;
 
 const int N_GAUSS = 2;
 
+// narrows [t0, t1] to the part of the line p0 + t * d within h of c
+static bool clip_to_slab(scalar p0, scalar d, scalar c, scalar h, scalar& t0, scalar& t1)
+{
+  if(d == 0.0) return fabs(p0 - c) <= h;
+  scalar ta = (c - h - p0) / d;
+  scalar tb = (c + h - p0) / d;
+  if(ta > tb) std::swap(ta, tb);
+  t0 = std::max(t0, ta);
+  t1 = std::min(t1, tb);
+  return t0 <= t1;
+}
+
+// Calls func(i, j, k) for the faces in [lo, hi] whose window of half size h
+// around base + (i, j, k) * h meets the segment x0-x1. The segment is clipped
+// to the slab of every k and then of every j, so only the faces along it are
+// visited instead of its whole bounding box. The slabs are widened slightly
+// since callers clip against each window again.
+template<class Callable>
+static void for_each_face_near_segment(const Vector3s& x0, const Vector3s& x1, const Vector3s& base, scalar h,
+                                       const Vector3i& lo, const Vector3i& hi, Callable func)
+{
+  const scalar hw = h * (1.0 + 1e-6);
+  const Vector3s d = x1 - x0;
+  
+  const int k0 = std::max(lo(2), (int) ceil((std::min(x0(2), x1(2)) - hw - base(2)) / h));
+  const int k1 = std::min(hi(2), (int) floor((std::max(x0(2), x1(2)) + hw - base(2)) / h));
+  for(int k = k0; k <= k1; ++k) {
+    scalar tk0 = 0.0, tk1 = 1.0;
+    if(!clip_to_slab(x0(2), d(2), base(2) + k * h, hw, tk0, tk1)) continue;
+    
+    const scalar ya = x0(1) + tk0 * d(1);
+    const scalar yb = x0(1) + tk1 * d(1);
+    const int j0 = std::max(lo(1), (int) ceil((std::min(ya, yb) - hw - base(1)) / h));
+    const int j1 = std::min(hi(1), (int) floor((std::max(ya, yb) + hw - base(1)) / h));
+    for(int j = j0; j <= j1; ++j) {
+      scalar tj0 = tk0, tj1 = tk1;
+      if(!clip_to_slab(x0(1), d(1), base(1) + j * h, hw, tj0, tj1)) continue;
+      
+      const scalar xa = x0(0) + tj0 * d(0);
+      const scalar xb = x0(0) + tj1 * d(0);
+      const int i0 = std::max(lo(0), (int) ceil((std::min(xa, xb) - hw - base(0)) / h));
+      const int i1 = std::min(hi(0), (int) floor((std::max(xa, xb) + hw - base(0)) / h));
+      for(int i = i0; i <= i1; ++i) func(i, j, k);
+    }
+  }
+}
+
 template<int DIM>
 CylindricalShallowFlow<DIM>::CylindricalShallowFlow(TwoDScene<DIM>* parent, const std::vector<int>& involved_particles, const VectorXs& eta, const std::vector<unsigned char>& particle_state) :
 HairFlow<DIM>(parent, involved_particles, eta, particle_state)
@@ -235,7 +282,7 @@ void CylindricalShallowFlow<DIM>::updateReservoir(FluidSim* fluidsim, const Vect
 
 
 template<>
-void CylindricalShallowFlow<2>::updateToFilteredGrid(const VectorXs& x, const VectorXs& v, FluidSim* fluidsim, const scalar& dt, int ibuffer)
+void CylindricalShallowFlow<2>::updateToFilteredGrid(const VectorXs& x, const VectorXs& v, FluidSim* fluidsim, const scalar& dt, int ibuffer, int ebegin, int eend)
 {
   FluidSim2D* fluid2d = (FluidSim2D*) fluidsim;
   scalar cellsize = fluid2d->cellsize();
@@ -250,8 +297,7 @@ void CylindricalShallowFlow<2>::updateToFilteredGrid(const VectorXs& x, const Ve
   const scalar& rho = m_parent->getLiquidDensity();
   
   // for each edge
-  int ne = HairFlow<2>::m_global_edges.size();
-  for(int eidx = 0; eidx < ne; ++eidx)
+  for(int eidx = ebegin; eidx < eend; ++eidx)
   {
     auto& e = HairFlow<2>::m_global_edges[eidx];
     int local_first = m_global_to_local.find(e.first)->second;
@@ -631,25 +677,22 @@ void CylindricalShallowFlow<2>::updateFromFilteredGrid(const VectorXs& x, Vector
 }
 
 template<>
-void CylindricalShallowFlow<3>::updateToFilteredGrid(const VectorXs& x, const VectorXs& v, FluidSim* fluidsim, const scalar& dt, int ibuffer)
+void CylindricalShallowFlow<3>::updateToFilteredGrid(const VectorXs& x, const VectorXs& v, FluidSim* fluidsim, const scalar& dt, int ibuffer, int ebegin, int eend)
 {
   FluidSim3D* fluid3d = (FluidSim3D*) fluidsim;
   scalar cellsize = fluid3d->cellsize();
   
   const VectorXs& drag_buffer = m_parent->getFluidDragBuffer();
-  std::vector<EdgeVelDragIntersection<3> >& u_edge_vel_drag = fluid3d->get_u_edge_vel_drag()[ibuffer];
-  std::vector<EdgeVelDragIntersection<3> >& v_edge_vel_drag = fluid3d->get_v_edge_vel_drag()[ibuffer];
-  std::vector<EdgeVelDragIntersection<3> >& w_edge_vel_drag = fluid3d->get_w_edge_vel_drag()[ibuffer];
-  
-  u_edge_vel_drag.resize(0);
-  v_edge_vel_drag.resize(0);
-  w_edge_vel_drag.resize(0);
+  // the intersections go straight into the tiles of the buffer
+  FluidSim3D::VelDragAccumulator& vel_drag = fluid3d->get_vel_drag_accumulator(ibuffer);
+  FluidSim3D::VelDragTiles& u_vel_drag = vel_drag.face[0];
+  FluidSim3D::VelDragTiles& v_vel_drag = vel_drag.face[1];
+  FluidSim3D::VelDragTiles& w_vel_drag = vel_drag.face[2];
   
   const scalar& rho = m_parent->getLiquidDensity();
 
-  // for each edge
-  int ne = HairFlow<3>::m_global_edges.size();
-  for(int eidx = 0; eidx < ne; ++eidx) {
+  // for each edge of the range
+  for(int eidx = ebegin; eidx < eend; ++eidx) {
     auto& e = HairFlow<3>::m_global_edges[eidx];
     int local_first = m_global_to_local.find(e.first)->second;
     int local_second = m_global_to_local.find(e.second)->second;
@@ -740,7 +783,8 @@ void CylindricalShallowFlow<3>::updateToFilteredGrid(const VectorXs& x, const Ve
     int zmax_w = std::max(0, std::min(fluid3d->get_w_nk()-1, (int) floor((zmax - fluid3d->get_origin()(2)) / cellsize)));
     
     std::vector<Vector3i> line_buffer;
-    for(int k = zmin_u; k <= zmax_u; ++k) for(int j = ymin_u; j <= ymax_u; ++j) for(int i = xmin_u; i <= xmax_u; ++i)
+    const Vector3s base_u = fluid3d->get_origin() + Vector3s(0.0, 0.5, 0.5) * cellsize;
+    for_each_face_near_segment(x0, x1, base_u, cellsize, Vector3i(xmin_u, ymin_u, zmin_u), Vector3i(xmax_u, ymax_u, zmax_u), [&] (int i, int j, int k)
     {
       Vector3s pos = Vector3s(i*cellsize, (j+0.5)*cellsize, (k+0.5)*cellsize) + fluid3d->get_origin();
       Vector6s clipping_window;
@@ -749,7 +793,7 @@ void CylindricalShallowFlow<3>::updateToFilteredGrid(const VectorXs& x, const Ve
       
       Vector3s q0 = x0, q1 = x1;
       scalar alpha0 = 0.0, alpha1 = 1.0;
-      if(!liangbarsky::clip_line(clipping_window, q0, q1, alpha0, alpha1)) continue;
+      if(!liangbarsky::clip_line(clipping_window, q0, q1, alpha0, alpha1)) return;
       
       scalar length_segment = (q1 - q0).norm();
       
@@ -796,12 +840,13 @@ void CylindricalShallowFlow<3>::updateToFilteredGrid(const VectorXs& x, const Ve
           tmp_inter.weight = weight * w;
           tmp_inter.linear_weight = w_linear * w;
           tmp_inter.coord = cd;
-          u_edge_vel_drag.push_back(tmp_inter);
+          u_vel_drag.add(tmp_inter);
         }
       }
-    }
+    });
  
-    for(int k = zmin_v; k <= zmax_v; ++k) for(int j = ymin_v; j <= ymax_v; ++j) for(int i = xmin_v; i <= xmax_v; ++i)
+    const Vector3s base_v = fluid3d->get_origin() + Vector3s(0.5, 0.0, 0.5) * cellsize;
+    for_each_face_near_segment(x0, x1, base_v, cellsize, Vector3i(xmin_v, ymin_v, zmin_v), Vector3i(xmax_v, ymax_v, zmax_v), [&] (int i, int j, int k)
     {
       Vector3s pos = Vector3s((i+0.5)*cellsize,j*cellsize,(k+0.5)*cellsize) + fluid3d->get_origin();
       Vector6s clipping_window;
@@ -810,7 +855,7 @@ void CylindricalShallowFlow<3>::updateToFilteredGrid(const VectorXs& x, const Ve
       
       Vector3s q0 = x0, q1 = x1;
       scalar alpha0 = 0.0, alpha1 = 1.0;
-      if(!liangbarsky::clip_line(clipping_window, q0, q1, alpha0, alpha1)) continue;
+      if(!liangbarsky::clip_line(clipping_window, q0, q1, alpha0, alpha1)) return;
       
       scalar length_segment = (q1 - q0).norm();
       
@@ -858,12 +903,13 @@ void CylindricalShallowFlow<3>::updateToFilteredGrid(const VectorXs& x, const Ve
           tmp_inter.linear_weight = w_linear * w;
           tmp_inter.coord = cd;
           
-          v_edge_vel_drag.push_back(tmp_inter);
+          v_vel_drag.add(tmp_inter);
         }
       }
-    }
+    });
     
-    for(int k = zmin_w; k <= zmax_w; ++k) for(int j = ymin_w; j <= ymax_w; ++j) for(int i = xmin_w; i <= xmax_w; ++i)
+    const Vector3s base_w = fluid3d->get_origin() + Vector3s(0.5, 0.5, 0.0) * cellsize;
+    for_each_face_near_segment(x0, x1, base_w, cellsize, Vector3i(xmin_w, ymin_w, zmin_w), Vector3i(xmax_w, ymax_w, zmax_w), [&] (int i, int j, int k)
     {
       Vector3s pos = Vector3s((i+0.5)*cellsize,(j+0.5)*cellsize,k*cellsize) + fluid3d->get_origin();
       Vector6s clipping_window;
@@ -872,7 +918,7 @@ void CylindricalShallowFlow<3>::updateToFilteredGrid(const VectorXs& x, const Ve
       
       Vector3s q0 = x0, q1 = x1;
       scalar alpha0 = 0.0, alpha1 = 1.0;
-      if(!liangbarsky::clip_line(clipping_window, q0, q1, alpha0, alpha1)) continue;
+      if(!liangbarsky::clip_line(clipping_window, q0, q1, alpha0, alpha1)) return;
       
       scalar length_segment = (q1 - q0).norm();
       
@@ -920,10 +966,10 @@ void CylindricalShallowFlow<3>::updateToFilteredGrid(const VectorXs& x, const Ve
           tmp_inter.linear_weight = w_linear * w;
           tmp_inter.coord = cd;
           
-          w_edge_vel_drag.push_back(tmp_inter);
+          w_vel_drag.add(tmp_inter);
         }
       }
-    }
+    });
   }
 }
 
@@ -484,7 +484,7 @@ public:
   
   virtual void updateGeometricState(const VectorXs& x, const VectorXs& v, FluidSim* fluidsim);
   
-  virtual void updateToFilteredGrid(const VectorXs& x, const VectorXs& v, FluidSim* fluidsim, const scalar& dt, int ibuffer);
+  virtual void updateToFilteredGrid(const VectorXs& x, const VectorXs& v, FluidSim* fluidsim, const scalar& dt, int ibuffer, int ebegin, int eend);
   
   virtual void updateFromFilteredGrid(const VectorXs& x, VectorXs& v, FluidSim* fluidsim, const scalar& dt);
   
@@ -101,6 +101,8 @@ public:
   virtual const std::vector<scalar>& getStepperTimingStatistics() const = 0;
   
   virtual const std::vector<scalar>& getTimingStatistics() const = 0;
+  
+  virtual void setSolverLog( const std::string& filename ) = 0;
 };
 
 #endif
@@ -22,6 +22,8 @@
 #include <iostream>
 #include <vector>
 #include <unordered_map>
+#include <algorithm>
+#include <atomic>
 #include <tbb/tbb.h>
 #include <cmath>
 #include "MathDefs.h"
@@ -304,6 +306,90 @@ struct levelGen{
 
 	}
 
+	// Same aggregation as generateRPSparse (coarse dofs are numbered in order
+	// of first appearance), but R and P are written straight into CSR form.
+	void generateRPSparseDirect(FixedSparseMatrix<T> &R,
+		FixedSparseMatrix<T> &P,
+		vector<bool>         &pattern,
+		vector<Vector3i>		 &Dof_ijk_fine,
+		vector<Vector3i>	     &Dof_ijk_coarse,
+		int ni, int nj, int nk)
+	{
+		generatePatternSparse(Dof_ijk_fine,pattern);
+		int nni = ceil((float)ni/2.0);
+		int nnj = ceil((float)nj/2.0);
+		int nnk = ceil((float)nk/2.0);
+		unsigned int nf = Dof_ijk_fine.size();
+		vector<int> coarse_index(nni*nnj*nnk, -1);
+		vector<unsigned int> aggregate(nf);
+		Dof_ijk_coarse.resize(0);
+		for (unsigned int idx_f=0;idx_f<nf;idx_f++)
+		{
+			Vector3i ijk = Dof_ijk_fine[idx_f];
+			int coarse_i = ijk[0]/2, coarse_j = ijk[1]/2, coarse_k = ijk[2]/2;
+			unsigned int idx = coarse_i + coarse_j*nni + coarse_k*nni*nnj;
+			if(coarse_index[idx] < 0)
+			{
+				coarse_index[idx] = Dof_ijk_coarse.size();
+				Dof_ijk_coarse.push_back(Vector3i(coarse_i,coarse_j,coarse_k));
+			}
+			aggregate[idx_f] = coarse_index[idx];
+		}
+		unsigned int nc = Dof_ijk_coarse.size();
+
+		P.resize(nf);
+		P.colindex = aggregate;
+		P.value.assign(nf, (T)1.0);
+		for (unsigned int idx_f=0;idx_f<=nf;idx_f++) P.rowstart[idx_f] = idx_f;
+
+		R.resize(nc);
+		R.rowstart.assign(nc+1, 0);
+		for (unsigned int idx_f=0;idx_f<nf;idx_f++) R.rowstart[aggregate[idx_f]+1]++;
+		for (unsigned int idx_c=0;idx_c<nc;idx_c++) R.rowstart[idx_c+1] += R.rowstart[idx_c];
+		R.colindex.resize(nf);
+		R.value.assign(nf, (T)0.125);
+		vector<unsigned int> fill(R.rowstart.begin(), R.rowstart.end()-1);
+		for (unsigned int idx_f=0;idx_f<nf;idx_f++) R.colindex[fill[aggregate[idx_f]]++] = idx_f;
+	}
+
+	// Refresh the values of A_c = 0.5*R*A*P in place, keeping the sparsity
+	// of A_c. Returns false if A has a coupling not present in A_c.
+	bool refreshGalerkinNumeric(const FixedSparseMatrix<T> &A,
+		const FixedSparseMatrix<T> &R,
+		const FixedSparseMatrix<T> &P,
+		FixedSparseMatrix<T> &A_c)
+	{
+		if(R.n != A_c.n || P.n != A.n) return false;
+		std::atomic<bool> consistent(true);
+		tbb::parallel_for((unsigned int)0,(unsigned int)A_c.n,(unsigned int)1,[&](unsigned int I)
+		{
+			unsigned int rb = A_c.rowstart[I], re = A_c.rowstart[I+1];
+			for (unsigned int q=rb;q<re;++q) A_c.value[q] = 0;
+			for (unsigned int p=R.rowstart[I];p<R.rowstart[I+1];++p)
+			{
+				unsigned int f = R.colindex[p];
+				T r = R.value[p];
+				for (unsigned int q=A.rowstart[f];q<A.rowstart[f+1];++q)
+				{
+					unsigned int g = A.colindex[q];
+					for (unsigned int pp=P.rowstart[g];pp<P.rowstart[g+1];++pp)
+					{
+						unsigned int J = P.colindex[pp];
+						vector<unsigned int>::const_iterator it =
+							std::lower_bound(A_c.colindex.begin()+rb, A_c.colindex.begin()+re, J);
+						if(it == A_c.colindex.begin()+re || *it != J)
+						{
+							consistent = false;
+							continue;
+						}
+						A_c.value[it - A_c.colindex.begin()] += (T)0.5*r*A.value[q]*P.value[pp];
+					}
+				}
+			}
+		});
+		return consistent;
+	}
+
 	void generatePatternSparse
 		(vector<Vector3i>       &Dof_ijk,
 		vector<bool>         &pattern)
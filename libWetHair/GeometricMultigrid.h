@@ -0,0 +1,416 @@
+#ifndef _GMG_H_
+#define _GMG_H_
+
+//
+// This file is part of the libWetHair open source project
+//
+// Copyright 2017 Yun (Raymond) Fei, Henrique Teles Maia, Christopher Batty,
+// Changxi Zheng, and Eitan Grinspun
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <iostream>
+#include <vector>
+#include <algorithm>
+#include <tbb/tbb.h>
+#include <cmath>
+#include "MathDefs.h"
+#include "array3.h"
+#include "PipelinedCG.h"
+
+/*
+Matrix-free geometric multigrid PCG for the variable-coefficient
+7-point Poisson stencil of the pressure projection.
+
+Each level stores only the diagonal and the three "forward" face
+couplings of every cell (cx(i,j,k) couples (i,j,k) with (i+1,j,k), etc.),
+so that
+
+	(A x)(i,j,k) = diag(i,j,k) x(i,j,k)
+	             - cx(i-1,j,k) x(i-1,j,k) - cx(i,j,k) x(i+1,j,k)
+	             - cy(i,j-1,k) x(i,j-1,k) - cy(i,j,k) x(i,j+1,k)
+	             - cz(i,j,k-1) x(i,j,k-1) - cz(i,j,k) x(i,j,k+1)
+
+Coarse levels use the same piecewise-constant aggregation as the
+Galerkin hierarchy in GeometricLevelGen.h (A_c = 0.5 * R A P with
+R = P^T / 8), which for a 7-point stencil is again a 7-point stencil,
+so the whole hierarchy is built directly on the grid without ever
+assembling a matrix.
+*/
+//#define GMG_VERBOSE
+
+template<class T>
+struct PoissonGridLevel
+{
+	int ni, nj, nk;
+	unsigned int dofs;
+	Array3<T, Array1<T> >       diag;
+	Array3<T, Array1<T> >       cx, cy, cz;
+	Array3<char, Array1<char> > mask;
+
+	PoissonGridLevel()
+	: ni(0), nj(0), nk(0), dofs(0)
+	{}
+
+	void resize(int ni_, int nj_, int nk_)
+	{
+		ni = ni_; nj = nj_; nk = nk_;
+		diag.resize(ni, nj, nk);
+		cx.resize(ni, nj, nk);
+		cy.resize(ni, nj, nk);
+		cz.resize(ni, nj, nk);
+		mask.resize(ni, nj, nk);
+	}
+
+	void zero()
+	{
+		diag.assign((T) 0);
+		cx.assign((T) 0);
+		cy.assign((T) 0);
+		cz.assign((T) 0);
+		mask.assign((char) 0);
+		dofs = 0;
+	}
+
+	void count_dofs()
+	{
+		dofs = tbb::parallel_reduce(tbb::blocked_range<size_t>(0, mask.a.size()), 0U,
+			[&](const tbb::blocked_range<size_t>& rg, unsigned int cnt) -> unsigned int {
+				for(size_t idx = rg.begin(); idx != rg.end(); ++idx) cnt += (mask.a[idx] != 0);
+				return cnt;
+			}, std::plus<unsigned int>());
+	}
+
+	inline T off_diag_product(const std::vector<T>& x, int i, int j, int k) const
+	{
+		const int idx = i + ni*(j + nj*k);
+		T sum = 0;
+		if(i > 0)    sum += cx.a[idx-1]     * x[idx-1];
+		if(i < ni-1) sum += cx.a[idx]       * x[idx+1];
+		if(j > 0)    sum += cy.a[idx-ni]    * x[idx-ni];
+		if(j < nj-1) sum += cy.a[idx]       * x[idx+ni];
+		if(k > 0)    sum += cz.a[idx-ni*nj] * x[idx-ni*nj];
+		if(k < nk-1) sum += cz.a[idx]       * x[idx+ni*nj];
+		return sum;
+	}
+};
+
+template<class T>
+struct GeometricMGPCGSolver
+{
+	std::vector<PoissonGridLevel<T> > levels;
+	std::vector<std::vector<T> >      x_L, b_L, r_L;
+	std::vector<T>                    z, s, r, u, w;
+
+	int pre_smooth;
+	int post_smooth;
+	int bottom_smooth;
+	unsigned int coarsest_dofs;
+	bool pipelined; // single-reduction CG of PipelinedCG.h
+	std::vector<double> residual_history; // max-norm residual before and after every iteration of the last solve
+
+	GeometricMGPCGSolver()
+	: pre_smooth(4), post_smooth(4), bottom_smooth(200), coarsest_dofs(4096), pipelined(false)
+	{}
+
+	// returns the finest level, resized and cleared, for the caller to fill
+	PoissonGridLevel<T>& finest(int ni, int nj, int nk)
+	{
+		if(levels.empty()) levels.resize(1);
+		if(levels[0].ni != ni || levels[0].nj != nj || levels[0].nk != nk)
+			levels[0].resize(ni, nj, nk);
+		levels[0].zero();
+		return levels[0];
+	}
+
+	void coarsen(const PoissonGridLevel<T>& f, PoissonGridLevel<T>& c)
+	{
+		int nni = (f.ni + 1) / 2, nnj = (f.nj + 1) / 2, nnk = (f.nk + 1) / 2;
+		if(c.ni != nni || c.nj != nnj || c.nk != nnk) c.resize(nni, nnj, nnk);
+
+		tbb::parallel_for(0, nnk, 1, [&](int K) {
+			for(int J = 0; J < nnj; ++J) for(int I = 0; I < nni; ++I)
+			{
+				char m = 0;
+				T d = 0, ax = 0, ay = 0, az = 0;
+				for(int kk = 0; kk <= 1; ++kk) for(int jj = 0; jj <= 1; ++jj) for(int ii = 0; ii <= 1; ++ii)
+				{
+					int i = 2*I + ii, j = 2*J + jj, k = 2*K + kk;
+					if(i >= f.ni || j >= f.nj || k >= f.nk) continue;
+					if(!f.mask(i,j,k)) continue;
+					m = 1;
+					d += f.diag(i,j,k);
+					// couplings internal to the aggregate are folded into the diagonal,
+					// couplings leaving it through the forward faces become coarse couplings
+					if(i+1 < f.ni) { if(ii == 0) d -= 2*f.cx(i,j,k); else ax += f.cx(i,j,k); }
+					if(j+1 < f.nj) { if(jj == 0) d -= 2*f.cy(i,j,k); else ay += f.cy(i,j,k); }
+					if(k+1 < f.nk) { if(kk == 0) d -= 2*f.cz(i,j,k); else az += f.cz(i,j,k); }
+				}
+				c.mask(I,J,K) = m;
+				c.diag(I,J,K) = d * (T) 0.0625;
+				c.cx(I,J,K) = (I+1 < nni) ? ax * (T) 0.0625 : 0;
+				c.cy(I,J,K) = (J+1 < nnj) ? ay * (T) 0.0625 : 0;
+				c.cz(I,J,K) = (K+1 < nnk) ? az * (T) 0.0625 : 0;
+			}
+		});
+		c.count_dofs();
+	}
+
+	// builds the coarse levels from the finest one filled by the caller
+	void buildHierarchy()
+	{
+		levels[0].count_dofs();
+		int total_level = 1;
+		while(levels[total_level-1].dofs > coarsest_dofs)
+		{
+			const PoissonGridLevel<T>& f = levels[total_level-1];
+			if(f.ni == 1 && f.nj == 1 && f.nk == 1) break;
+			if((int) levels.size() <= total_level) levels.resize(total_level + 1);
+			coarsen(levels[total_level-1], levels[total_level]);
+			total_level++;
+		}
+		levels.resize(total_level);
+
+		x_L.resize(total_level);
+		b_L.resize(total_level);
+		r_L.resize(total_level);
+		for(int l = 0; l < total_level; ++l)
+		{
+			size_t num = levels[l].mask.a.size();
+			x_L[l].resize(num);
+			b_L[l].resize(num);
+			r_L[l].resize(num);
+		}
+#ifdef GMG_VERBOSE
+		std::cout << "[GMG: " << total_level << " levels, " << levels[0].dofs << " dofs]" << std::endl;
+#endif
+	}
+
+	void multiply(const PoissonGridLevel<T>& A, const std::vector<T>& x, std::vector<T>& result) const
+	{
+		tbb::parallel_for(0, A.nk, 1, [&](int k) {
+			for(int j = 0; j < A.nj; ++j) for(int i = 0; i < A.ni; ++i)
+			{
+				const int idx = i + A.ni*(j + A.nj*k);
+				result[idx] = A.mask.a[idx] ? (A.diag.a[idx] * x[idx] - A.off_diag_product(x, i, j, k)) : 0;
+			}
+		});
+	}
+
+	void RBGS(const PoissonGridLevel<T>& A, const std::vector<T>& b, std::vector<T>& x, int iternum) const
+	{
+		for(int iter = 0; iter < iternum; ++iter)
+		{
+			for(int color = 1; color >= 0; --color)
+			{
+				tbb::parallel_for(0, A.nk, 1, [&](int k) {
+					for(int j = 0; j < A.nj; ++j)
+					{
+						for(int i = (color + j + k) % 2; i < A.ni; i += 2)
+						{
+							const int idx = i + A.ni*(j + A.nj*k);
+							if(!A.mask.a[idx]) continue;
+							T diag = A.diag.a[idx];
+							if(diag != 0)
+							{
+								x[idx] = (b[idx] + A.off_diag_product(x, i, j, k)) / diag;
+							}
+							else
+							{
+								x[idx] = 0;
+							}
+						}
+					}
+				});
+			}
+		}
+	}
+
+	// b_next = R (b - A x), R = P^T / 8
+	void restriction(int l)
+	{
+		const PoissonGridLevel<T>& f = levels[l];
+		const PoissonGridLevel<T>& c = levels[l+1];
+		multiply(f, x_L[l], r_L[l]);
+		const std::vector<T>& b = b_L[l];
+		std::vector<T>& res = r_L[l];
+		std::vector<T>& bc = b_L[l+1];
+		tbb::parallel_for(0, c.nk, 1, [&](int K) {
+			for(int J = 0; J < c.nj; ++J) for(int I = 0; I < c.ni; ++I)
+			{
+				T sum = 0;
+				for(int kk = 0; kk <= 1; ++kk) for(int jj = 0; jj <= 1; ++jj) for(int ii = 0; ii <= 1; ++ii)
+				{
+					int i = 2*I + ii, j = 2*J + jj, k = 2*K + kk;
+					if(i >= f.ni || j >= f.nj || k >= f.nk) continue;
+					int idx = i + f.ni*(j + f.nj*k);
+					if(f.mask.a[idx]) sum += b[idx] - res[idx];
+				}
+				bc[I + c.ni*(J + c.nj*K)] = sum * (T) 0.125;
+			}
+		});
+	}
+
+	// x_curr += P x_next
+	void prolongation(int l)
+	{
+		const PoissonGridLevel<T>& f = levels[l];
+		const PoissonGridLevel<T>& c = levels[l+1];
+		const std::vector<T>& xc = x_L[l+1];
+		std::vector<T>& xf = x_L[l];
+		tbb::parallel_for(0, f.nk, 1, [&](int k) {
+			for(int j = 0; j < f.nj; ++j) for(int i = 0; i < f.ni; ++i)
+			{
+				int idx = i + f.ni*(j + f.nj*k);
+				if(f.mask.a[idx]) xf[idx] += xc[i/2 + c.ni*(j/2 + c.nj*(k/2))];
+			}
+		});
+	}
+
+	void VCycle(std::vector<T>& x, const std::vector<T>& b)
+	{
+		int total_level = levels.size();
+		b_L[0] = b;
+		std::fill(x_L[0].begin(), x_L[0].end(), (T) 0);
+		for(int i = 1; i < total_level; ++i)
+		{
+			std::fill(x_L[i].begin(), x_L[i].end(), (T) 0);
+		}
+
+		for(int i = 0; i < total_level-1; ++i)
+		{
+			RBGS(levels[i], b_L[i], x_L[i], pre_smooth);
+			restriction(i);
+		}
+		int i = total_level-1;
+		RBGS(levels[i], b_L[i], x_L[i], bottom_smooth);
+		for(int i = total_level-2; i >= 0; --i)
+		{
+			prolongation(i);
+			RBGS(levels[i], b_L[i], x_L[i], post_smooth);
+		}
+		x = x_L[0];
+	}
+
+	static T dot(const std::vector<T>& x, const std::vector<T>& y)
+	{
+		return tbb::parallel_reduce(tbb::blocked_range<size_t>(0, x.size()), (T) 0,
+			[&](const tbb::blocked_range<size_t>& rg, T sum) -> T {
+				for(size_t i = rg.begin(); i != rg.end(); ++i) sum += x[i] * y[i];
+				return sum;
+			}, std::plus<T>());
+	}
+
+	static T abs_max(const std::vector<T>& x)
+	{
+		return tbb::parallel_reduce(tbb::blocked_range<size_t>(0, x.size()), (T) 0,
+			[&](const tbb::blocked_range<size_t>& rg, T m) -> T {
+				for(size_t i = rg.begin(); i != rg.end(); ++i) m = std::max(m, (T) std::fabs(x[i]));
+				return m;
+			}, [](T a, T b) -> T { return std::max(a, b); });
+	}
+
+	// y += alpha * x
+	static void add_scaled(T alpha, const std::vector<T>& x, std::vector<T>& y)
+	{
+		tbb::parallel_for(tbb::blocked_range<size_t>(0, y.size()), [&](const tbb::blocked_range<size_t>& rg) {
+			for(size_t i = rg.begin(); i != rg.end(); ++i) y[i] += alpha * x[i];
+		});
+	}
+
+	// rhs and result are indexed over the whole grid of the finest level;
+	// entries outside the mask are ignored and returned as zero. With
+	// use_initial_guess the incoming result seeds the iteration, while the
+	// tolerance stays relative to the rhs.
+	bool solve(const std::vector<T>& rhs,
+		std::vector<T>& result,
+		T tolerance_factor,
+		int max_iterations,
+		T& residual_out,
+		int& iterations_out,
+		bool use_initial_guess = false)
+	{
+		const PoissonGridLevel<T>& A = levels[0];
+		size_t n = A.mask.a.size();
+		if(result.size() != n) {
+			result.resize(n);
+			use_initial_guess = false;
+		}
+		z.resize(n); s.resize(n); r.resize(n);
+
+		tbb::parallel_for(tbb::blocked_range<size_t>(0, n), [&](const tbb::blocked_range<size_t>& rg) {
+			for(size_t i = rg.begin(); i != rg.end(); ++i) {
+				r[i] = A.mask.a[i] ? rhs[i] : 0;
+				if(!use_initial_guess || !A.mask.a[i]) result[i] = 0;
+			}
+		});
+
+		residual_out = abs_max(r);
+		residual_history.assign(1, residual_out);
+		if(residual_out == 0) {
+			std::fill(result.begin(), result.end(), (T) 0);
+			iterations_out = 0;
+			return true;
+		}
+		T tol = tolerance_factor * residual_out;
+
+		if(use_initial_guess) {
+			multiply(A, result, z);
+			add_scaled((T) -1, z, r); // r = b - A*x0
+			residual_out = abs_max(r);
+			residual_history[0] = residual_out;
+			if(residual_out <= tol) {
+				iterations_out = 0;
+				return true;
+			}
+		}
+
+		if(pipelined) {
+			return pipelinedcg::solve(result, r, u, w, s, z,
+				[&](std::vector<T>& x, const std::vector<T>& b) { VCycle(x, b); },
+				[&](const std::vector<T>& x, std::vector<T>& y) { multiply(A, x, y); },
+				tol, pipelinedcg::RN_INF, max_iterations, residual_out, iterations_out, &residual_history);
+		}
+
+		VCycle(z, r);
+		T rho = dot(z, r);
+		if(rho == 0 || rho != rho) {
+			iterations_out = 0;
+			return false;
+		}
+
+		s = z;
+		int iteration;
+		for(iteration = 0; iteration < max_iterations; ++iteration) {
+			multiply(A, s, z);
+			T alpha = rho / dot(s, z);
+			add_scaled(alpha, s, result);
+			add_scaled(-alpha, z, r);
+			residual_out = abs_max(r);
+			residual_history.push_back(residual_out);
+			if(residual_out <= tol) {
+				iterations_out = iteration + 1;
+				return true;
+			}
+			VCycle(z, r);
+			T rho_new = dot(z, r);
+			T beta = rho_new / rho;
+			add_scaled(beta, s, z); s.swap(z); // s=beta*s+z
+			rho = rho_new;
+		}
+		iterations_out = iteration;
+		return false;
+	}
+};
+
+#endif
@@ -0,0 +1,432 @@
+#ifndef _GMG_2D_H_
+#define _GMG_2D_H_
+
+//
+// This file is part of the libWetHair open source project
+//
+// Copyright 2017 Yun (Raymond) Fei, Henrique Teles Maia, Christopher Batty,
+// Changxi Zheng, and Eitan Grinspun
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <iostream>
+#include <vector>
+#include <algorithm>
+#include <tbb/tbb.h>
+#include <cmath>
+#include "MathDefs.h"
+#include "array2.h"
+#include "PipelinedCG.h"
+
+/*
+Matrix-free geometric multigrid PCG for the variable-coefficient
+5-point Poisson stencil of the 2D pressure projection, the planar
+counterpart of GeometricMultigrid.h.
+
+Each level stores the diagonal and the two forward face couplings
+(cx(i,j) couples (i,j) with (i+1,j), cy(i,j) couples (i,j) with (i,j+1)),
+and the coarse levels come from 2x2 piecewise-constant aggregation with
+A_c = 0.5 * R A P, R = P^T / 4.
+
+The red-black Gauss-Seidel smoother relaxes the first color of row j and
+the second color of row j-1 in the same pass, so that one sweep reads the
+level only once. The rows are split into bands that are relaxed in
+parallel; only the second color of the first and last row of every band
+has to wait for the neighbouring bands, and is relaxed in a short second
+pass. The result is identical to relaxing all of one color and then all
+of the other. Inside a row the update is branch-free (cells that are not
+unknowns have a zero inverse diagonal and zero couplings), so the
+compiler can vectorize it.
+*/
+
+template<class T>
+struct PoissonGridLevel2D
+{
+	int ni, nj;
+	unsigned int dofs;
+	Array2<T, Array1<T> >       diag, invdiag;
+	Array2<T, Array1<T> >       cx, cy;
+	Array2<char, Array1<char> > mask;
+
+	PoissonGridLevel2D()
+	: ni(0), nj(0), dofs(0)
+	{}
+
+	void resize(int ni_, int nj_)
+	{
+		ni = ni_; nj = nj_;
+		diag.resize(ni, nj);
+		invdiag.resize(ni, nj);
+		cx.resize(ni, nj);
+		cy.resize(ni, nj);
+		mask.resize(ni, nj);
+	}
+
+	void zero()
+	{
+		diag.assign((T) 0);
+		invdiag.assign((T) 0);
+		cx.assign((T) 0);
+		cy.assign((T) 0);
+		mask.assign((char) 0);
+		dofs = 0;
+	}
+
+	// counts the unknowns and inverts the diagonal
+	void finalize()
+	{
+		dofs = tbb::parallel_reduce(tbb::blocked_range<size_t>(0, mask.a.size()), 0U,
+			[&](const tbb::blocked_range<size_t>& rg, unsigned int cnt) -> unsigned int {
+				for(size_t idx = rg.begin(); idx != rg.end(); ++idx) {
+					invdiag.a[idx] = (mask.a[idx] && diag.a[idx] != 0) ? (T) 1 / diag.a[idx] : (T) 0;
+					cnt += (mask.a[idx] != 0);
+				}
+				return cnt;
+			}, std::plus<unsigned int>());
+	}
+
+	inline T off_diag_product(const T* x, int i, int j) const
+	{
+		const int idx = i + ni*j;
+		T sum = 0;
+		if(i > 0)    sum += cx.a[idx-1]  * x[idx-1];
+		if(i < ni-1) sum += cx.a[idx]    * x[idx+1];
+		if(j > 0)    sum += cy.a[idx-ni] * x[idx-ni];
+		if(j < nj-1) sum += cy.a[idx]    * x[idx+ni];
+		return sum;
+	}
+};
+
+template<class T>
+struct GeometricMGPCGSolver2D
+{
+	std::vector<PoissonGridLevel2D<T> > levels;
+	std::vector<std::vector<T> >        x_L, b_L, r_L;
+	std::vector<T>                      z, s, r, u, w;
+
+	int pre_smooth;
+	int post_smooth;
+	int bottom_smooth;
+	unsigned int coarsest_dofs;
+	int band_rows; // rows per band of the smoother, at least 2
+	bool pipelined; // single-reduction CG of PipelinedCG.h
+	std::vector<double> residual_history; // max-norm residual before and after every iteration of the last solve
+
+	GeometricMGPCGSolver2D()
+	: pre_smooth(4), post_smooth(4), bottom_smooth(200), coarsest_dofs(1024), band_rows(16), pipelined(false)
+	{}
+
+	// returns the finest level, resized and cleared, for the caller to fill
+	PoissonGridLevel2D<T>& finest(int ni, int nj)
+	{
+		if(levels.empty()) levels.resize(1);
+		if(levels[0].ni != ni || levels[0].nj != nj)
+			levels[0].resize(ni, nj);
+		levels[0].zero();
+		return levels[0];
+	}
+
+	void coarsen(const PoissonGridLevel2D<T>& f, PoissonGridLevel2D<T>& c)
+	{
+		int nni = (f.ni + 1) / 2, nnj = (f.nj + 1) / 2;
+		if(c.ni != nni || c.nj != nnj) c.resize(nni, nnj);
+
+		tbb::parallel_for(0, nnj, 1, [&](int J) {
+			for(int I = 0; I < nni; ++I)
+			{
+				char m = 0;
+				T d = 0, ax = 0, ay = 0;
+				for(int jj = 0; jj <= 1; ++jj) for(int ii = 0; ii <= 1; ++ii)
+				{
+					int i = 2*I + ii, j = 2*J + jj;
+					if(i >= f.ni || j >= f.nj) continue;
+					if(!f.mask(i,j)) continue;
+					m = 1;
+					d += f.diag(i,j);
+					// couplings internal to the aggregate are folded into the diagonal,
+					// couplings leaving it through the forward faces become coarse couplings
+					if(i+1 < f.ni) { if(ii == 0) d -= 2*f.cx(i,j); else ax += f.cx(i,j); }
+					if(j+1 < f.nj) { if(jj == 0) d -= 2*f.cy(i,j); else ay += f.cy(i,j); }
+				}
+				c.mask(I,J) = m;
+				c.diag(I,J) = d * (T) 0.125;
+				c.cx(I,J) = (I+1 < nni) ? ax * (T) 0.125 : 0;
+				c.cy(I,J) = (J+1 < nnj) ? ay * (T) 0.125 : 0;
+			}
+		});
+		c.finalize();
+	}
+
+	// builds the coarse levels from the finest one filled by the caller
+	void buildHierarchy()
+	{
+		levels[0].finalize();
+		int total_level = 1;
+		while(levels[total_level-1].dofs > coarsest_dofs)
+		{
+			const PoissonGridLevel2D<T>& f = levels[total_level-1];
+			if(f.ni == 1 && f.nj == 1) break;
+			if((int) levels.size() <= total_level) levels.resize(total_level + 1);
+			coarsen(levels[total_level-1], levels[total_level]);
+			total_level++;
+		}
+		levels.resize(total_level);
+
+		x_L.resize(total_level);
+		b_L.resize(total_level);
+		r_L.resize(total_level);
+		for(int l = 0; l < total_level; ++l)
+		{
+			size_t num = levels[l].mask.a.size();
+			x_L[l].resize(num);
+			b_L[l].resize(num);
+			r_L[l].resize(num);
+		}
+#ifdef GMG_VERBOSE
+		std::cout << "[GMG 2D: " << total_level << " levels, " << levels[0].dofs << " dofs]" << std::endl;
+#endif
+	}
+
+	void multiply(const PoissonGridLevel2D<T>& A, const std::vector<T>& x, std::vector<T>& result) const
+	{
+		tbb::parallel_for(0, A.nj, 1, [&](int j) {
+			for(int i = 0; i < A.ni; ++i)
+			{
+				const int idx = i + A.ni*j;
+				result[idx] = A.mask.a[idx] ? (A.diag.a[idx] * x[idx] - A.off_diag_product(x.data(), i, j)) : 0;
+			}
+		});
+	}
+
+	// Gauss-Seidel update of the cells of one color ((i+j)%2 == color) in row j
+	static void relax_row(const PoissonGridLevel2D<T>& A, const T* b, T* x, int j, int color)
+	{
+		const int ni = A.ni;
+		int i = (color + j) % 2;
+		if(j == 0 || j == A.nj-1)
+		{
+			for(; i < ni; i += 2)
+			{
+				const int idx = i + ni*j;
+				x[idx] = A.invdiag.a[idx] * (b[idx] + A.off_diag_product(x, i, j));
+			}
+			return;
+		}
+		if(i == 0)
+		{
+			const int idx = ni*j;
+			x[idx] = A.invdiag.a[idx] * (b[idx] + A.off_diag_product(x, 0, j));
+			i = 2;
+		}
+		const T* invdiag = A.invdiag.a.data;
+		const T* cx = A.cx.a.data;
+		const T* cy = A.cy.a.data;
+		const int row = ni*j;
+		for(; i < ni-1; i += 2)
+		{
+			const int idx = row + i;
+			x[idx] = invdiag[idx] * (b[idx] + cx[idx-1] * x[idx-1] + cx[idx] * x[idx+1]
+			                                + cy[idx-ni] * x[idx-ni] + cy[idx] * x[idx+ni]);
+		}
+		if(i == ni-1)
+		{
+			const int idx = row + i;
+			x[idx] = invdiag[idx] * (b[idx] + A.off_diag_product(x, i, j));
+		}
+	}
+
+	void RBGS(const PoissonGridLevel2D<T>& A, const std::vector<T>& b, std::vector<T>& x, int iternum) const
+	{
+		const int rows = std::max(band_rows, 2);
+		const int num_bands = (A.nj + rows - 1) / rows;
+		const T* bb = b.data();
+		T* xx = x.data();
+		for(int iter = 0; iter < iternum; ++iter)
+		{
+			// first color of every row, second color of all rows but the first and last of each band
+			tbb::parallel_for(0, num_bands, 1, [&](int band) {
+				const int j0 = band * rows, j1 = std::min(j0 + rows, A.nj);
+				for(int j = j0; j < j1; ++j)
+				{
+					relax_row(A, bb, xx, j, 1);
+					if(j-1 > j0) relax_row(A, bb, xx, j-1, 0);
+				}
+			});
+			// second color of the band boundary rows, whose first color neighbours are now final
+			tbb::parallel_for(0, num_bands, 1, [&](int band) {
+				const int j0 = band * rows, j1 = std::min(j0 + rows, A.nj);
+				relax_row(A, bb, xx, j0, 0);
+				if(j1-1 > j0) relax_row(A, bb, xx, j1-1, 0);
+			});
+		}
+	}
+
+	// b_next = R (b - A x), R = P^T / 4
+	void restriction(int l)
+	{
+		const PoissonGridLevel2D<T>& f = levels[l];
+		const PoissonGridLevel2D<T>& c = levels[l+1];
+		multiply(f, x_L[l], r_L[l]);
+		const std::vector<T>& b = b_L[l];
+		std::vector<T>& res = r_L[l];
+		std::vector<T>& bc = b_L[l+1];
+		tbb::parallel_for(0, c.nj, 1, [&](int J) {
+			for(int I = 0; I < c.ni; ++I)
+			{
+				T sum = 0;
+				for(int jj = 0; jj <= 1; ++jj) for(int ii = 0; ii <= 1; ++ii)
+				{
+					int i = 2*I + ii, j = 2*J + jj;
+					if(i >= f.ni || j >= f.nj) continue;
+					int idx = i + f.ni*j;
+					if(f.mask.a[idx]) sum += b[idx] - res[idx];
+				}
+				bc[I + c.ni*J] = sum * (T) 0.25;
+			}
+		});
+	}
+
+	// x_curr += P x_next
+	void prolongation(int l)
+	{
+		const PoissonGridLevel2D<T>& f = levels[l];
+		const PoissonGridLevel2D<T>& c = levels[l+1];
+		const std::vector<T>& xc = x_L[l+1];
+		std::vector<T>& xf = x_L[l];
+		tbb::parallel_for(0, f.nj, 1, [&](int j) {
+			for(int i = 0; i < f.ni; ++i)
+			{
+				int idx = i + f.ni*j;
+				if(f.mask.a[idx]) xf[idx] += xc[i/2 + c.ni*(j/2)];
+			}
+		});
+	}
+
+	void VCycle(std::vector<T>& x, const std::vector<T>& b)
+	{
+		int total_level = levels.size();
+		b_L[0] = b;
+		for(int i = 0; i < total_level; ++i)
+		{
+			std::fill(x_L[i].begin(), x_L[i].end(), (T) 0);
+		}
+
+		for(int i = 0; i < total_level-1; ++i)
+		{
+			RBGS(levels[i], b_L[i], x_L[i], pre_smooth);
+			restriction(i);
+		}
+		int i = total_level-1;
+		RBGS(levels[i], b_L[i], x_L[i], bottom_smooth);
+		for(int i = total_level-2; i >= 0; --i)
+		{
+			prolongation(i);
+			RBGS(levels[i], b_L[i], x_L[i], post_smooth);
+		}
+		x = x_L[0];
+	}
+
+	static T dot(const std::vector<T>& x, const std::vector<T>& y)
+	{
+		return tbb::parallel_reduce(tbb::blocked_range<size_t>(0, x.size()), (T) 0,
+			[&](const tbb::blocked_range<size_t>& rg, T sum) -> T {
+				for(size_t i = rg.begin(); i != rg.end(); ++i) sum += x[i] * y[i];
+				return sum;
+			}, std::plus<T>());
+	}
+
+	static T abs_max(const std::vector<T>& x)
+	{
+		return tbb::parallel_reduce(tbb::blocked_range<size_t>(0, x.size()), (T) 0,
+			[&](const tbb::blocked_range<size_t>& rg, T m) -> T {
+				for(size_t i = rg.begin(); i != rg.end(); ++i) m = std::max(m, (T) std::fabs(x[i]));
+				return m;
+			}, [](T a, T b) -> T { return std::max(a, b); });
+	}
+
+	// y += alpha * x
+	static void add_scaled(T alpha, const std::vector<T>& x, std::vector<T>& y)
+	{
+		tbb::parallel_for(tbb::blocked_range<size_t>(0, y.size()), [&](const tbb::blocked_range<size_t>& rg) {
+			for(size_t i = rg.begin(); i != rg.end(); ++i) y[i] += alpha * x[i];
+		});
+	}
+
+	// rhs and result are indexed over the whole grid of the finest level;
+	// entries outside the mask are ignored and returned as zero
+	bool solve(const std::vector<T>& rhs,
+		std::vector<T>& result,
+		T tolerance_factor,
+		int max_iterations,
+		T& residual_out,
+		int& iterations_out)
+	{
+		const PoissonGridLevel2D<T>& A = levels[0];
+		size_t n = A.mask.a.size();
+		result.resize(n);
+		z.resize(n); s.resize(n); r.resize(n);
+
+		tbb::parallel_for(tbb::blocked_range<size_t>(0, n), [&](const tbb::blocked_range<size_t>& rg) {
+			for(size_t i = rg.begin(); i != rg.end(); ++i) {
+				r[i] = A.mask.a[i] ? rhs[i] : 0;
+				result[i] = 0;
+			}
+		});
+
+		residual_out = abs_max(r);
+		residual_history.assign(1, residual_out);
+		if(residual_out == 0) {
+			iterations_out = 0;
+			return true;
+		}
+		T tol = tolerance_factor * residual_out;
+
+		if(pipelined) {
+			return pipelinedcg::solve(result, r, u, w, s, z,
+				[&](std::vector<T>& x, const std::vector<T>& b) { VCycle(x, b); },
+				[&](const std::vector<T>& x, std::vector<T>& y) { multiply(A, x, y); },
+				tol, pipelinedcg::RN_INF, max_iterations, residual_out, iterations_out, &residual_history);
+		}
+
+		VCycle(z, r);
+		T rho = dot(z, r);
+		if(rho == 0 || rho != rho) {
+			iterations_out = 0;
+			return false;
+		}
+
+		s = z;
+		int iteration;
+		for(iteration = 0; iteration < max_iterations; ++iteration) {
+			multiply(A, s, z);
+			T alpha = rho / dot(s, z);
+			add_scaled(alpha, s, result);
+			add_scaled(-alpha, z, r);
+			residual_out = abs_max(r);
+			residual_history.push_back(residual_out);
+			if(residual_out <= tol) {
+				iterations_out = iteration + 1;
+				return true;
+			}
+			VCycle(z, r);
+			T rho_new = dot(z, r);
+			T beta = rho_new / rho;
+			add_scaled(beta, s, z); s.swap(z); // s=beta*s+z
+			rho = rho_new;
+		}
+		iterations_out = iteration;
+		return false;
+	}
+};
+
+#endif
@@ -179,7 +179,10 @@ public:
   
   virtual void updateGeometricState(const VectorXs& x, const VectorXs& v, FluidSim* fluidsim) = 0;
   
-  virtual void updateToFilteredGrid(const VectorXs& x, const VectorXs& v, FluidSim* fluidsim, const scalar& dt, int ibuffer) = 0;
+  // rasterizes the global edges [ebegin, eend) into buffer ibuffer of fluidsim.
+  // In 3D a flow may be split into edge ranges that go to different buffers;
+  // in 2D the buffer is the flow's own and it gets all its edges at once
+  virtual void updateToFilteredGrid(const VectorXs& x, const VectorXs& v, FluidSim* fluidsim, const scalar& dt, int ibuffer, int ebegin, int eend) = 0;
   
   virtual void updateFromFilteredGrid(const VectorXs& x, VectorXs& v, FluidSim* fluidsim, const scalar& dt) = 0;
   
@@ -0,0 +1,254 @@
+//
+// This file is part of the libWetHair open source project
+//
+// Copyright 2017 Yun (Raymond) Fei, Henrique Teles Maia, Christopher Batty,
+// Changxi Zheng, and Eitan Grinspun
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#ifndef MAC_INTERPOLATION_H
+#define MAC_INTERPOLATION_H
+
+#include "MathDefs.h"
+#include <cmath>
+
+#if defined(__AVX512F__) || defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+/*
+Batched trilinear interpolation of the staggered velocity of a MAC grid.
+
+interpolate_value and affine_interpolate_value (array3_utils.h) find the
+barycentric coordinates of one point on one grid at a time, so a G2P
+transfer computes them six times per particle. Along an axis, the grid
+normal to it is aligned with the cells and the other two are half a cell
+off, so the three grids only have two sets of coordinates per axis. They
+are computed once here, every corner is read once for both the velocity
+and the APIC affine matrix, and the arithmetic runs on packets of points:
+8 with AVX-512, 4 with AVX2 (when the compiler targets them), 1 otherwise.
+The tail of a batch always takes the one-lane path. The results are those
+of the one-point helpers, up to the contraction of multiply-adds.
+*/
+
+namespace macinterp {
+
+// one lane; the portable fallback
+struct ScalarPack
+{
+  static const int width = 1;
+  typedef bool Mask;
+
+  scalar v;
+
+  ScalarPack() {}
+  ScalarPack(scalar x) : v(x) {}
+
+  static ScalarPack load(const scalar* p) { return ScalarPack(*p); }
+  void store(scalar* p) const { *p = v; }
+};
+
+inline ScalarPack operator+(const ScalarPack& a, const ScalarPack& b) { return ScalarPack(a.v + b.v); }
+inline ScalarPack operator-(const ScalarPack& a, const ScalarPack& b) { return ScalarPack(a.v - b.v); }
+inline ScalarPack operator*(const ScalarPack& a, const ScalarPack& b) { return ScalarPack(a.v * b.v); }
+inline ScalarPack operator/(const ScalarPack& a, const ScalarPack& b) { return ScalarPack(a.v / b.v); }
+inline ScalarPack operator-(const ScalarPack& a) { return ScalarPack(-a.v); }
+inline ScalarPack floor(const ScalarPack& a) { return ScalarPack(std::floor(a.v)); }
+inline bool less(const ScalarPack& a, const ScalarPack& b) { return a.v < b.v; }
+inline bool greater(const ScalarPack& a, const ScalarPack& b) { return a.v > b.v; }
+// a where m is set, b elsewhere
+inline ScalarPack select(bool m, const ScalarPack& a, const ScalarPack& b) { return m ? a : b; }
+
+#if defined(__AVX512F__)
+
+struct SimdPack
+{
+  static const int width = 8;
+  typedef __mmask8 Mask;
+
+  __m512d v;
+
+  SimdPack() {}
+  SimdPack(__m512d x) : v(x) {}
+  SimdPack(scalar x) : v(_mm512_set1_pd(x)) {}
+
+  static SimdPack load(const scalar* p) { return SimdPack(_mm512_loadu_pd(p)); }
+  void store(scalar* p) const { _mm512_storeu_pd(p, v); }
+};
+
+inline SimdPack operator+(const SimdPack& a, const SimdPack& b) { return SimdPack(_mm512_add_pd(a.v, b.v)); }
+inline SimdPack operator-(const SimdPack& a, const SimdPack& b) { return SimdPack(_mm512_sub_pd(a.v, b.v)); }
+inline SimdPack operator*(const SimdPack& a, const SimdPack& b) { return SimdPack(_mm512_mul_pd(a.v, b.v)); }
+inline SimdPack operator/(const SimdPack& a, const SimdPack& b) { return SimdPack(_mm512_div_pd(a.v, b.v)); }
+inline SimdPack operator-(const SimdPack& a) { return SimdPack(_mm512_sub_pd(_mm512_setzero_pd(), a.v)); }
+inline SimdPack floor(const SimdPack& a) { return SimdPack(_mm512_roundscale_pd(a.v, _MM_FROUND_TO_NEG_INF | _MM_FROUND_NO_EXC)); }
+inline __mmask8 less(const SimdPack& a, const SimdPack& b) { return _mm512_cmp_pd_mask(a.v, b.v, _CMP_LT_OQ); }
+inline __mmask8 greater(const SimdPack& a, const SimdPack& b) { return _mm512_cmp_pd_mask(a.v, b.v, _CMP_GT_OQ); }
+inline SimdPack select(__mmask8 m, const SimdPack& a, const SimdPack& b) { return SimdPack(_mm512_mask_blend_pd(m, b.v, a.v)); }
+
+#elif defined(__AVX2__)
+
+struct SimdPack
+{
+  static const int width = 4;
+  typedef __m256d Mask;
+
+  __m256d v;
+
+  SimdPack() {}
+  SimdPack(__m256d x) : v(x) {}
+  SimdPack(scalar x) : v(_mm256_set1_pd(x)) {}
+
+  static SimdPack load(const scalar* p) { return SimdPack(_mm256_loadu_pd(p)); }
+  void store(scalar* p) const { _mm256_storeu_pd(p, v); }
+};
+
+inline SimdPack operator+(const SimdPack& a, const SimdPack& b) { return SimdPack(_mm256_add_pd(a.v, b.v)); }
+inline SimdPack operator-(const SimdPack& a, const SimdPack& b) { return SimdPack(_mm256_sub_pd(a.v, b.v)); }
+inline SimdPack operator*(const SimdPack& a, const SimdPack& b) { return SimdPack(_mm256_mul_pd(a.v, b.v)); }
+inline SimdPack operator/(const SimdPack& a, const SimdPack& b) { return SimdPack(_mm256_div_pd(a.v, b.v)); }
+inline SimdPack operator-(const SimdPack& a) { return SimdPack(_mm256_sub_pd(_mm256_setzero_pd(), a.v)); }
+inline SimdPack floor(const SimdPack& a) { return SimdPack(_mm256_floor_pd(a.v)); }
+inline __m256d less(const SimdPack& a, const SimdPack& b) { return _mm256_cmp_pd(a.v, b.v, _CMP_LT_OQ); }
+inline __m256d greater(const SimdPack& a, const SimdPack& b) { return _mm256_cmp_pd(a.v, b.v, _CMP_GT_OQ); }
+inline SimdPack select(__m256d m, const SimdPack& a, const SimdPack& b) { return SimdPack(_mm256_blendv_pd(b.v, a.v, m)); }
+
+#else
+
+typedef ScalarPack SimdPack;
+
+#endif
+
+template<class P>
+inline P lerp(const P& a, const P& b, const P& f)
+{
+  return (P(1.0) - f) * a + f * b;
+}
+
+// mathutils::get_barycentric on every lane, with the cell index i as a scalar
+template<class P>
+inline void get_barycentric(const P& x, int n, P& i, P& f)
+{
+  const P s = floor(x);
+  const P lo(0.0);
+  const P hi((scalar) (n - 2));
+  const typename P::Mask below = less(s, lo);
+  const typename P::Mask above = greater(s, hi);
+  i = select(below, lo, select(above, hi, s));
+  f = select(below, P(0.0), select(above, P(1.0), x - s));
+}
+
+template<class Grid>
+inline int grid_size(const Grid& grid, int axis)
+{
+  return axis == 0 ? grid.ni : (axis == 1 ? grid.nj : grid.nk);
+}
+
+/*
+Interpolates (u, v, w) at the P::width points x[0..width) of world space,
+where the u, v, w samples of cell (i, j, k) sit at origin + dx * (i, j + 1/2,
+k + 1/2), dx * (i + 1/2, j, k + 1/2) and dx * (i + 1/2, j + 1/2, k). Writes
+the velocities to vel and, unless c is NULL, the affine matrices (the
+gradient of the u component in the first column, and so on) to c.
+*/
+template<class P, class Grid>
+inline void interpolate_packet(const Grid& u, const Grid& v, const Grid& w, const Vector3s& origin, scalar dx,
+                               const Vector3s* x, Vector3s* vel, Matrix3s* c)
+{
+  const int W = P::width;
+  const Grid* grids[3] = {&u, &v, &w};
+
+  // on every axis, the coordinates on the grid normal to it (0) and on the other two (1)
+  P f[3][2];
+  int index[3][2][W];
+  for(int a = 0; a < 3; ++a) {
+    scalar coord[W];
+    for(int l = 0; l < W; ++l) coord[l] = x[l](a);
+    const P p = (P::load(coord) - P(origin(a))) / P(dx);
+
+    for(int h = 0; h < 2; ++h) {
+      P i;
+      get_barycentric(h ? p - P(0.5) : p, grid_size(*grids[h ? (a + 1) % 3 : a], a), i, f[a][h]);
+      scalar cell[W];
+      i.store(cell);
+      for(int l = 0; l < W; ++l) index[a][h][l] = (int) cell[l];
+    }
+  }
+
+  for(int g = 0; g < 3; ++g) {
+    const Grid& grid = *grids[g];
+    const int hx = g != 0, hy = g != 1, hz = g != 2;
+
+    scalar corner[8][W];
+    for(int l = 0; l < W; ++l) {
+      const int i = index[0][hx][l], j = index[1][hy][l], k = index[2][hz][l];
+      corner[0][l] = grid(i, j, k);
+      corner[1][l] = grid(i + 1, j, k);
+      corner[2][l] = grid(i, j + 1, k);
+      corner[3][l] = grid(i + 1, j + 1, k);
+      corner[4][l] = grid(i, j, k + 1);
+      corner[5][l] = grid(i + 1, j, k + 1);
+      corner[6][l] = grid(i, j + 1, k + 1);
+      corner[7][l] = grid(i + 1, j + 1, k + 1);
+    }
+
+    const P v000 = P::load(corner[0]), v100 = P::load(corner[1]), v010 = P::load(corner[2]), v110 = P::load(corner[3]);
+    const P v001 = P::load(corner[4]), v101 = P::load(corner[5]), v011 = P::load(corner[6]), v111 = P::load(corner[7]);
+    const P& fx = f[0][hx];
+    const P& fy = f[1][hy];
+    const P& fz = f[2][hz];
+
+    // mathutils::trilerp
+    const P value = lerp(lerp(lerp(v000, v100, fx), lerp(v010, v110, fx), fy),
+                         lerp(lerp(v001, v101, fx), lerp(v011, v111, fx), fy), fz);
+    scalar out[W];
+    value.store(out);
+    for(int l = 0; l < W; ++l) vel[l](g) = out[l];
+
+    if(!c) continue;
+
+    // mathutils::grad_trilerp, divided by dx
+    const P gx = fx - P(1.0), gy = fy - P(1.0), gz = fz - P(1.0);
+    const P ddx = -(gy * gz) * v000 + gy * gz * v100 + fy * gz * v010 + -(fy * gz) * v110
+                + fz * gy * v001 + -(fz * gy) * v101 + -(fy * fz) * v011 + fy * fz * v111;
+    const P ddy = -(gx * gz) * v000 + fx * gz * v100 + gx * gz * v010 + -(fx * gz) * v110
+                + fz * gx * v001 + -(fx * fz) * v101 + -(fz * gx) * v011 + fx * fz * v111;
+    const P ddz = -(gx * gy) * v000 + fx * gy * v100 + fy * gx * v010 + -(fx * fy) * v110
+                + gx * gy * v001 + -(fx * gy) * v101 + -(fy * gx) * v011 + fx * fy * v111;
+    const P* grad[3] = {&ddx, &ddy, &ddz};
+    for(int r = 0; r < 3; ++r) {
+      (*grad[r] / P(dx)).store(out);
+      for(int l = 0; l < W; ++l) c[l](r, g) = out[l];
+    }
+  }
+}
+
+// interpolate_packet over count points, in packets of SimdPack::width
+template<class Grid>
+inline void interpolate_mac(const Grid& u, const Grid& v, const Grid& w, const Vector3s& origin, scalar dx,
+                            const Vector3s* x, int count, Vector3s* vel, Matrix3s* c)
+{
+  const int W = SimdPack::width;
+  int n = 0;
+  for(; n + W <= count; n += W) {
+    interpolate_packet<SimdPack>(u, v, w, origin, dx, x + n, vel + n, c ? c + n : NULL);
+  }
+  for(; n < count; ++n) {
+    interpolate_packet<ScalarPack>(u, v, w, origin, dx, x + n, vel + n, c ? c + n : NULL);
+  }
+}
+
+};
+
+#endif
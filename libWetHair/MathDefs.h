@@ -34,6 +34,14 @@
 typedef double scalar;
 typedef unsigned long long uint64;
 
+// storage precision of the 3D fluid grids; everything computed from them is
+// still done in scalar
+#ifdef USE_SINGLE_PRECISION_GRID
+typedef float gridscalar;
+#else
+typedef double gridscalar;
+#endif
+
 struct int_scalar {
   int i;
   scalar v;
@@ -214,6 +214,12 @@ const std::vector<scalar>& ParticleSimulation<DIM>::getTimingStatistics() const
   return m_wet_hair_core->getTimingStatistics();
 }
 
+template<int DIM>
+void ParticleSimulation<DIM>::setSolverLog( const std::string& filename )
+{
+  m_wet_hair_core->setSolverLog(filename);
+}
+
 template<int DIM>
 void ParticleSimulation<DIM>::serializeScene( std::ostream& outputstream )
 {
@@ -102,6 +102,8 @@ public:
   virtual const std::vector<scalar>& getTimingStatistics() const;
   virtual const std::vector<scalar>& getStepperTimingStatistics() const;
   
+  virtual void setSolverLog( const std::string& filename );
+  
   EIGEN_MAKE_ALIGNED_OPERATOR_NEW
 private:
   WetHairCore<DIM>* m_wet_hair_core;
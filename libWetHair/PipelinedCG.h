@@ -0,0 +1,170 @@
+#ifndef _PIPELINED_CG_H_
+#define _PIPELINED_CG_H_
+
+//
+// This file is part of the libWetHair open source project
+//
+// Copyright 2017 Yun (Raymond) Fei, Henrique Teles Maia, Christopher Batty,
+// Changxi Zheng, and Eitan Grinspun
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <vector>
+#include <algorithm>
+#include <cmath>
+#include <type_traits>
+#include <tbb/tbb.h>
+
+/*
+Single-reduction preconditioned CG (Chronopoulos & Gear, 1989).
+
+The textbook PCG loop needs (s,As), (z,r) and a residual norm at three
+different points of the iteration. Here the preconditioned residual u = M r
+and w = A u are formed first, and (r,u), (w,u), (r,r) and max|r| are then
+accumulated in one pass over memory. The recurrences
+
+	p = u + beta p,  s = w + beta s,  x += alpha p,  r -= alpha s
+
+also go through memory only once. The result is the same Krylov sequence as
+standard PCG in exact arithmetic, with one global reduction per iteration
+instead of three. Convergence is tested on the reduction of the current
+iteration, so the last M and A applications are spent on a residual that is
+already small enough.
+
+Works for any vector type with size() and data() (std::vector, Eigen).
+*/
+
+namespace pipelinedcg {
+
+enum RESIDUAL_NORM
+{
+	RN_INF,
+	RN_L2
+};
+
+struct Reduction
+{
+	double ru, wu, rr, rmax;
+
+	Reduction() : ru(0), wu(0), rr(0), rmax(0) {}
+
+	Reduction operator+(const Reduction& o) const
+	{
+		Reduction s;
+		s.ru = ru + o.ru;
+		s.wu = wu + o.wu;
+		s.rr = rr + o.rr;
+		s.rmax = std::max(rmax, o.rmax);
+		return s;
+	}
+
+	double norm(RESIDUAL_NORM kind) const
+	{
+		return kind == RN_INF ? rmax : std::sqrt(rr);
+	}
+};
+
+// (r,u), (w,u), (r,r) and max|r| in one pass
+template<class T>
+Reduction fused_reduce(const T* r, const T* u, const T* w, size_t n)
+{
+	return tbb::parallel_reduce(tbb::blocked_range<size_t>(0, n), Reduction(),
+		[&](const tbb::blocked_range<size_t>& rg, Reduction red) -> Reduction {
+			for(size_t i = rg.begin(); i != rg.end(); ++i) {
+				red.ru += (double) r[i] * u[i];
+				red.wu += (double) w[i] * u[i];
+				red.rr += (double) r[i] * r[i];
+				red.rmax = std::max(red.rmax, (double) std::fabs(r[i]));
+			}
+			return red;
+		}, std::plus<Reduction>());
+}
+
+// p = u + beta p, s = w + beta s, x += alpha p, r -= alpha s; p and s are
+// overwritten on the first iteration so that they need no initialisation
+template<class T>
+void fused_update(T alpha, T beta, bool first, T* x, T* r, T* p, T* s, const T* u, const T* w, size_t n)
+{
+	tbb::parallel_for(tbb::blocked_range<size_t>(0, n), [&](const tbb::blocked_range<size_t>& rg) {
+		for(size_t i = rg.begin(); i != rg.end(); ++i) {
+			const T pi = first ? u[i] : u[i] + beta * p[i];
+			const T si = first ? w[i] : w[i] + beta * s[i];
+			p[i] = pi;
+			s[i] = si;
+			x[i] += alpha * pi;
+			r[i] -= alpha * si;
+		}
+	});
+}
+
+/*
+On entry r holds b - A x for the incoming x. u, w, p, s are workspace and are
+resized to match r. precond(u, r) computes u = M^{-1} r and apply(u, w)
+computes w = A u. If history is given, it receives the residual norm of the
+incoming x and of every iteration.
+*/
+template<class Vector, class Scalar, class Precond, class MatVec>
+bool solve(Vector& x, Vector& r, Vector& u, Vector& w, Vector& p, Vector& s,
+	Precond precond, MatVec apply,
+	Scalar tolerance, RESIDUAL_NORM norm_kind, int max_iterations,
+	Scalar& residual_out, int& iterations_out, std::vector<double>* history = NULL)
+{
+	typedef typename std::remove_reference<decltype(*r.data())>::type T;
+	const size_t n = r.size();
+	u.resize(n); w.resize(n); p.resize(n); s.resize(n);
+
+	precond(u, r);
+	apply(u, w);
+	Reduction red = fused_reduce(r.data(), u.data(), w.data(), n);
+	residual_out = (Scalar) red.norm(norm_kind);
+	if(history) history->assign(1, (double) residual_out);
+	if(residual_out <= tolerance) {
+		iterations_out = 0;
+		return true;
+	}
+
+	double gamma = red.ru;
+	if(gamma == 0 || gamma != gamma || red.wu == 0) {
+		iterations_out = 0;
+		return false;
+	}
+	double alpha = gamma / red.wu;
+	double beta = 0;
+
+	int iteration;
+	for(iteration = 0; iteration < max_iterations; ++iteration) {
+		fused_update((T) alpha, (T) beta, iteration == 0, x.data(), r.data(), p.data(), s.data(), u.data(), w.data(), n);
+
+		precond(u, r);
+		apply(u, w);
+		red = fused_reduce(r.data(), u.data(), w.data(), n);
+		residual_out = (Scalar) red.norm(norm_kind);
+		if(history) history->push_back((double) residual_out);
+		if(residual_out <= tolerance) {
+			iterations_out = iteration + 1;
+			return true;
+		}
+
+		double gamma_new = red.ru;
+		beta = gamma_new / gamma;
+		alpha = gamma_new / (red.wu - beta * gamma_new / alpha);
+		gamma = gamma_new;
+		if(alpha != alpha) break;
+	}
+	iterations_out = iteration;
+	return false;
+}
+
+};
+
+#endif
@@ -41,7 +41,7 @@ template<int DIM>
 PolygonalCohesion<DIM>::PolygonalCohesion(TwoDScene<DIM>* scene) :
 m_parent(scene), m_tree(NULL), m_sorter(NULL), m_use_decoupled_force(false), m_compute_particle_poe_mapping(true), m_min_cohesion_table(NULL), m_max_cohesion_table(NULL)
 {
-  m_sorter = new Sorter(0, 0, 0);
+  m_sorter = new HashedSorter(0, 0, 0);
   
   scalar gnorm = scene->getSimpleGravity().norm();
   gnorm = (gnorm == 0.0) ? 1000.0 : gnorm;
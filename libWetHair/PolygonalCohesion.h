@@ -223,7 +223,7 @@ class PolygonalCohesion: public Force
   VectorXs m_particle_length;
   
   nanoflann::KDTreeEigenMatrixAdaptor< MatrixXs, DIM>* m_tree;
-  Sorter* m_sorter;
+  HashedSorter* m_sorter;
   
   MatrixXs m_edge_buffer;
   
@@ -0,0 +1,123 @@
+//
+// This file is part of the libWetHair open source project
+//
+// Copyright 2017 Yun (Raymond) Fei, Henrique Teles Maia, Christopher Batty,
+// Changxi Zheng, and Eitan Grinspun
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+
+#include "SolverTelemetry.h"
+
+#include <limits>
+
+LinearSolveRecord::LinearSolveRecord()
+: size(0)
+, nonzeros(-1)
+, setup_time(0)
+, solve_time(0)
+, iterations(0)
+, residual(0)
+, converged(true)
+{}
+
+LinearSolveRecord::LinearSolveRecord(const std::string& kind_)
+: kind(kind_)
+, size(0)
+, nonzeros(-1)
+, setup_time(0)
+, solve_time(0)
+, iterations(0)
+, residual(0)
+, converged(true)
+{}
+
+void LinearSolverTelemetry::record(const LinearSolveRecord& rec)
+{
+  std::lock_guard<std::mutex> lock(m_mutex);
+  m_records.push_back(rec);
+}
+
+void LinearSolverTelemetry::clear()
+{
+  std::lock_guard<std::mutex> lock(m_mutex);
+  m_records.clear();
+}
+
+const std::vector<LinearSolveRecord>& LinearSolverTelemetry::getRecords() const
+{
+  return m_records;
+}
+
+// JSON has no representation for inf and nan
+static void write_json_number(std::ostream& os, double x)
+{
+  if(x != x || x == std::numeric_limits<double>::infinity() || x == -std::numeric_limits<double>::infinity())
+    os << "null";
+  else
+    os << x;
+}
+
+void LinearSolverTelemetry::writeJSON(std::ostream& os, int step, int substep, double time, double dt) const
+{
+  std::streamsize old_precision = os.precision(9);
+  
+  os << "{\"step\":" << step << ",\"substep\":" << substep << ",\"time\":" << time << ",\"dt\":" << dt << ",\"solves\":[";
+  for(size_t i = 0; i < m_records.size(); ++i)
+  {
+    const LinearSolveRecord& rec = m_records[i];
+    if(i > 0) os << ",";
+    os << "{\"kind\":\"" << rec.kind << "\",\"size\":" << rec.size << ",\"nonzeros\":";
+    if(rec.nonzeros < 0) os << "null";
+    else os << rec.nonzeros;
+    os << ",\"setup_time\":" << rec.setup_time << ",\"solve_time\":" << rec.solve_time
+       << ",\"iterations\":" << rec.iterations << ",\"residual\":";
+    write_json_number(os, rec.residual);
+    os << ",\"converged\":" << (rec.converged ? "true" : "false") << ",\"residual_history\":[";
+    for(size_t j = 0; j < rec.residual_history.size(); ++j)
+    {
+      if(j > 0) os << ",";
+      write_json_number(os, rec.residual_history[j]);
+    }
+    os << "]}";
+  }
+  os << "]}" << std::endl;
+  
+  os.precision(old_precision);
+}
+
+void LinearSolverTelemetry::writeCSVHeader(std::ostream& os)
+{
+  os << "step,substep,time,dt,{kind,size,nonzeros,setup_time,solve_time,iterations,residual,converged,residual_history}..." << std::endl;
+}
+
+void LinearSolverTelemetry::writeCSV(std::ostream& os, int step, int substep, double time, double dt) const
+{
+  std::streamsize old_precision = os.precision(9);
+  
+  os << step << "," << substep << "," << time << "," << dt;
+  for(const LinearSolveRecord& rec : m_records)
+  {
+    os << "," << rec.kind << "," << rec.size << "," << rec.nonzeros << "," << rec.setup_time << "," << rec.solve_time
+       << "," << rec.iterations << "," << rec.residual << "," << (rec.converged ? 1 : 0) << ",";
+    for(size_t j = 0; j < rec.residual_history.size(); ++j)
+    {
+      if(j > 0) os << " ";
+      os << rec.residual_history[j];
+    }
+  }
+  os << std::endl;
+  
+  os.precision(old_precision);
+}
@@ -0,0 +1,70 @@
+//
+// This file is part of the libWetHair open source project
+//
+// Copyright 2017 Yun (Raymond) Fei, Henrique Teles Maia, Christopher Batty,
+// Changxi Zheng, and Eitan Grinspun
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#ifndef __SOLVER_TELEMETRY_H__
+#define __SOLVER_TELEMETRY_H__
+
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// Statistics of one linear solve. Matrix-free solves report nonzeros = -1.
+struct LinearSolveRecord
+{
+  std::string kind;
+  int size;
+  long nonzeros;
+  double setup_time;
+  double solve_time;
+  int iterations;
+  double residual;
+  bool converged;
+  std::vector<double> residual_history;
+  
+  LinearSolveRecord();
+  explicit LinearSolveRecord(const std::string& kind_);
+};
+
+// Collects the linear solves of one substep, and writes them as a single
+// JSON object or CSV row per substep. Solvers may record concurrently.
+class LinearSolverTelemetry
+{
+public:
+  void record(const LinearSolveRecord& rec);
+  
+  void clear();
+  
+  const std::vector<LinearSolveRecord>& getRecords() const;
+  
+  // {"step":..,"substep":..,"time":..,"dt":..,"solves":[{...},...]}
+  void writeJSON(std::ostream& os, int step, int substep, double time, double dt) const;
+  
+  // step,substep,time,dt followed by the nine fields of every solve; the
+  // residual history is written space-separated into a single field
+  void writeCSV(std::ostream& os, int step, int substep, double time, double dt) const;
+  
+  static void writeCSVHeader(std::ostream& os);
+  
+private:
+  std::vector<LinearSolveRecord> m_records;
+  std::mutex m_mutex;
+};
+
+#endif
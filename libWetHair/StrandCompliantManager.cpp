@@ -22,6 +22,7 @@
 #include "TwoDScene.h"
 #include "ThreadUtils.h"
 #include "TimingUtilities.h"
+#include "PipelinedCG.h"
 #include <unordered_map>
 
 using namespace threadutils;
@@ -38,8 +39,8 @@ StrandCompliantManager<DIM>::~StrandCompliantManager()
 }
 
 template<int DIM>
-StrandCompliantManager<DIM>::StrandCompliantManager(TwoDScene<DIM>* scene, int max_newton, int max_iters, scalar criterion, bool compute_interhair, bool use_preconditioner)
-: m_max_num_newton(max_newton), m_max_num_iters(max_iters), m_criterion(criterion), m_scene(scene), m_compute_interhair(compute_interhair), m_use_preconditioner(use_preconditioner)
+StrandCompliantManager<DIM>::StrandCompliantManager(TwoDScene<DIM>* scene, int max_newton, int max_iters, scalar criterion, bool compute_interhair, bool use_preconditioner, bool use_pipelined_cg)
+: m_max_num_newton(max_newton), m_max_num_iters(max_iters), m_criterion(criterion), m_scene(scene), m_compute_interhair(compute_interhair), m_use_preconditioner(use_preconditioner), m_use_pipelined_cg(use_pipelined_cg)
 {
   int numhairs = scene->getNumFlows();
 
@@ -362,6 +363,8 @@ bool StrandCompliantManager<DIM>::stepSceneNonlinear( TwoDScene<DIM> & scene, sc
   scalar newton_res_norm = 0.0;
   
   for(; nkiters < m_max_num_newton; ++nkiters) {
+    double t_setup = timingutils::seconds();
+    
     std::cout << "[compute-assist-vars-local]" << std::endl;
     localUpdateNumConstraints(m_dx, m_dv, dt);
     
@@ -392,63 +395,88 @@ bool StrandCompliantManager<DIM>::stepSceneNonlinear( TwoDScene<DIM> & scene, sc
     }
  
     m_dvi.setZero();
-    // solve Mz = r
-    localPreconditionScene(scene, dt, m_z, m_r);
+    scalar cg_res_norm;
+    
+    LinearSolveRecord record(m_use_pipelined_cg ? "hair_newton_cg_pipelined" : "hair_newton_cg");
+    record.size = (int) m_r.size();
+    double t_solve = timingutils::seconds();
+    record.setup_time = t_solve - t_setup;
+    
+    if(m_use_pipelined_cg) {
+      // r = b - A * 0 is already in m_r
+      pipelinedcg::solve(m_dvi, m_r, m_z, m_t, m_p, m_q,
+                         [&] (VectorXs& z, const VectorXs& r) { localPreconditionScene(scene, dt, z, r); },
+                         [&] (const VectorXs& p, VectorXs& q) { computeAp(scene, p, q, dt); },
+                         m_criterion, pipelinedcg::RN_L2, m_max_num_iters, cg_res_norm, iter, &record.residual_history);
+    } else {
+      record.residual_history.push_back(newton_res_norm);
+      
+      // solve Mz = r
+      localPreconditionScene(scene, dt, m_z, m_r);
     
-    // p = z
-    m_p = m_z;
+      // p = z
+      m_p = m_z;
     
-    scalar rho = m_r.dot(m_z);
+      scalar rho = m_r.dot(m_z);
     
-    // q = Ap
-    computeAp(scene, m_p, m_q, dt);
+      // q = Ap
+      computeAp(scene, m_p, m_q, dt);
     
-    // alpha = rho / (p, q)
-    scalar alpha = rho / m_p.dot(m_q);
+      // alpha = rho / (p, q)
+      scalar alpha = rho / m_p.dot(m_q);
     
-    // x = x + alpha*p
-    m_dvi += m_p * alpha;
+      // x = x + alpha*p
+      m_dvi += m_p * alpha;
     
-    // r = r - alpha*q
-    m_r -= m_q * alpha;
+      // r = r - alpha*q
+      m_r -= m_q * alpha;
     
-    scalar cg_res_norm = m_r.norm();
+      cg_res_norm = m_r.norm();
+      record.residual_history.push_back(cg_res_norm);
     
-    scalar rho_old, beta;
-    for(; iter < m_max_num_iters && cg_res_norm > m_criterion; ++iter)
-    {
-      rho_old = rho;
+      scalar rho_old, beta;
+      for(; iter < m_max_num_iters && cg_res_norm > m_criterion; ++iter)
+      {
+        rho_old = rho;
       
-      // solve Mz = r
-      localPreconditionScene(scene, dt, m_z, m_r);
+        // solve Mz = r
+        localPreconditionScene(scene, dt, m_z, m_r);
       
-      rho = m_r.dot(m_z);
+        rho = m_r.dot(m_z);
       
-      beta = rho / rho_old;
+        beta = rho / rho_old;
       
-      // p = beta * p + z
-      m_p = m_z + m_p * beta;
+        // p = beta * p + z
+        m_p = m_z + m_p * beta;
       
-      // q = Ap
-      computeAp(scene, m_p, m_q, dt);
+        // q = Ap
+        computeAp(scene, m_p, m_q, dt);
       
-      // alpha = rho / (p, q)
-      alpha = rho / m_p.dot(m_q);
+        // alpha = rho / (p, q)
+        alpha = rho / m_p.dot(m_q);
       
-      // x = x + alpha*p
-      m_dvi += m_p * alpha;
+        // x = x + alpha*p
+        m_dvi += m_p * alpha;
       
-      // r = r - alpha*q
-      m_r -= m_q * alpha;
+        // r = r - alpha*q
+        m_r -= m_q * alpha;
       
-      cg_res_norm = m_r.norm();
+        cg_res_norm = m_r.norm();
+        record.residual_history.push_back(cg_res_norm);
       
 #ifdef PCG_VERBOSE
-      std::cout << "[PCG iter: " << iter << ", res: " << cg_res_norm << "]" << std::endl;
+        std::cout << "[PCG iter: " << iter << ", res: " << cg_res_norm << "]" << std::endl;
 #endif
+      }
     }
     
-    std::cout << "[PCG total iter: " << iter << ", res: " << cg_res_norm << "]" << std::endl;
+    std::cout << "[PCG " << (m_use_pipelined_cg ? "pipelined " : "") << "total iter: " << iter << ", res: " << cg_res_norm << "]" << std::endl;
+    
+    record.solve_time = timingutils::seconds() - t_solve;
+    record.iterations = iter;
+    record.residual = cg_res_norm;
+    record.converged = cg_res_norm <= m_criterion;
+    scene.recordLinearSolve(record);
     
     m_dxi = m_dvi * dt;
     
@@ -586,6 +614,9 @@ bool StrandCompliantManager<DIM>::stepSceneLinear( TwoDScene<DIM> & scene, scala
   
   t1 = timingutils::seconds();
   SceneStepper<DIM>::m_timing_statistics[3] += (t1 - t0); // compute Interhair Variables
+  
+  LinearSolveRecord record(m_use_pipelined_cg ? "hair_cg_pipelined" : "hair_cg");
+  record.setup_time = t1 - t0;
   t0 = t1;
   
   // Ap = Ax0
@@ -593,20 +624,19 @@ bool StrandCompliantManager<DIM>::stepSceneLinear( TwoDScene<DIM> & scene, scala
   // r = b - Ax0
   m_r = m_rhs - m_r;
   
-  // solve Mz = r
-  localPreconditionScene(scene, dt, m_z, m_r);
-  
-  // p = z
-  m_p = m_z;
-  
-  scalar rho = m_r.dot(m_z);
-  
   scalar res_norm = m_r.norm();
   
+  record.size = (int) m_r.size();
+  record.residual_history.push_back(res_norm);
+  
   int iter = 0;
   if(res_norm < m_criterion) {
     std::cout << "[pcg total iter: " << iter << ", res: " << res_norm << "]" << std::endl;
     
+    record.solve_time = timingutils::seconds() - t0;
+    record.residual = res_norm;
+    scene.recordLinearSolve(record);
+    
     localUpdateLambda(scene, m_dx, m_dv, dt);
     
     m_scene->storeLambda(m_lambda, m_lambda_v);
@@ -618,55 +648,78 @@ bool StrandCompliantManager<DIM>::stepSceneLinear( TwoDScene<DIM> & scene, scala
     return true;
   }
   
-  // q = Ap
-  computeAp(scene, m_p, m_q, dt);
+  if(m_use_pipelined_cg) {
+    pipelinedcg::solve(m_vplus, m_r, m_z, m_t, m_p, m_q,
+                       [&] (VectorXs& z, const VectorXs& r) { localPreconditionScene(scene, dt, z, r); },
+                       [&] (const VectorXs& p, VectorXs& q) { computeAp(scene, p, q, dt); },
+                       m_criterion, pipelinedcg::RN_L2, m_max_num_iters, res_norm, iter, &record.residual_history);
+  } else {
+    // solve Mz = r
+    localPreconditionScene(scene, dt, m_z, m_r);
+    
+    // p = z
+    m_p = m_z;
+    
+    scalar rho = m_r.dot(m_z);
+    
+    // q = Ap
+    computeAp(scene, m_p, m_q, dt);
   
-  // alpha = rho / (p, q)
-  scalar alpha = rho / m_p.dot(m_q);
+    // alpha = rho / (p, q)
+    scalar alpha = rho / m_p.dot(m_q);
   
-  // x = x + alpha*p
-  m_vplus += m_p * alpha;
+    // x = x + alpha*p
+    m_vplus += m_p * alpha;
   
-  // r = r - alpha*q
-  m_r -= m_q * alpha;
+    // r = r - alpha*q
+    m_r -= m_q * alpha;
   
-  res_norm = m_r.norm();
+    res_norm = m_r.norm();
+    record.residual_history.push_back(res_norm);
   
-  scalar rho_old, beta;
-  for(; iter < m_max_num_iters && res_norm > m_criterion; ++iter)
-  {
-    rho_old = rho;
+    scalar rho_old, beta;
+    for(; iter < m_max_num_iters && res_norm > m_criterion; ++iter)
+    {
+      rho_old = rho;
     
-    // solve Mz = r
-    localPreconditionScene(scene, dt, m_z, m_r);
+      // solve Mz = r
+      localPreconditionScene(scene, dt, m_z, m_r);
     
-    rho = m_r.dot(m_z);
+      rho = m_r.dot(m_z);
     
-    beta = rho / rho_old;
+      beta = rho / rho_old;
     
-    // p = beta * p + z
-    m_p = m_z + m_p * beta;
+      // p = beta * p + z
+      m_p = m_z + m_p * beta;
     
-    // q = Ap
-    computeAp(scene, m_p, m_q, dt);
+      // q = Ap
+      computeAp(scene, m_p, m_q, dt);
     
-    // alpha = rho / (p, q)
-    alpha = rho / m_p.dot(m_q);
+      // alpha = rho / (p, q)
+      alpha = rho / m_p.dot(m_q);
     
-    // x = x + alpha*p
-    m_vplus += m_p * alpha;
+      // x = x + alpha*p
+      m_vplus += m_p * alpha;
     
-    // r = r - alpha*q
-    m_r -= m_q * alpha;
+      // r = r - alpha*q
+      m_r -= m_q * alpha;
     
-    res_norm = m_r.norm();
+      res_norm = m_r.norm();
+      record.residual_history.push_back(res_norm);
     
 #ifdef PCG_VERBOSE
-    std::cout << "[pcg iter: " << iter << ", res: " << res_norm << "]" << std::endl;
+      std::cout << "[pcg iter: " << iter << ", res: " << res_norm << "]" << std::endl;
 #endif
+    }
   }
   
-  std::cout << "[pcg total iter: " << iter << ", res: " << res_norm << "]" << std::endl;
+  std::cout << "[pcg " << (m_use_pipelined_cg ? "pipelined " : "") << "total iter: " << iter << ", res: " << res_norm << "]" << std::endl;
+  
+  record.solve_time = timingutils::seconds() - t0;
+  record.iterations = iter;
+  record.residual = res_norm;
+  record.converged = res_norm <= m_criterion;
+  scene.recordLinearSolve(record);
   
   m_dv = m_vplus - v;
   m_dx = m_vplus * dt;
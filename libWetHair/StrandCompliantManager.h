@@ -37,7 +37,7 @@ template<int DIM>
 class StrandCompliantManager : public SceneStepper<DIM>
 {
 public:
-  StrandCompliantManager(TwoDScene<DIM>* scene, int max_newton, int max_iters, scalar criterion, bool compute_interhair, bool use_preconditioner);
+  StrandCompliantManager(TwoDScene<DIM>* scene, int max_newton, int max_iters, scalar criterion, bool compute_interhair, bool use_preconditioner, bool use_pipelined_cg = false);
   
   virtual ~StrandCompliantManager();
   
@@ -138,6 +138,7 @@ protected:
   
   bool m_compute_interhair;
   bool m_use_preconditioner;
+  bool m_use_pipelined_cg;
   
   friend class StrandCompliantEuler<DIM>;
 };
@@ -27,6 +27,7 @@
 #include "DER/StrandForce.h"
 #include "ThreadUtils.h"
 #include <iostream>
+#include <limits>
 #include <set>
 #include <stack>
 
@@ -57,9 +58,13 @@ collision_stiffness_planar(10000.0),
 damping_multiplier(0.0),
 damping_multiplier_planar(0.0),
 friction_multiplier_planar(0.35),
+cfl_number(3.0),
 hairsteps(1),
 swesteps(1),
+min_substeps(1),
+max_substeps(16),
 fluidcorrectionsteps(8),
+particle_reorder_interval(0),
 drippingnear(true),
 drippingfar(true),
 drippingmiddle(true),
@@ -72,7 +77,13 @@ use_ctcd(false),
 global_volume_control(true),
 individual_transfer(true),
 volume_summary(false),
+warm_start_pressure(false),
+amg_single_precision(false),
+pipelined_pressure_cg(false),
+scatter_p2g(true),
+adaptive_substep(false),
 mass_update_mode(MUM_MOMENTUM),
+pressure_solver_mode(PSM_AMG),
 gravity(0.0, -981.0, 0.0)
 {
 }
@@ -92,7 +103,9 @@ TwoDScene<DIM>::TwoDScene( const bool& isMassSpring )
 , m_particle_tags()
 , m_fluid_sim(NULL)
 , m_polygonal_cohesion(NULL)
+, m_solver_telemetry(NULL)
 , m_strout("log.txt")
+, m_num_flow_buffers(0)
 , m_massSpringSim( isMassSpring )
 {}
 
@@ -112,7 +125,9 @@ TwoDScene<DIM>::TwoDScene( const TwoDScene& otherscene, const bool& isMassSpring
 , m_particle_tags()
 , m_fluid_sim(NULL)
 , m_polygonal_cohesion(NULL)
+, m_solver_telemetry(NULL)
 , m_strout("log.txt")
+, m_num_flow_buffers(0)
 , m_massSpringSim( isMassSpring )
 {
   m_forces.resize(otherscene.m_forces.size());
@@ -361,12 +376,30 @@ void TwoDScene<DIM>::setFluidSim(FluidSim* sim)
   m_fluid_sim = sim;
 }
 
+template<int DIM>
+void TwoDScene<DIM>::setSolverTelemetry(LinearSolverTelemetry* telemetry)
+{
+  m_solver_telemetry = telemetry;
+}
+
+template<int DIM>
+void TwoDScene<DIM>::recordLinearSolve(const LinearSolveRecord& rec)
+{
+  if(m_solver_telemetry) m_solver_telemetry->record(rec);
+}
+
 template<int DIM>
 int TwoDScene<DIM>::getNumFlows() const
 {
   return m_flows.size();
 }
 
+template<int DIM>
+int TwoDScene<DIM>::getNumFlowBuffers() const
+{
+  return m_num_flow_buffers;
+}
+
 template<int DIM>
 const scalar& TwoDScene<DIM>::getLiquidTheta() const
 {
@@ -495,6 +528,28 @@ void TwoDScene<DIM>::updateHairFlowsToGrid(const scalar& dt)
 {
   if(!m_fluid_sim) return;
   
+  // Every flow is cut into chunks of edges, and consecutive chunks are dealt
+  // out to the buffers, which are filled in parallel. A buffer rasterizes its
+  // chunks one after another, so the sums do not depend on the scheduling.
+  // In 3D the flows are cut into chunks of 32 edges over at most 32 buffers,
+  // so that long flows are balanced over the threads together with the short
+  // ones. In 2D every flow fills the buffer of its own index and stays whole.
+  const int edges_per_chunk = (DIM == 3) ? 32 : std::numeric_limits<int>::max();
+  int nflows = m_flows.size();
+  m_flow_edge_chunks.resize(0);
+  for(int iflow = 0; iflow < nflows; ++iflow) {
+    const int ne = m_flows[iflow]->getGlobalEdges().size();
+    int ebegin = 0;
+    do {
+      const int eend = ne - ebegin > edges_per_chunk ? ebegin + edges_per_chunk : ne;
+      m_flow_edge_chunks.push_back(Vector3i(iflow, ebegin, eend));
+      ebegin = eend;
+    } while(ebegin < ne);
+  }
+  
+  const int nchunks = m_flow_edge_chunks.size();
+  m_num_flow_buffers = (DIM == 3) ? std::min(nchunks, 32) : nflows;
+  
   m_fluid_sim->prepare_update_from_hair();
   
   // update drag buffer
@@ -506,9 +561,13 @@ void TwoDScene<DIM>::updateHairFlowsToGrid(const scalar& dt)
     m_fluid_drag_buffer(i) /= m_m(i);
   }
   
-  int nflows = m_flows.size();
-  threadutils::thread_pool::ParallelFor(0, nflows, [&] (int iflow) {
-    m_flows[iflow]->updateToFilteredGrid(m_x, m_v, m_fluid_sim, dt, iflow);
+  threadutils::thread_pool::ParallelFor(0, m_num_flow_buffers, [&] (int ibuffer) {
+    const int cbegin = (int) ((int64_t) nchunks * ibuffer / m_num_flow_buffers);
+    const int cend = (int) ((int64_t) nchunks * (ibuffer + 1) / m_num_flow_buffers);
+    for(int ichunk = cbegin; ichunk < cend; ++ichunk) {
+      const Vector3i& chunk = m_flow_edge_chunks[ichunk];
+      m_flows[chunk(0)]->updateToFilteredGrid(m_x, m_v, m_fluid_sim, dt, ibuffer, chunk(1), chunk(2));
+    }
   });
   
   m_fluid_sim->done_update_from_hair();
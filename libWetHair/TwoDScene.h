@@ -29,6 +29,7 @@
 #include <fstream>
 #include "CohesionTableGen.h"
 #include "TwoDSceneSerializer.h"
+#include "SolverTelemetry.h"
 #include "DER/StrandParameters.h"
 
 template<int DIM>
@@ -106,6 +107,14 @@ enum MASS_UPDATE_MODE
   MUM_COUNT
 };
 
+enum PRESSURE_SOLVER_MODE
+{
+  PSM_AMG,
+  PSM_GEOMETRIC_MG,
+  
+  PSM_COUNT
+};
+
 struct WetHairParameter
 {
   scalar dt;
@@ -134,10 +143,14 @@ struct WetHairParameter
   scalar damping_multiplier;
   scalar damping_multiplier_planar;
   scalar friction_multiplier_planar;
+  scalar cfl_number;
   
   int hairsteps;
   int swesteps;
+  int min_substeps;
+  int max_substeps;
   int fluidcorrectionsteps;
+  int particle_reorder_interval;
   
   bool no_fluids;
   bool no_swe;
@@ -152,8 +165,14 @@ struct WetHairParameter
   bool global_volume_control;
   bool individual_transfer;
   bool volume_summary;
+  bool warm_start_pressure;
+  bool amg_single_precision;
+  bool pipelined_pressure_cg;
+  bool scatter_p2g;
+  bool adaptive_substep;
   
   MASS_UPDATE_MODE mass_update_mode;
+  PRESSURE_SOLVER_MODE pressure_solver_mode;
   Vector3s gravity;
   
   WetHairParameter();
@@ -175,6 +194,8 @@ public:
   int getNumEdges() const;
   int getNumHalfplanes() const;
   int getNumFlows() const;
+  // the number of buffers updateHairFlowsToGrid rasterizes the flows into
+  int getNumFlowBuffers() const;
   int getNumDofs() const;
 
   bool isMassSpring() const;
@@ -387,6 +408,11 @@ public:
   
   void setFluidSim(FluidSim*);
   
+  // linear solves are reported to the telemetry collector, if one is attached
+  void setSolverTelemetry(LinearSolverTelemetry* telemetry);
+  
+  void recordLinearSolve(const LinearSolveRecord& rec);
+  
   void setPolygonalCohesion(PolygonalCohesion<DIM>*);
   
   const PolygonalCohesion<DIM>* getPolygonalCohesion() const;
@@ -642,6 +668,8 @@ private:
   
   PolygonalCohesion<DIM>* m_polygonal_cohesion;
   
+  LinearSolverTelemetry* m_solver_telemetry;
+  
   std::vector<unsigned char> m_fixed;
   
   std::ofstream m_strout;
@@ -672,6 +700,10 @@ private:
   
   std::vector<HairFlow<DIM>*> m_flows;
   
+  // (flow, first edge, end edge) of the pieces updateHairFlowsToGrid rasterizes
+  std::vector<Vector3i> m_flow_edge_chunks;
+  int m_num_flow_buffers;
+  
   std::vector< std::vector<int> > m_particle_to_edge;
   
   std::vector< std::unordered_set<int> > m_bp_edge_edge_pairs;
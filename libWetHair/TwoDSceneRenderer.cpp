@@ -346,8 +346,8 @@ void TwoDSceneRenderer<DIM>::updateOpenGLRenderer(const TwoDScene<DIM>& scene, b
     m_dynamic_fluid_particles.reserve(nfp);
     for(int i = 0; i < nfp; ++i)
     {
-      if(fluid_particles[i].type == PT_LIQUID) {
-        m_dynamic_fluid_particles.push_back(Vector3f( fluid_particles[i].x(0), fluid_particles[i].x(1), fluid_particles[i].x(2) ));
+      if(fluid_particles.type[i] == PT_LIQUID) {
+        m_dynamic_fluid_particles.push_back(Vector3f( fluid_particles.x[i](0), fluid_particles.x[i](1), fluid_particles.x[i](2) ));
       }
     }
 
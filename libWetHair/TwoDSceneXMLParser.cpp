@@ -821,6 +821,16 @@ void TwoDSceneXMLParser::loadFluidSim( rapidxml::xml_node<> *node, TwoDScene<3>&
     }
   }
   
+  if( nd->first_attribute("reorderinterval") )
+  {
+    std::string attribute(nd->first_attribute("reorderinterval")->value());
+    if( !stringutils::extractFromString(attribute, twoscene.getParameter().particle_reorder_interval ) )
+    {
+      std::cerr << "\033[31;1mERROR IN XMLSCENEPARSER:\033[m Failed to parse value of reorderinterval attribute for fluidsim parameters. Value must be integer. Exiting." << std::endl;
+      exit(1);
+    }
+  }
+  
   for( rapidxml::xml_node<>* subnd = nd->first_node("boundary"); subnd; subnd = subnd->next_sibling("boundary") )
   {
     FluidSim::BOUNDARY_TYPE bt = FluidSim::BT_COUNT;
@@ -1251,6 +1261,42 @@ void TwoDSceneXMLParser::loadLiquidParameter( rapidxml::xml_node<> *node, TwoDSc
         exit(1);
       }
     }
+    
+    rapidxml::xml_attribute<>* adaptnd = nd->first_attribute("adaptivestep");
+    if(adaptnd) {
+      if( !stringutils::extractFromString(std::string(adaptnd->value()),parameter.adaptive_substep) )
+      {
+        std::cerr << "\033[31;1mERROR IN XMLSCENEPARSER:\033[m Failed to parse 'adaptivestep' attribute for integrator. Value must be boolean. Exiting." << std::endl;
+        exit(1);
+      }
+    }
+    
+    rapidxml::xml_attribute<>* cflnd = nd->first_attribute("cfl");
+    if(cflnd) {
+      if( !stringutils::extractFromString(std::string(cflnd->value()),parameter.cfl_number) || parameter.cfl_number <= 0.0 )
+      {
+        std::cerr << "\033[31;1mERROR IN XMLSCENEPARSER:\033[m Failed to parse 'cfl' attribute for integrator. Value must be positive numeric. Exiting." << std::endl;
+        exit(1);
+      }
+    }
+    
+    rapidxml::xml_attribute<>* minsnd = nd->first_attribute("minsubsteps");
+    if(minsnd) {
+      if( !stringutils::extractFromString(std::string(minsnd->value()),parameter.min_substeps) || parameter.min_substeps < 1 )
+      {
+        std::cerr << "\033[31;1mERROR IN XMLSCENEPARSER:\033[m Failed to parse 'minsubsteps' attribute for integrator. Value must be positive integer. Exiting." << std::endl;
+        exit(1);
+      }
+    }
+    
+    rapidxml::xml_attribute<>* maxsnd = nd->first_attribute("maxsubsteps");
+    if(maxsnd) {
+      if( !stringutils::extractFromString(std::string(maxsnd->value()),parameter.max_substeps) || parameter.max_substeps < parameter.min_substeps )
+      {
+        std::cerr << "\033[31;1mERROR IN XMLSCENEPARSER:\033[m Failed to parse 'maxsubsteps' attribute for integrator. Value must be integer, no less than minsubsteps. Exiting." << std::endl;
+        exit(1);
+      }
+    }
 
     
     if( nd->first_attribute("rho") )
@@ -1495,6 +1541,58 @@ void TwoDSceneXMLParser::loadLiquidParameter( rapidxml::xml_node<> *node, TwoDSc
       else if( mum == "momentum" ) parameter.mass_update_mode = MUM_MOMENTUM;
     }
     
+    timend = nd->first_attribute("warmstartpressure");
+    if( timend != NULL )
+    {
+      if( !stringutils::extractFromString(std::string(timend->value()),parameter.warm_start_pressure) )
+      {
+        std::cerr << "\033[31;1mERROR IN XMLSCENEPARSER:\033[m Failed to parse 'warmstartpressure' attribute for liquid. Value must be boolean. Exiting." << std::endl;
+        exit(1);
+      }
+    }
+    
+    timend = nd->first_attribute("amgsingleprecision");
+    if( timend != NULL )
+    {
+      if( !stringutils::extractFromString(std::string(timend->value()),parameter.amg_single_precision) )
+      {
+        std::cerr << "\033[31;1mERROR IN XMLSCENEPARSER:\033[m Failed to parse 'amgsingleprecision' attribute for liquid. Value must be boolean. Exiting." << std::endl;
+        exit(1);
+      }
+    }
+    
+    timend = nd->first_attribute("pipelinedcg");
+    if( timend != NULL )
+    {
+      if( !stringutils::extractFromString(std::string(timend->value()),parameter.pipelined_pressure_cg) )
+      {
+        std::cerr << "\033[31;1mERROR IN XMLSCENEPARSER:\033[m Failed to parse 'pipelinedcg' attribute for liquid. Value must be boolean. Exiting." << std::endl;
+        exit(1);
+      }
+    }
+    
+    timend = nd->first_attribute("scatterp2g");
+    if( timend != NULL )
+    {
+      if( !stringutils::extractFromString(std::string(timend->value()),parameter.scatter_p2g) )
+      {
+        std::cerr << "\033[31;1mERROR IN XMLSCENEPARSER:\033[m Failed to parse 'scatterp2g' attribute for liquid. Value must be boolean. Exiting." << std::endl;
+        exit(1);
+      }
+    }
+    
+    timend = nd->first_attribute("pressuresolver");
+    if( timend != NULL )
+    {
+      std::string psm = std::string(timend->value());
+      if( psm == "amg" ) parameter.pressure_solver_mode = PSM_AMG;
+      else if( psm == "gmg" ) parameter.pressure_solver_mode = PSM_GEOMETRIC_MG;
+      else {
+        std::cerr << "\033[31;1mERROR IN XMLSCENEPARSER:\033[m Failed to parse 'pressuresolver' attribute for liquid. Value must be 'amg' or 'gmg'. Exiting." << std::endl;
+        exit(1);
+      }
+    }
+    
     timend = nd->first_attribute("globalvolumecontrol");
     if( timend != NULL )
     {
@@ -2914,7 +3012,16 @@ void TwoDSceneXMLParser::loadIntegrator( rapidxml::xml_node<>* node, TwoDScene<D
         exit(1);
       }
     }
-    *scenestepper = new StrandCompliantManager<DIM>(&twodscene, max_newton, max_iters, criterion, compute_interhair, use_preconditioner);
+    dtnd = nd->first_attribute("pipelinedcg");
+    bool use_pipelined_cg = false;
+    if(dtnd) {
+      if( !stringutils::extractFromString(std::string(dtnd->value()),use_pipelined_cg) )
+      {
+        std::cerr << "\033[31;1mERROR IN XMLSCENEPARSER:\033[m Failed to parse 'pipelinedcg' attribute for integrator. Value must be boolean. Exiting." << std::endl;
+        exit(1);
+      }
+    }
+    *scenestepper = new StrandCompliantManager<DIM>(&twodscene, max_newton, max_iters, criterion, compute_interhair, use_preconditioner, use_pipelined_cg);
     twodscene.notifyGlobalIntegrator();
     twodscene.notifyFullIntegrator();
   }
@@ -32,7 +32,11 @@ WetHairCore<DIM>::WetHairCore( TwoDScene<DIM>* scene, SceneStepper<DIM>* scene_s
 , m_timing_statistics(17, 0)
 , m_current_time(0)
 , m_script_callback(std::move(script_callback))
+, m_solver_log_csv(false)
+, m_step_count(0)
+, m_total_substeps(0)
 {
+  m_scene->setSolverTelemetry(&m_solver_telemetry);
 }
 
 template<int DIM>
@@ -62,10 +66,62 @@ const std::vector<scalar>& WetHairCore<DIM>::getStepperTimingStatistics() const
 {
   return m_scene_stepper->getTimingStatistics();
 }
+
+template<int DIM>
+const LinearSolverTelemetry& WetHairCore<DIM>::getSolverTelemetry() const
+{
+  return m_solver_telemetry;
+}
+
+template<int DIM>
+void WetHairCore<DIM>::setSolverLog(const std::string& filename)
+{
+  if(m_solver_log.is_open()) m_solver_log.close();
+  
+  m_solver_log.open(filename.c_str());
+  if(!m_solver_log.is_open()) {
+    std::cerr << "Failed to open solver log " << filename << std::endl;
+    return;
+  }
+  
+  m_solver_log_csv = filename.size() >= 4 && filename.compare(filename.size() - 4, 4, ".csv") == 0;
+  if(m_solver_log_csv) LinearSolverTelemetry::writeCSVHeader(m_solver_log);
+}
 /////////////////////////////////////////////////////////////////////////////
 // Simulation Control Functions
 
-// #define USE_CFL
+template<int DIM>
+scalar WetHairCore<DIM>::computeSubstep(const scalar& remaining) const
+{
+  const scalar dt = m_scene->getDt();
+  const WetHairParameter& parameter = m_scene->getParameter();
+  
+  if(!parameter.adaptive_substep) return remaining;
+  
+  const scalar min_substep = dt / (scalar) std::max(1, parameter.max_substeps);
+  const scalar max_substep = dt / (scalar) std::max(1, parameter.min_substeps);
+  
+  scalar substep = max_substep;
+  FluidSim* fluidsim = m_scene->getFluidSim();
+  if(fluidsim && !parameter.no_fluids)
+    substep = mathutils::clamp(fluidsim->cfl() * parameter.cfl_number, min_substep, max_substep);
+  
+  // split what is left evenly into as few substeps as the CFL allows, instead
+  // of leaving a sliver for the last one. The tolerance keeps the rounding of
+  // the time already stepped from adding a substep.
+  const int nsteps = std::max(1, (int) ceil(remaining / substep - 1e-6));
+  if(nsteps == 1) return remaining;
+  
+  const scalar even = remaining / (scalar) nsteps;
+  if(even >= min_substep) return even;
+  
+  // the even split would go below the smallest substep: step by the CFL
+  // substep if that leaves at least the smallest substep, otherwise split what
+  // is left in two, or take it whole if the halves would be too small
+  if(remaining - substep >= min_substep) return substep;
+  if(remaining * 0.5 >= min_substep) return remaining * 0.5;
+  return remaining;
+}
 
 template<int DIM>
 void WetHairCore<DIM>::stepSystem()
@@ -78,15 +134,23 @@ void WetHairCore<DIM>::stepSystem()
   const WetHairParameter& parameter = m_scene->getParameter();
   
   scalar t = 0;
+  int substep_count = 0;
+  scalar min_substep = dt;
+  scalar max_substep = 0;
   
   while(t < dt) {
-#ifdef USE_CFL
-    scalar substep = sim ? (sim->cfl() * 3.0) : dt;
-#else
-    scalar substep = dt;
-#endif
-    if(t + substep > dt)
-      substep = dt - t;
+    m_solver_telemetry.clear();
+    
+    scalar substep = computeSubstep(dt - t);
+    const bool last_substep = (substep == dt - t);
+    assert( !parameter.adaptive_substep || substep >= dt / (scalar) std::max(1, parameter.max_substeps) * (1.0 - 1e-6) );
+    
+    // the hair and reduced liquid keep the step sizes they were given for a
+    // whole frame
+    const int hairsteps = parameter.adaptive_substep ?
+      std::max(1, (int) ceil(parameter.hairsteps * substep / dt - 1e-6)) : parameter.hairsteps;
+    const int swesteps = parameter.adaptive_substep ?
+      std::max(1, (int) ceil(parameter.swesteps * substep / dt - 1e-6)) : parameter.swesteps;
     
     VectorXs oldpos = m_scene->getX();
     VectorXs oldvel = m_scene->getV();
@@ -97,9 +161,9 @@ void WetHairCore<DIM>::stepSystem()
     if(m_script_callback)
       updateSDF = m_script_callback(substep);
     
-    m_scene->getFluidSim()->controlSources(m_current_time, dt);
+    m_scene->getFluidSim()->controlSources(m_current_time + t, substep);
     
-    m_scene->applyScript(dt);
+    m_scene->applyScript(substep);
     
     // 0. advect the free-flow particles (Sec. 4.2).
     if(!parameter.no_fluids) {
@@ -143,11 +207,11 @@ void WetHairCore<DIM>::stepSystem()
     if(m_scene->getNumFlows() > 0) {
       
       // 1. handle the hair dynamics (Sec. 4.1), computing the drag force using velocities sampled from the grid (Sec. 4.8), as well as the adhesive/repulsive force between hairs (Sec. 4.5).
-      scalar hairsubstep = substep / (scalar) parameter.hairsteps;
+      scalar hairsubstep = substep / (scalar) hairsteps;
       
       m_scene->updateStrandParamsTimestep( hairsubstep );
 
-      for(int i = 0; i < parameter.hairsteps; ++i) {
+      for(int i = 0; i < hairsteps; ++i) {
         std::cout << "[hair step: " << i << "]" << std::endl;
         // Step the simulated scene forward
         
@@ -191,9 +255,9 @@ void WetHairCore<DIM>::stepSystem()
         t0 = t1;
         
         if(!parameter.no_swe) {
-          for(int i = 0; i < parameter.swesteps; ++i) {
+          for(int i = 0; i < swesteps; ++i) {
 
-            scalar swesubstep = substep / (scalar) parameter.swesteps;
+            scalar swesubstep = substep / (scalar) swesteps;
             std::cout << "[advect hair flows]" << std::endl;
             m_scene->advectHairFlows(swesubstep);
             
@@ -223,7 +287,7 @@ void WetHairCore<DIM>::stepSystem()
         
         // 3. transfer the velocity of on-hair liquid onto collocated grid (Sec. 4.7).
         std::cout << "[update hair flow to grid]" << std::endl;
-        m_scene->updateHairFlowsToGrid(dt);
+        m_scene->updateHairFlowsToGrid(substep);
         
         std::cout << "[constrain hair particles]" << std::endl;
         m_scene->constrainHairParticles();
@@ -309,12 +373,29 @@ void WetHairCore<DIM>::stepSystem()
     m_scene->checkConsistency();
 #endif
 
-    t += substep;
+    if(m_solver_log.is_open()) {
+      if(m_solver_log_csv)
+        m_solver_telemetry.writeCSV(m_solver_log, m_step_count, substep_count, m_current_time + t, substep);
+      else
+        m_solver_telemetry.writeJSON(m_solver_log, m_step_count, substep_count, m_current_time + t, substep);
+    }
+    
+    min_substep = std::min(min_substep, substep);
+    max_substep = std::max(max_substep, substep);
+    ++substep_count;
     
-    //std::cout << "substep: " << substep << std::endl;
+    if(last_substep) break;
+    t += substep;
   }
   
   m_current_time += dt;
+  ++m_step_count;
+  m_total_substeps += substep_count;
+  
+  if(parameter.adaptive_substep) {
+    std::cout << "[substeps: " << substep_count << " (min " << min_substep << ", max " << max_substep
+              << "), mean " << ((scalar) m_total_substeps / (scalar) m_step_count) << " per step]" << std::endl;
+  }
   
   m_scene->addVolSummary();
 }
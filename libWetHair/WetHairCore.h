@@ -26,6 +26,9 @@
 #include "SceneStepper.h"
 #include "TwoDSceneSerializer.h"
 #include "TwoDimensionalDisplayController.h"
+#include "SolverTelemetry.h"
+
+#include <fstream>
 
 template<int DIM>
 class WetHairCore
@@ -51,8 +54,19 @@ public:
   
   virtual const scalar& getCurrentTime() const;
   
+  // linear solver statistics of the last substep
+  virtual const LinearSolverTelemetry& getSolverTelemetry() const;
+  
+  // write the linear solver statistics of every substep to filename, as CSV
+  // if it ends with .csv and as JSON lines otherwise
+  virtual void setSolverLog(const std::string& filename);
+  
   EIGEN_MAKE_ALIGNED_OPERATOR_NEW
 private:
+  // the next substep, bounded by the fluid CFL condition when the adaptive
+  // substepping is on, and by the time remaining in the step
+  scalar computeSubstep(const scalar& remaining) const;
+  
   TwoDScene<DIM>* m_scene;
   
   SceneStepper<DIM>* m_scene_stepper;
@@ -61,6 +75,12 @@ private:
   std::function<bool(double)> m_script_callback;
   
   scalar m_current_time;
+  
+  LinearSolverTelemetry m_solver_telemetry;
+  std::ofstream m_solver_log;
+  bool m_solver_log_csv;
+  int m_step_count;
+  int m_total_substeps;
 };
 
 #endif
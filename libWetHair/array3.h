@@ -277,6 +277,7 @@ struct Array3
 
 // some common arrays
 typedef Array3<scalar, Array1<scalar> > Array3s;
+typedef Array3<gridscalar, Array1<gridscalar> > Array3g;
 typedef Array3<double, Array1<double> > Array3d;
 typedef Array3<float, Array1<float> > Array3f;
 typedef Array3<long long, Array1<long long> > Array3ll;
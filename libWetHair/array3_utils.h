@@ -23,8 +23,11 @@
 #include "array3.h"
 #include "MathUtilities.h"
 
-template<class S, class T>
-T interpolate_value(const Eigen::Matrix<S, 3, 1>& point, const Array3<T, Array1<T> >& grid) {
+// The helpers below that take a single grid accept any grid with ni, nj, nk
+// and (i,j,k) access, i.e. Array3 as well as SparseArray3.
+
+template<class S, class Grid>
+typename Grid::value_type interpolate_value(const Eigen::Matrix<S, 3, 1>& point, const Grid& grid) {
    int i,j,k;
    S fi,fj,fk;
 
@@ -59,8 +62,8 @@ T interpolate_value(const Eigen::Matrix<S, 3, 1>& point, const std::vector<T>& g
                  fi,fj,fk);
 }
 
-template<class T>
-Eigen::Matrix<T, 3, 1> affine_interpolate_value(const Eigen::Matrix<T, 3, 1>& point, const Array3<T, Array1<T> >& grid) {
+template<class T, class Grid>
+Eigen::Matrix<T, 3, 1> affine_interpolate_value(const Eigen::Matrix<T, 3, 1>& point, const Grid& grid) {
   int i,j,k;
   T fx,fy,fz;
   
@@ -76,8 +79,8 @@ Eigen::Matrix<T, 3, 1> affine_interpolate_value(const Eigen::Matrix<T, 3, 1>& po
                      fx, fy, fz);
 }
 
-template<class S,class T>
-T interpolate_gradient(Eigen::Matrix<T, 3, 1>& gradient, const Eigen::Matrix<S, 3, 1>& point, const Array3<T, Array1<T> >& grid) {
+template<class S,class T,class Grid>
+T interpolate_gradient(Eigen::Matrix<T, 3, 1>& gradient, const Eigen::Matrix<S, 3, 1>& point, const Grid& grid) {
    int i,j,k;
    S fx,fy,fz;
    
@@ -126,8 +129,8 @@ T interpolate_gradient(Eigen::Matrix<T, 3, 1>& gradient, const Eigen::Matrix<S,
 }
 
 
-template<class S,class T>
-void interpolate_gradient(Eigen::Matrix<T, 3, 1>& gradient, const Eigen::Matrix<S, 3, 1>& point, const Array3<T, Array1<T> >& grid, S cellSize) {
+template<class S,class T,class Grid>
+void interpolate_gradient(Eigen::Matrix<T, 3, 1>& gradient, const Eigen::Matrix<S, 3, 1>& point, const Grid& grid, S cellSize) {
   int i,j,k;
   S fx,fy,fz;
   
@@ -209,8 +212,8 @@ void interpolate_gradient(Eigen::Matrix<T, 3, 1>& gradient, const Eigen::Matrix<
   gradient[2] = dv_dz / cellSize;
 }
 
-template<typename S, typename T>
-void interpolate_hessian(Eigen::Matrix<S, 3, 3>& hessian, const Eigen::Matrix<S, 3, 1>& point, const Array3<T, Array1<T> >& grid, S cellSize) {
+template<typename S, typename Grid>
+void interpolate_hessian(Eigen::Matrix<S, 3, 3>& hessian, const Eigen::Matrix<S, 3, 1>& point, const Grid& grid, S cellSize) {
   Eigen::Matrix<S, 3, 1> gx0;
   Eigen::Matrix<S, 3, 1> gx1;
   Eigen::Matrix<S, 3, 1> gy0;
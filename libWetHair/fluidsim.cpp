@@ -21,6 +21,9 @@
 #include "TwoDScene.h"
 #include "fluidsim2D.h"
 #include "fluidsim3D.h"
+#include "ThreadUtils.h"
+
+#include <numeric>
 
 inline scalar circle_phi(const Vector2s& position, const Vector2s& centre, scalar radius) {
   return ((position-centre).norm() - radius);
@@ -323,6 +326,42 @@ size_t FluidSim::SolidBoundary<DIM>::size() const
 {
   return (DIM + DIM + 4 + 3 + DIM) * sizeof(scalar);
 }
+
+template<int DIM>
+bool FluidSim::SolidBoundary<DIM>::bounds(const scalar& band, Vectors<DIM>& lo, Vectors<DIM>& hi) const
+{
+  // the solid is everything outside of the shape
+  if(sign < 0.0) return false;
+  
+  // the half extents of the shape along its own axes, before rounding
+  Vector3s extent = Vector3s::Zero();
+  scalar radius = 0.0;
+  switch (Boundary<DIM>::type) {
+    case BT_BOX:
+      extent = Vector3s(parameter(0), parameter(1), DIM == 3 ? parameter(2) : 0.0);
+      radius = parameter(3);
+      break;
+    case BT_CIRCLE:
+      radius = parameter(0);
+      break;
+    case BT_CAPSULE:
+      extent(0) = parameter(1);
+      radius = parameter(0);
+      break;
+    default:
+      return false;
+  }
+  
+  // in 2D the rotation axis need not be normal to the plane, so take the bounding circle
+  Vector3s half;
+  if(DIM == 3) half = rot.toRotationMatrix().cwiseAbs() * extent;
+  else half.setConstant(extent.norm());
+  half.array() += radius + band;
+  
+  lo = center - half.segment<DIM>(0);
+  hi = center + half.segment<DIM>(0);
+  return true;
+}
 template<int DIM>
 FluidSim::OperatorBoundary<DIM>::OperatorBoundary(BOUNDARY_TYPE type_)
 : Boundary<DIM>(type_)
@@ -382,6 +421,37 @@ scalar FluidSim::OperatorBoundary<DIM>::compute_phi_vel(const Vectors<DIM>& pos,
   }
 }
 
+template<int DIM>
+bool FluidSim::OperatorBoundary<DIM>::bounds(const scalar& band, Vectors<DIM>& lo, Vectors<DIM>& hi) const
+{
+  if(Boundary<DIM>::type != BT_UNION && Boundary<DIM>::type != BT_INTERSECT) return false;
+  
+  bool bounded = false;
+  for(const Boundary<DIM>* child : children)
+  {
+    Vectors<DIM> child_lo, child_hi;
+    if(!child->bounds(band, child_lo, child_hi)) {
+      // the union is near every child, the intersection only near all of them
+      if(Boundary<DIM>::type == BT_UNION) return false;
+      continue;
+    }
+    
+    if(!bounded) {
+      lo = child_lo;
+      hi = child_hi;
+    } else if(Boundary<DIM>::type == BT_UNION) {
+      lo = lo.cwiseMin(child_lo);
+      hi = hi.cwiseMax(child_hi);
+    } else {
+      lo = lo.cwiseMax(child_lo);
+      hi = hi.cwiseMin(child_hi);
+    }
+    bounded = true;
+  }
+  
+  return bounded;
+}
+
 template<int DIM>
 void FluidSim::OperatorBoundary<DIM>::write(std::vector<scalar>& buf) const
 {
@@ -507,6 +577,210 @@ size_t Particle<DIM>::size()
   return s;
 }
 
+template<int DIM>
+void ParticleStore<DIM>::clear()
+{
+  resize(0);
+}
+
+template<int DIM>
+void ParticleStore<DIM>::reserve(size_t n)
+{
+  x.reserve(n);
+  v.reserve(n);
+  buf0.reserve(n);
+  buf1.reserve(n);
+  buf2.reserve(n);
+  c.reserve(n);
+  radii.reserve(n);
+  fresh.reserve(n);
+  pressure.reserve(n);
+  edge_alpha.reserve(n);
+  type.reserve(n);
+  edge_idx.reserve(n);
+  deceased.reserve(n);
+}
+
+template<int DIM>
+void ParticleStore<DIM>::resize(size_t n)
+{
+  x.resize(n, Vectors<DIM>::Zero());
+  v.resize(n, Vectors<DIM>::Zero());
+  buf0.resize(n, Vectors<DIM>::Zero());
+  buf1.resize(n, Vectors<DIM>::Zero());
+  buf2.resize(n, Matrixs<DIM>::Zero());
+  c.resize(n, Matrixs<DIM>::Zero());
+  radii.resize(n, 0.0);
+  fresh.resize(n, 1.0);
+  pressure.resize(n, 0.0);
+  edge_alpha.resize(n, 0.0);
+  type.resize(n, PT_LIQUID);
+  edge_idx.resize(n, -1);
+  deceased.resize(n, 0);
+  clear_bridges();
+}
+
+template<int DIM>
+void ParticleStore<DIM>::push_back(const Particle<DIM>& p)
+{
+  x.push_back(p.x);
+  v.push_back(p.v);
+  buf0.push_back(p.buf0);
+  buf1.push_back(p.buf1);
+  buf2.push_back(p.buf2);
+  c.push_back(p.c);
+  radii.push_back(p.radii);
+  fresh.push_back(p.fresh);
+  pressure.push_back(p.pressure);
+  edge_alpha.push_back(p.edge_alpha);
+  type.push_back(p.type);
+  edge_idx.push_back(p.edge_idx);
+  deceased.push_back(p.deceased);
+  if(!bridge_offsets.empty()) bridge_offsets.push_back(bridge_offsets.back());
+}
+
+template<int DIM>
+void ParticleStore<DIM>::append(const std::vector< Particle<DIM> >& ps)
+{
+  reserve(size() + ps.size());
+  for(const Particle<DIM>& p : ps) push_back(p);
+}
+
+template<int DIM>
+Particle<DIM> ParticleStore<DIM>::get(int i) const
+{
+  Particle<DIM> p(x[i], v[i], radii[i], type[i], edge_idx[i], edge_alpha[i]);
+  p.buf0 = buf0[i];
+  p.buf1 = buf1[i];
+  p.buf2 = buf2[i];
+  p.c = c[i];
+  p.fresh = fresh[i];
+  p.pressure = pressure[i];
+  p.deceased = deceased[i] != 0;
+  p.bridges.assign(bridges(i), bridges(i) + num_bridges(i));
+  return p;
+}
+
+template<int DIM>
+void ParticleStore<DIM>::set(int i, const Particle<DIM>& p)
+{
+  x[i] = p.x;
+  v[i] = p.v;
+  buf0[i] = p.buf0;
+  buf1[i] = p.buf1;
+  buf2[i] = p.buf2;
+  c[i] = p.c;
+  radii[i] = p.radii;
+  fresh[i] = p.fresh;
+  pressure[i] = p.pressure;
+  edge_alpha[i] = p.edge_alpha;
+  type[i] = p.type;
+  edge_idx[i] = p.edge_idx;
+  deceased[i] = p.deceased;
+}
+
+template<int DIM>
+void ParticleStore<DIM>::set_bridges(const std::vector<int>& bridge_particle)
+{
+  const int np = (int) size();
+  const int nb = (int) bridge_particle.size();
+  bridge_offsets.assign(np + 1, 0);
+  for(int b = 0; b < nb; ++b) ++bridge_offsets[bridge_particle[b] + 1];
+  std::partial_sum(bridge_offsets.begin(), bridge_offsets.end(), bridge_offsets.begin());
+  
+  bridge_indices.resize(nb);
+  std::vector<int> next(bridge_offsets.begin(), bridge_offsets.end() - 1);
+  for(int b = 0; b < nb; ++b) bridge_indices[next[bridge_particle[b]]++] = b;
+}
+
+template<int DIM>
+void ParticleStore<DIM>::clear_bridges()
+{
+  bridge_offsets.clear();
+  bridge_indices.clear();
+}
+
+template<typename T>
+static void gather_array(std::vector<T>& a, const std::vector<int>& order)
+{
+  std::vector<T> gathered(order.size());
+  threadutils::thread_pool::ParallelFor(0, (int) order.size(), [&] (int n) {
+    gathered[n] = a[order[n]];
+  });
+  a.swap(gathered);
+}
+
+template<int DIM>
+void ParticleStore<DIM>::permute(const std::vector<int>& order)
+{
+  if(!bridge_offsets.empty()) {
+    const int np = (int) order.size();
+    std::vector<int> offsets(np + 1, 0);
+    for(int n = 0; n < np; ++n) offsets[n + 1] = offsets[n] + num_bridges(order[n]);
+    std::vector<int> indices(offsets[np]);
+    threadutils::thread_pool::ParallelFor(0, np, [&] (int n) {
+      std::copy(bridges(order[n]), bridges(order[n]) + num_bridges(order[n]), indices.begin() + offsets[n]);
+    });
+    bridge_offsets.swap(offsets);
+    bridge_indices.swap(indices);
+  }
+  
+  gather_array(x, order);
+  gather_array(v, order);
+  gather_array(buf0, order);
+  gather_array(buf1, order);
+  gather_array(buf2, order);
+  gather_array(c, order);
+  gather_array(radii, order);
+  gather_array(fresh, order);
+  gather_array(pressure, order);
+  gather_array(edge_alpha, order);
+  gather_array(type, order);
+  gather_array(edge_idx, order);
+  gather_array(deceased, order);
+}
+
+template<int DIM>
+void ParticleStore<DIM>::write(int i, std::vector<scalar>& buf) const
+{
+  buf.push_back(radii[i]);
+  for(int r = 0; r < DIM; ++r)
+  {
+    buf.push_back(x[i](r));
+  }
+  for(int r = 0; r < DIM; ++r)
+  {
+    buf.push_back(v[i](r));
+  }
+  for(int r = 0; r < DIM; ++r)
+  {
+    for(int s = 0; s < DIM; ++s) {
+      buf.push_back(c[i](r, s));
+    }
+  }
+}
+
+template<int DIM>
+void ParticleStore<DIM>::read(int i, const scalar* data)
+{
+  int k = 0;
+  radii[i] = data[k++];
+  for(int r = 0; r < DIM; ++r)
+  {
+    x[i](r) = data[k++];
+  }
+  for(int r = 0; r < DIM; ++r)
+  {
+    v[i](r) = data[k++];
+  }
+  for(int r = 0; r < DIM; ++r)
+  {
+    for(int s = 0; s < DIM; ++s) {
+      c[i](r, s) = data[k++];
+    }
+  }
+}
+
 // explicit instantiations at bottom
 template struct FluidSim::Boundary<2>;
 template struct FluidSim::Boundary<3>;
@@ -523,6 +797,9 @@ template struct FluidSim::SourceBoundary<3>;
 template struct Particle<2>;
 template struct Particle<3>;
 
+template struct ParticleStore<2>;
+template struct ParticleStore<3>;
+
 template struct EdgeVelDragIntersection<2>;
 template struct EdgeVelDragIntersection<3>;
 
@@ -82,6 +82,85 @@ struct Particle
   EIGEN_MAKE_ALIGNED_OPERATOR_NEW
 };
 
+/*
+Particles stored as a structure of arrays: particle i is x[i], v[i], ... so
+that a loop over positions or velocities reads only those. The bridges of
+particle i are bridge_indices[bridge_offsets[i] .. bridge_offsets[i + 1])
+(empty for all particles when bridge_offsets is empty).
+*/
+template<int DIM>
+struct ParticleStore
+{
+  std::vector< Vectors<DIM> > x;
+  std::vector< Vectors<DIM> > v;
+  
+  std::vector< Vectors<DIM> > buf0;
+  std::vector< Vectors<DIM> > buf1;
+  std::vector< Matrixs<DIM> > buf2;
+  
+  std::vector< Matrixs<DIM> > c;
+  
+  std::vector<scalar> radii;
+  std::vector<scalar> fresh;
+  std::vector<scalar> pressure;
+  std::vector<scalar> edge_alpha;
+  
+  std::vector<ParticleType> type;
+  
+  // for hair particles
+  std::vector<int> edge_idx;
+  std::vector<unsigned char> deceased;
+  
+  std::vector<int> bridge_offsets;
+  std::vector<int> bridge_indices;
+  
+  size_t size() const { return x.size(); }
+  bool empty() const { return x.empty(); }
+  
+  void clear();
+  void reserve(size_t n);
+  // new particles are default constructed Particle<DIM>s
+  void resize(size_t n);
+  
+  void push_back(const Particle<DIM>& p);
+  void append(const std::vector< Particle<DIM> >& ps);
+  
+  Particle<DIM> get(int i) const;
+  void set(int i, const Particle<DIM>& p);
+  
+  int num_bridges(int i) const
+  { return bridge_offsets.empty() ? 0 : bridge_offsets[i + 1] - bridge_offsets[i]; }
+  
+  const int* bridges(int i) const
+  { return bridge_offsets.empty() ? NULL : bridge_indices.data() + bridge_offsets[i]; }
+  
+  // builds the bridge table from the particle of each bridge; the bridges of
+  // a particle are listed in increasing order
+  void set_bridges(const std::vector<int>& bridge_particle);
+  void clear_bridges();
+  
+  // keeps the particles order[0], order[1], ... in this order
+  void permute(const std::vector<int>& order);
+  
+  // removes the particles i with pred(i) and keeps the order of the others;
+  // pred is called once per particle, in order
+  template<typename Pred>
+  void remove_if(Pred pred)
+  {
+    const int np = (int) size();
+    std::vector<int> kept;
+    kept.reserve(np);
+    for(int i = 0; i < np; ++i) {
+      if(!pred(i)) kept.push_back(i);
+    }
+    if((int) kept.size() != np) permute(kept);
+  }
+  
+  // the same layout as Particle<DIM>::write and read
+  void write(int i, std::vector<scalar>&) const;
+  void read(int i, const scalar* data);
+};
+
 template<int DIM>
 struct EdgeVelDragIntersection
 {
@@ -127,6 +206,9 @@ public:
     
     virtual void advance(const scalar& dt) = 0;
     virtual scalar compute_phi_vel(const Vectors<DIM>& pos, Vectors<DIM>& vel) const = 0;
+    // an axis-aligned box [lo, hi] outside of which compute_phi_vel is at
+    // least band; returns false if there is none
+    virtual bool bounds(const scalar& band, Vectors<DIM>& lo, Vectors<DIM>& hi) const = 0;
     virtual void write(std::vector<scalar>&) const = 0;
     virtual void read(const scalar* data) = 0;
     virtual size_t size() const = 0;
@@ -147,6 +229,7 @@ public:
     
     virtual void advance(const scalar& dt);
     virtual scalar compute_phi_vel(const Vectors<DIM>& pos, Vectors<DIM>& vel) const;
+    virtual bool bounds(const scalar& band, Vectors<DIM>& lo, Vectors<DIM>& hi) const;
     virtual void write(std::vector<scalar>&) const;
     virtual void read(const scalar* data);
     virtual size_t size() const;
@@ -160,6 +243,7 @@ public:
     SolidBoundary(const Vectors<DIM>& center_, const VectorXs& parameter_, BOUNDARY_TYPE type_, bool inside, const Vector3s& raxis, const scalar& rangle);
     virtual void advance(const scalar& dt);
     virtual scalar compute_phi_vel(const Vectors<DIM>& pos, Vectors<DIM>& vel) const;
+    virtual bool bounds(const scalar& band, Vectors<DIM>& lo, Vectors<DIM>& hi) const;
     
     Vectors<DIM> center;
     VectorXs parameter;
@@ -21,6 +21,7 @@
 #include "MathUtilities.h"
 #include "ThreadUtils.h"
 #include "FluidDragForce.h"
+#include "TimingUtilities.h"
 
 #include "array2_utils.h"
 
@@ -41,21 +42,28 @@ const static int MAX_BRIDGE_PER_EDGE = 64;
 
 void extrapolate(Array2s& grid, Array2s& old_grid, const Array2s& grid_weight, const Array2s& grid_liquid_weight, Array2c& valid, Array2c old_valid, const Vector2i& offset);
 
-FluidSim2D* g_fluid2d_iptr = NULL;
-
-static void sorter_callback(int pidx, int& i, int& j, int& k)
+//Maps a particle to its cell for the sorter. Bound to one simulation instead of
+//a global pointer, so that several simulations can sort at the same time.
+struct sorter_callback
 {
-  auto& particles = g_fluid2d_iptr->get_particles();
-  
-  auto& p = particles[pidx];
+  const FluidSim2D* fluid;
   
-  int pi = (int)((p.x(0) - g_fluid2d_iptr->get_origin()(0)) / g_fluid2d_iptr->cellsize());
-  int pj = (int)((p.x(1) - g_fluid2d_iptr->get_origin()(1)) / g_fluid2d_iptr->cellsize());
+  explicit sorter_callback(const FluidSim2D* fluid_) : fluid(fluid_) {}
   
-  i = max(0, min(g_fluid2d_iptr->get_ni()-1, pi));
-  j = max(0, min(g_fluid2d_iptr->get_ni()-1, pj));
-  k = 0;
-}
+  void operator()(int pidx, int& i, int& j, int& k) const
+  {
+    auto& particles = fluid->get_particles();
+    
+    auto& p = particles[pidx];
+    
+    int pi = (int)((p.x(0) - fluid->get_origin()(0)) / fluid->cellsize());
+    int pj = (int)((p.x(1) - fluid->get_origin()(1)) / fluid->cellsize());
+    
+    i = max(0, min(fluid->get_ni()-1, pi));
+    j = max(0, min(fluid->get_ni()-1, pj));
+    k = 0;
+  }
+};
 
 FluidSim2D::~FluidSim2D()
 {
@@ -71,7 +79,6 @@ FluidSim2D::FluidSim2D(const Vector2s& origin_,
                        TwoDScene<2>* scene)
 : m_parent(scene)
 {
-  g_fluid2d_iptr = this;
   ryoichi_correction_counter = 0;
   origin = origin_;
   boundaries = boundaries_;
@@ -454,7 +461,7 @@ void FluidSim2D::transferLiquidToGridParticle(const scalar& dt)
 
 void FluidSim2D::shareParticleWithHairs( VectorXs& x, scalar dt )
 {
-  m_sorter->sort(particles.size(), sorter_callback);
+  m_sorter->sort(particles.size(), sorter_callback(this));
   
   std::vector<HairFlow<2>*>& hairs = m_parent->getFilmFlows();
   // build bridges
@@ -790,7 +797,7 @@ void FluidSim2D::shareParticleWithHairs( VectorXs& x, scalar dt )
     return p.type == PT_LIQUID && p.radii <= 1e-7;
   }), particles.end());
   
-  m_sorter->sort(particles.size(), sorter_callback);
+  m_sorter->sort(particles.size(), sorter_callback(this));
 }
 
 void FluidSim2D::resample(Vector2s& p, Vector2s& u, Matrix2s& c)
@@ -878,7 +885,7 @@ void FluidSim2D::correct(scalar dt)
     return p.deceased;
   }), particles.end());
   
-  m_sorter->sort(particles.size(), sorter_callback);
+  m_sorter->sort(particles.size(), sorter_callback(this));
   std::cout << particles.size() << ">\n";
 #endif
   scalar coeff = sqrt(ni * nj);
@@ -957,7 +964,7 @@ void FluidSim2D::correct(scalar dt)
     p.c = p.buf2;
   });
   
-  m_sorter->sort(particles.size(), sorter_callback);
+  m_sorter->sort(particles.size(), sorter_callback(this));
   
   ryoichi_correction_counter++;
 }
@@ -1160,7 +1167,7 @@ void FluidSim2D::constrain_hair_particles()
     }
   });
   
-  m_sorter->sort(particles.size(), sorter_callback);
+  m_sorter->sort(particles.size(), sorter_callback(this));
 }
 
 
@@ -1348,11 +1355,15 @@ void FluidSim2D::compute_weights() {
   
 }
 
-//An implementation of the variational pressure projection solve for static geometry
-void FluidSim2D::solve_pressure(scalar dt) {
+//Assemble the pressure system as a sparse matrix and solve it with Robert Bridson's
+//incomplete Cholesky PCG solver
+bool FluidSim2D::solve_pressure_pcg(scalar dt, LinearSolveRecord& record) {
   //This linear system could be simplified, but I've left it as is for clarity
   //and consistency with the standard naive discretization
   
+  record.kind = "pressure_mic";
+  double t0 = timingutils::seconds();
+  
   int ni = v.ni;
   int nj = u.nj;
   int system_size = ni*nj;
@@ -1438,54 +1449,134 @@ void FluidSim2D::solve_pressure(scalar dt) {
     }
   }
   
+  record.size = system_size;
+  record.nonzeros = 0;
+  for(int i = 0; i < system_size; ++i)
+    record.nonzeros += matrix.index[i].size();
+  record.setup_time = timingutils::seconds() - t0;
+  t0 = timingutils::seconds();
+  
   //Solve the system using Robert Bridson's incomplete Cholesky PCG solver
   
   scalar tolerance;
   int iterations;
   bool success = solver.solve(matrix, rhs, pressure, tolerance, iterations);
-  if(!success) {
-    printf("WARNING: Pressure solve failed!************************************************\n");
-    
-    std::cout << "rhs=[";
-    for(scalar s : rhs) {
-      std::cout << s << "; ";
-    }
-    std::cout << "];" << std::endl;
-    
-    std::cout << "pressure=[";
-    for(scalar s : pressure) {
-      std::cout << s << "; ";
+  
+  record.solve_time = timingutils::seconds() - t0;
+  record.iterations = iterations;
+  record.residual = tolerance;
+  record.converged = success;
+  record.residual_history.assign(solver.residual_history.begin(), solver.residual_history.end());
+  
+  return success;
+}
+
+//Solve the pressure system matrix-free on the grid with geometric multigrid PCG.
+//Only the diagonal and the forward face couplings of the 5-point stencil are stored.
+//Liquid cells on the grid boundary have no equation and are held at zero pressure.
+bool FluidSim2D::solve_pressure_gmg(scalar dt, LinearSolveRecord& record) {
+  double t0 = timingutils::seconds();
+  
+  int ni = v.ni;
+  int nj = u.nj;
+  int system_size = ni*nj;
+  if(rhs.size() != system_size) {
+    rhs.resize(system_size);
+    pressure.resize(system_size);
+  }
+  
+  const scalar rho = m_parent->getLiquidDensity();
+  const scalar coef = dt / sqr(dx) / rho;
+  
+  PoissonGridLevel2D<scalar>& A = m_mg_solver.finest(ni, nj);
+  
+  auto is_dof = [&] (int i, int j) -> bool {
+    return i>=1 && i<ni-1 && j>=1 && j<nj-1 && liquid_phi(i,j) < 0;
+  };
+  
+  // dofs and couplings of every row, for the statistics
+  std::vector<long> row_dofs(nj, 0), row_couplings(nj, 0);
+  
+  threadutils::thread_pool::ParallelFor(0, nj, [&](int j) {
+    for(int i = 0; i < ni; ++i) {
+      int idx = i + ni*j;
+      rhs[idx] = 0;
+      if(!is_dof(i,j)) continue;
+      
+      ++row_dofs[j];
+      A.mask(i,j) = 1;
+      scalar centre_phi = liquid_phi(i,j);
+      scalar diag = 0;
+      
+      // liquid neighbours contribute to the diagonal (and couple through the forward faces),
+      // air neighbours contribute the ghost-fluid term/theta
+      auto add_face = [&] (scalar weight, scalar nbr_phi, bool forward, bool nbr_dof, scalar& coupling) {
+        scalar term = weight * coef;
+        if(nbr_phi < 0) {
+          diag += term;
+          if(forward && nbr_dof) coupling = term;
+        } else {
+          scalar theta = mathutils::fraction_inside(centre_phi, nbr_phi);
+          if(theta < 0.01) theta = 0.01;
+          diag += term / theta;
+        }
+      };
+      
+      add_face(u_weights(i+1,j), liquid_phi(i+1,j), true, is_dof(i+1,j), A.cx(i,j));
+      add_face(u_weights(i,j), liquid_phi(i-1,j), false, false, A.cx(i,j));
+      add_face(v_weights(i,j+1), liquid_phi(i,j+1), true, is_dof(i,j+1), A.cy(i,j));
+      add_face(v_weights(i,j), liquid_phi(i,j-1), false, false, A.cy(i,j));
+      A.diag(i,j) = diag;
+      row_couplings[j] += (A.cx(i,j) != 0) + (A.cy(i,j) != 0);
+      
+      rhs[idx] -= u_weights(i+1,j)*u(i+1,j) / dx;
+      rhs[idx] += u_weights(i,j)*u(i,j) / dx;
+      rhs[idx] -= v_weights(i,j+1)*v(i,j+1) / dx;
+      rhs[idx] += v_weights(i,j)*v(i,j) / dx;
     }
-    std::cout << "];" << std::endl;
-    
-    write_matlab_array(std::cout, u, "u");
-    write_matlab_array(std::cout, v, "v");
+  });
+  
+  m_mg_solver.buildHierarchy();
+  
+  record.kind = m_parent->getParameter().pipelined_pressure_cg ? "pressure_gmg_pipelined" : "pressure_gmg";
+  record.size = (int) std::accumulate(row_dofs.begin(), row_dofs.end(), 0L);
+  record.nonzeros = record.size + 2 * std::accumulate(row_couplings.begin(), row_couplings.end(), 0L);
+  record.setup_time = timingutils::seconds() - t0;
+  t0 = timingutils::seconds();
+  
+  scalar tolerance;
+  int iterations;
+  m_mg_solver.pipelined = m_parent->getParameter().pipelined_pressure_cg;
+  bool success = m_mg_solver.solve(rhs, pressure, 1e-8, 50, tolerance, iterations);
+  
+  record.solve_time = timingutils::seconds() - t0;
+  record.iterations = iterations;
+  record.residual = tolerance;
+  record.converged = success;
+  record.residual_history = m_mg_solver.residual_history;
+  
+  return success;
+}
 
-    write_matlab_array(std::cout, u_hair, "u_hair");
-    write_matlab_array(std::cout, v_hair, "v_hair");
-    
-    write_matlab_array(std::cout, u_particle, "u_particle");
-    write_matlab_array(std::cout, v_particle, "v_particle");
-    
-    write_matlab_array(std::cout, u_drag, "u_drag");
-    write_matlab_array(std::cout, v_drag, "v_drag");
-    
-    write_matlab_array(std::cout, u_weights, "u_weights");
-    write_matlab_array(std::cout, v_weights, "v_weights");
-   
-    write_matlab_array(std::cout, u_weight_particle, "u_weight_particle");
-    write_matlab_array(std::cout, v_weight_particle, "v_weight_particle");
-    
-    write_matlab_array(std::cout, u_weight_hair, "u_weight_hair");
-    write_matlab_array(std::cout, v_weight_hair, "v_weight_hair");
-    
-    write_matlab_array(std::cout, u_weight_total, "u_weight_total");
-    write_matlab_array(std::cout, v_weight_total, "v_weight_total");
-    
-    write_matlab_array(std::cout, liquid_phi, "liquid_phi");
-    
-    
-    exit(0);
+//An implementation of the variational pressure projection solve for static geometry
+void FluidSim2D::solve_pressure(scalar dt) {
+  int ni = v.ni;
+  
+  const scalar rho = m_parent->getLiquidDensity();
+  
+  LinearSolveRecord record;
+  
+  bool success = false;
+  if(m_parent->getParameter().pressure_solver_mode == PSM_GEOMETRIC_MG)
+    success = solve_pressure_gmg(dt, record);
+  else
+    success = solve_pressure_pcg(dt, record);
+  
+  m_parent->recordLinearSolve(record);
+  
+  // the last iterate is still used for the projection, the failure shows up in the solver statistics
+  if(!success) {
+    printf("WARNING: Pressure solve failed!************************************************\n");
   }
 
   //Apply the velocity update
@@ -1645,7 +1736,7 @@ void FluidSim2D::init_random_particles(const scalar& rl, const scalar& rr, const
 
 void FluidSim2D::sort_particles()
 {
-  m_sorter->sort(particles.size(), sorter_callback);
+  m_sorter->sort(particles.size(), sorter_callback(this));
 }
 
 
@@ -1828,15 +1919,27 @@ const std::vector<Particle<2> >& FluidSim2D::get_particles() const
   return particles;
 }
 
+// the time a grid cell is crossed at the largest face or particle speed
 scalar FluidSim2D::cfl()
 {
-  scalar maxvel = 0;
-  const int npu = u.a.size();
-  const int npv = v.a.size();
-  for(int i = 0; i < npu; ++i)
-    maxvel = max(maxvel, fabs(u.a[i]));
-  for(int i = 0; i < npv; ++i)
-    maxvel = max(maxvel, fabs(v.a[i]));
+  const auto max_abs = [] (const Array1<scalar>& values) {
+    return tbb::parallel_reduce(tbb::blocked_range<size_t>(0, values.size()), (scalar) 0,
+      [&] (const tbb::blocked_range<size_t>& rg, scalar m) -> scalar {
+        for(size_t i = rg.begin(); i != rg.end(); ++i) m = max(m, fabs(values[i]));
+        return m;
+      }, [] (scalar a, scalar b) { return max(a, b); });
+  };
+  
+  scalar maxvel = max(max_abs(u.a), max_abs(v.a));
+  
+  const scalar maxpvel2 = tbb::parallel_reduce(tbb::blocked_range<size_t>(0, particles.size()), (scalar) 0,
+    [&] (const tbb::blocked_range<size_t>& rg, scalar m) -> scalar {
+      for(size_t i = rg.begin(); i != rg.end(); ++i) m = max(m, particles[i].v.squaredNorm());
+      return m;
+    }, [] (scalar a, scalar b) { return max(a, b); });
+  maxvel = max(maxvel, sqrt(maxpvel2));
+  
+  if(maxvel == 0.0) return std::numeric_limits<scalar>::max();
   return dx / maxvel;
 }
 
@@ -1989,7 +2092,7 @@ void FluidSim2D::load_particles_off(const std::string szfn)
   
   ifs.close();
   
-  m_sorter->sort(particles.size(), sorter_callback);
+  m_sorter->sort(particles.size(), sorter_callback(this));
   
   compute_liquid_phi();
 }
@@ -24,6 +24,8 @@
 #include "MathUtilities.h"
 #include "array2.h"
 #include "pcgsolver/pcg_solver.h"
+#include "GeometricMultigrid2D.h"
+#include "SolverTelemetry.h"
 
 //#define USE_SURFACE_TENSION
 
@@ -100,6 +102,8 @@ public:
   virtual void project(scalar dt);
   virtual void compute_weights();
   virtual void solve_pressure(scalar dt);
+  virtual bool solve_pressure_pcg(scalar dt, LinearSolveRecord& record);
+  virtual bool solve_pressure_gmg(scalar dt, LinearSolveRecord& record);
   virtual scalar get_particle_weight(const Vector2s& position) const;
   virtual scalar get_clamped_particle_weight(const Vector2s& position) const;
   
@@ -275,6 +279,7 @@ protected:
   // Solver data
   robertbridson::PCGSolver<scalar> solver;
   robertbridson::SparseMatrix<scalar> matrix;
+  GeometricMGPCGSolver2D<scalar> m_mg_solver;
   std::vector<double> rhs;
   std::vector<double> pressure;
   
@@ -22,12 +22,14 @@
 #include "TwoDimensionalDisplayController.h"
 
 #include "array3_utils.h"
+#include "MACInterpolation.h"
 
 #include "pcgsolver/sparse_matrix.h"
 #include "pcgsolver/pcg_solver.h"
 
 #include "ThreadUtils.h"
 #include "AlgebraicMultigrid.h"
+#include "TimingUtilities.h"
 
 #include "TwoDScene.h"
 #include "sorter.h"
@@ -45,27 +47,63 @@ using namespace mathutils;
 
 const static int MAX_BRIDGE_PER_EDGE = 64;
 
-void extrapolate(Array3s& grid, Array3s& old_grid, const Array3s& grid_weight, const Array3s& grid_liquid_weight, Array3c& valid, Array3c old_valid, const Vector3i& offset);
+//Cells of padding around particles and hair when allocating grid tiles. The liquid phi reads
+//particles two cells away, the rest leaves room for the hair to move before the next update.
+const static int GRID_TILE_MARGIN = 4;
 
-FluidSim3D* g_fluid3d_iptr = NULL;
+//Width in cells of the band around the liquid surface that redistance_liquid_phi recomputes,
+//and the number of times it sweeps the grid in all six directions.
+const static int LIQUID_PHI_BAND = 3;
+const static int LIQUID_PHI_SWEEPS = 2;
 
-static void sorter_callback(int pidx, int& i, int& j, int& k)
+//Cells around the solid boundaries within which nodal_solid_phi is exact. Further away from
+//all of them it is clamped to this distance, and the boundary caches store nothing.
+const static int SOLID_PHI_BAND = 4;
+
+//Particles per task of map_g2p_apic
+const static int G2P_BATCH = 64;
+
+void extrapolate(SparseArray3g& grid, SparseArray3g& old_grid, const SparseArray3g& grid_weight, const SparseArray3g& grid_liquid_weight, SparseArray3c& valid, SparseArray3c old_valid, const Vector3i& offset);
+
+//Calls func(i, j, k) for every cell of the allocated tiles of grid, in parallel over the tiles.
+//The cells of the other tiles keep the background value of the fields func writes to.
+template<class Grid, class Callable>
+static void for_each_active_cell(const Grid& grid, Callable func)
 {
-  auto& particles = g_fluid3d_iptr->get_particles();
-  
-  auto& p = particles[pidx];
-  
-  const Vector3s& origin = g_fluid3d_iptr->get_origin();
-  scalar cellsize = g_fluid3d_iptr->cellsize();
+  threadutils::thread_pool::ParallelFor(0, grid.num_active_tiles(), [&] (int n) {
+    int i0, j0, k0, i1, j1, k1;
+    grid.get_tile_range(n, i0, j0, k0, i1, j1, k1);
+    for(int k = k0; k < k1; ++k) for(int j = j0; j < j1; ++j) for(int i = i0; i < i1; ++i)
+      func(i, j, k);
+  });
+}
+
+//Maps a particle to its cell for the sorter. Bound to one simulation instead of
+//a global pointer, so that several simulations can sort at the same time.
+struct sorter_callback
+{
+  const FluidSim3D* fluid;
   
-  int pi = (int)((p.x(0) - origin(0)) / cellsize);
-  int pj = (int)((p.x(1) - origin(1)) / cellsize);
-  int pk = (int)((p.x(2) - origin(2)) / cellsize);
+  explicit sorter_callback(const FluidSim3D* fluid_) : fluid(fluid_) {}
   
-  i = max(0, min(g_fluid3d_iptr->get_ni()-1, pi));
-  j = max(0, min(g_fluid3d_iptr->get_nj()-1, pj));
-  k = max(0, min(g_fluid3d_iptr->get_nk()-1, pk));
-}
+  void operator()(int pidx, int& i, int& j, int& k) const
+  {
+    auto& particles = fluid->get_particles();
+    
+    const Vector3s& x = particles.x[pidx];
+    
+    const Vector3s& origin = fluid->get_origin();
+    scalar cellsize = fluid->cellsize();
+    
+    int pi = (int)((x(0) - origin(0)) / cellsize);
+    int pj = (int)((x(1) - origin(1)) / cellsize);
+    int pk = (int)((x(2) - origin(2)) / cellsize);
+    
+    i = max(0, min(fluid->get_ni()-1, pi));
+    j = max(0, min(fluid->get_nj()-1, pj));
+    k = max(0, min(fluid->get_nk()-1, pk));
+  }
+};
 
 scalar FluidSim3D::default_radius_multiplier() const
 {
@@ -80,14 +118,18 @@ int FluidSim3D::default_particle_in_cell() const
 FluidSim3D::~FluidSim3D()
 {
   if(m_sorter) delete m_sorter;
+  if(m_hair_sorter) delete m_hair_sorter;
+  if(m_amg_hierarchy) delete m_amg_hierarchy;
 }
 
 FluidSim3D::FluidSim3D(const Vector3s& origin_, scalar width, int ni_, int nj_, int nk_,
                        const std::vector< Boundary<3>* >& boundaries_, const std::vector< SourceBoundary<3>* >& sources_, TwoDScene<3>* scene)
 : m_parent(scene)
 {
-  g_fluid3d_iptr = this;
   ryoichi_correction_counter = 0;
+  m_reorder_counter = 0;
+  m_last_pressure_dt = 0.0;
+  m_tile_ni = m_tile_nj = m_tile_nk = 0;
   origin = origin_;
   boundaries = boundaries_;
   sources = sources_;
@@ -98,19 +140,22 @@ FluidSim3D::FluidSim3D(const Vector3s& origin_, scalar width, int ni_, int nj_,
   
   u.resize(ni+1,nj,nk); temp_u.resize(ni+1,nj,nk); u_weights.resize(ni+1,nj,nk);
   u_weight_hair.resize(ni+1,nj,nk); u_valid.resize(ni+1,nj,nk); u_hair.resize(ni+1,nj,nk);
-  u_particle.resize(ni+1, nj,nk); u_weight_particle.resize(ni+1,nj,nk);
+  u_particle.resize(ni+1, nj,nk); u_weight_particle.resize(ni+1,nj,nk); u_weight_scatter.resize(ni+1,nj,nk);
+  u_momentum_scatter.resize(ni+1,nj,nk); u_liquid_weight_scatter.resize(ni+1,nj,nk);
   u_drag.resize(ni+1, nj,nk); u_weight_total.resize(ni+1, nj, nk);
   u_pressure_grad.resize(ni+1,nj,nk); u_solid.resize(ni+1, nj, nk);
   
   v.resize(ni,nj+1,nk); temp_v.resize(ni,nj+1,nk); v_weights.resize(ni,nj+1,nk);
   v_weight_hair.resize(ni,nj+1,nk); v_valid.resize(ni,nj+1,nk); v_hair.resize(ni,nj+1,nk);
-  v_particle.resize(ni, nj+1, nk); v_weight_particle.resize(ni,nj+1,nk);
+  v_particle.resize(ni, nj+1, nk); v_weight_particle.resize(ni,nj+1,nk); v_weight_scatter.resize(ni,nj+1,nk);
+  v_momentum_scatter.resize(ni,nj+1,nk); v_liquid_weight_scatter.resize(ni,nj+1,nk);
   v_drag.resize(ni, nj+1, nk); v_weight_total.resize(ni, nj+1, nk);
   v_pressure_grad.resize(ni, nj+1, nk); v_solid.resize(ni, nj+1, nk);
   
   w.resize(ni,nj,nk+1); temp_w.resize(ni,nj,nk+1); w_weights.resize(ni,nj,nk+1);
   w_weight_hair.resize(ni,nj,nk+1); w_valid.resize(ni,nj,nk+1); w_hair.resize(ni,nj,nk+1);
-  w_particle.resize(ni, nj, nk+1); w_weight_particle.resize(ni,nj,nk+1);
+  w_particle.resize(ni, nj, nk+1); w_weight_particle.resize(ni,nj,nk+1); w_weight_scatter.resize(ni,nj,nk+1);
+  w_momentum_scatter.resize(ni,nj,nk+1); w_liquid_weight_scatter.resize(ni,nj,nk+1);
   w_drag.resize(ni, nj, nk+1); w_weight_total.resize(ni, nj, nk+1);
   w_pressure_grad.resize(ni, nj, nk+1); w_solid.resize(ni, nj, nk+1);
   
@@ -137,6 +182,15 @@ FluidSim3D::FluidSim3D(const Vector3s& origin_, scalar width, int ni_, int nj_,
   u_weight_particle.set_zero();
   v_weight_particle.set_zero();
   w_weight_particle.set_zero();
+  u_weight_scatter.set_zero();
+  v_weight_scatter.set_zero();
+  w_weight_scatter.set_zero();
+  u_momentum_scatter.set_zero();
+  v_momentum_scatter.set_zero();
+  w_momentum_scatter.set_zero();
+  u_liquid_weight_scatter.set_zero();
+  v_liquid_weight_scatter.set_zero();
+  w_liquid_weight_scatter.set_zero();
   u_drag.set_zero();
   v_drag.set_zero();
   w_drag.set_zero();
@@ -149,11 +203,18 @@ FluidSim3D::FluidSim3D(const Vector3s& origin_, scalar width, int ni_, int nj_,
   temp_v.set_zero();
   temp_w.set_zero();
   
+  // faces away from the liquid are never cut by solids as far as the solver is concerned
+  u_weights.assign(1.0);
+  v_weights.assign(1.0);
+  w_weights.assign(1.0);
+  
   nodal_solid_phi.resize(ni+1,nj+1,nk+1);
   valid.resize(ni+1, nj+1, nk+1);
   old_valid.resize(ni+1, nj+1, nk+1);
   liquid_phi.resize(ni, nj, nk);
   liquid_phi.assign(3*dx);
+  liquid_phi_sweep.resize(ni, nj, nk);
+  liquid_phi_band.resize(ni, nj, nk);
   
   pressure.resize(ni * nj * nk, 0.0);
  
@@ -161,6 +222,9 @@ FluidSim3D::FluidSim3D(const Vector3s& origin_, scalar width, int ni_, int nj_,
   
   update_boundary();
   m_sorter = new Sorter(ni, nj, nk);
+  m_particle_index_dirty = true;
+  m_hair_sorter = new HashedSorter(ni, nj, nk);
+  m_amg_hierarchy = new AMGSparseHierarchy<scalar>();
   particles.clear();
   
   int nflows = m_parent->getNumFlows();
@@ -195,42 +259,145 @@ void FluidSim3D::advect_boundary(const scalar& dt)
   });
 }
 
-//Initialize the grid-based signed distance field that dictates the position of the solid boundary
+//Update the grid-based signed distance field that dictates the position of the solid boundary.
+//Every root boundary keeps its samples inside its bounding box, which are taken again only when
+//the state of the boundary changes, e.g. when a script moves it. The field is then recombined
+//from the caches over the old and the new box of the changed boundaries only.
 void FluidSim3D::update_boundary() {
-  threadutils::thread_pool::ParallelFor(0, nk+1, [&] (int k) {
-    for(int j = 0; j < nj+1; ++j) for(int i = 0; i < ni+1; ++i) {
-      Vector3s pos(i*dx,j*dx,k*dx);
-      Vector3s vel;
-      nodal_solid_phi(i,j,k) = compute_phi_vel(pos + origin, vel);
+  std::vector<const Boundary<3>*> roots;
+  for(auto& b : boundaries) {
+    if(b->is_root()) roots.push_back(b);
+  }
+  
+  const int nroots = roots.size();
+  const bool rebuild = (int) m_boundary_caches.size() != nroots;
+  if(rebuild) m_boundary_caches.assign(nroots, BoundaryCache());
+  
+  std::vector<Vector3i> dirty_lo, dirty_hi;
+  int nsampled = 0;
+  for(int r = 0; r < nroots; ++r) {
+    BoundaryCache& cache = m_boundary_caches[r];
+    std::vector<scalar> state;
+    roots[r]->write(state);
+    if(cache.boundary == roots[r] && cache.state == state) continue;
+    
+    // the boundary has swept over its old and its new box
+    if(cache.boundary) {
+      dirty_lo.push_back(cache.lo);
+      dirty_hi.push_back(cache.hi);
     }
-  });
+    cache.boundary = roots[r];
+    cache.state.swap(state);
+    get_boundary_box(roots[r], cache.lo, cache.hi);
+    sample_boundary(cache);
+    dirty_lo.push_back(cache.lo);
+    dirty_hi.push_back(cache.hi);
+    ++nsampled;
+  }
   
-  threadutils::thread_pool::ParallelFor(0, nk, [&] (int k) {
-    for(int j = 0; j < nj; ++j) for(int i = 0; i < ni+1; ++i) {
-      Vector3s pos(i*dx,(j+0.5)*dx,(k+0.5)*dx);
-      Vector3s vel;
-      compute_phi_vel(pos + origin, vel);
-      u_solid(i, j, k) = vel[0];
-    }
-  });
+  if(rebuild) {
+    dirty_lo.assign(1, Vector3i::Zero());
+    dirty_hi.assign(1, Vector3i(ni, nj, nk));
+  }
   
-  threadutils::thread_pool::ParallelFor(0, nk, [&] (int k) {
-    for(int j = 0; j < nj+1; ++j) for(int i = 0; i < ni; ++i) {
-      Vector3s pos((i+0.5)*dx,j*dx,(k+0.5)*dx);
-      Vector3s vel;
-      compute_phi_vel(pos + origin, vel);
-      v_solid(i, j, k) = vel[1];
-    }
-  });
+  const int ndirty = dirty_lo.size();
+  for(int n = 0; n < ndirty; ++n) combine_boundaries(dirty_lo[n], dirty_hi[n]);
   
-  threadutils::thread_pool::ParallelFor(0, nk+1, [&] (int k) {
-    for(int j = 0; j < nj; ++j) for(int i = 0; i < ni; ++i) {
-      Vector3s pos((i+0.5)*dx,(j+0.5)*dx,k*dx);
-      Vector3s vel;
-      compute_phi_vel(pos + origin, vel);
-      w_solid(i, j, k) = vel[2];
+  std::cout << "[Solid SDF: resampled " << nsampled << " of " << nroots << " boundaries]" << std::endl;
+}
+
+//The range [s0, s1) of the samples of grid g (0: nodes, 1-3: u, v, w faces) inside the box of
+//nodes [lo, hi]. The faces sit half a cell above their index on the two axes across them.
+static void get_boundary_sample_range(int g, const Vector3i& lo, const Vector3i& hi, Vector3i& s0, Vector3i& s1)
+{
+  for(int a = 0; a < 3; ++a) {
+    const bool half = g > 0 && a != g - 1;
+    s0(a) = lo(a);
+    s1(a) = half ? hi(a) : hi(a) + 1;
+  }
+}
+
+//The box of nodes outside of which the boundary is at least SOLID_PHI_BAND cells away, clamped
+//to the grid, or the whole grid if there is no such box
+void FluidSim3D::get_boundary_box(const Boundary<3>* b, Vector3i& lo, Vector3i& hi) const
+{
+  lo.setZero();
+  hi = Vector3i(ni, nj, nk);
+  
+  Vector3s blo, bhi;
+  if(!b->bounds(SOLID_PHI_BAND * dx, blo, bhi)) return;
+  
+  const Vector3i n(ni, nj, nk);
+  for(int a = 0; a < 3; ++a) {
+    lo(a) = std::max(0, std::min(n(a), (int) floor((blo(a) - origin(a)) / dx)));
+    hi(a) = std::max(lo(a), std::min(n(a), (int) ceil((bhi(a) - origin(a)) / dx)));
+  }
+}
+
+//Evaluate the boundary of the cache at the nodes and faces inside its box
+void FluidSim3D::sample_boundary(BoundaryCache& cache) const
+{
+  for(int g = 0; g < 4; ++g) {
+    Vector3i s0, s1;
+    get_boundary_sample_range(g, cache.lo, cache.hi, s0, s1);
+    const Vector3i size = (s1 - s0).cwiseMax(0);
+    const Vector3s offset(g > 0 && g != 1 ? 0.5 : 0.0, g > 0 && g != 2 ? 0.5 : 0.0, g > 0 && g != 3 ? 0.5 : 0.0);
+    
+    Array3g& phi = cache.phi[g];
+    phi.resize(size(0), size(1), size(2));
+    if(g > 0) cache.vel[g - 1].resize(size(0), size(1), size(2));
+    
+    threadutils::thread_pool::ParallelFor(0, size(2), [&] (int k) {
+      for(int j = 0; j < size(1); ++j) for(int i = 0; i < size(0); ++i) {
+        Vector3s pos = (Vector3s(i + s0(0), j + s0(1), k + s0(2)) + offset) * dx + origin;
+        Vector3s vel;
+        phi(i, j, k) = cache.boundary->compute_phi_vel(pos, vel);
+        if(g > 0) cache.vel[g - 1](i, j, k) = vel(g - 1);
+      }
+    });
+  }
+}
+
+//Recombine nodal_solid_phi and u_solid, v_solid, w_solid inside the box of nodes [lo, hi] from the
+//boundary caches. Where no boundary is within SOLID_PHI_BAND cells the distance is clamped to the
+//band and the solid velocity is zero.
+void FluidSim3D::combine_boundaries(const Vector3i& lo, const Vector3i& hi)
+{
+  const scalar band = SOLID_PHI_BAND * dx;
+  const int ncaches = m_boundary_caches.size();
+  Array3g* solid_vel[] = {&u_solid, &v_solid, &w_solid};
+  
+  for(int g = 0; g < 4; ++g) {
+    Vector3i s0, s1;
+    get_boundary_sample_range(g, lo, hi, s0, s1);
+    
+    std::vector<Vector3i> cache_s0(ncaches), cache_s1(ncaches);
+    for(int r = 0; r < ncaches; ++r) {
+      get_boundary_sample_range(g, m_boundary_caches[r].lo, m_boundary_caches[r].hi, cache_s0[r], cache_s1[r]);
     }
-  });
+    
+    threadutils::thread_pool::ParallelFor(s0(2), std::max(s0(2), s1(2)), [&] (int k) {
+      for(int j = s0(1); j < s1(1); ++j) for(int i = s0(0); i < s1(0); ++i) {
+        scalar min_phi = band;
+        scalar vel = 0.0;
+        for(int r = 0; r < ncaches; ++r) {
+          const Vector3i& c0 = cache_s0[r];
+          const Vector3i& c1 = cache_s1[r];
+          if(i < c0(0) || i >= c1(0) || j < c0(1) || j >= c1(1) || k < c0(2) || k >= c1(2)) continue;
+          
+          const BoundaryCache& cache = m_boundary_caches[r];
+          const scalar phi = cache.phi[g](i - c0(0), j - c0(1), k - c0(2));
+          if(phi < min_phi) {
+            min_phi = phi;
+            if(g > 0) vel = cache.vel[g - 1](i - c0(0), j - c0(1), k - c0(2));
+          }
+        }
+        
+        if(g == 0) nodal_solid_phi(i, j, k) = min_phi;
+        else (*solid_vel[g - 1])(i, j, k) = vel;
+      }
+    });
+  }
 }
 
 int FluidSim3D::num_particles() const
@@ -255,7 +422,7 @@ void FluidSim3D::transferLiquidToGridParticle(const scalar& dt)
   // set all particles as old
   int np = particles.size();
   threadutils::thread_pool::ParallelFor(0, np, [&] (int i) {
-    particles[i].fresh *= 0.99;
+    particles.fresh[i] *= 0.99;
   });
   
   int nhairp = m_parent->getNumParticles();
@@ -266,7 +433,7 @@ void FluidSim3D::transferLiquidToGridParticle(const scalar& dt)
   const scalar& rho_liq = m_parent->getLiquidDensity();
   const scalar& gamma_liq = m_parent->getLiquidTension();
   
-  m_sorter->sort(nhairp, [&] (int pidx, int& i, int& j, int& k) {
+  m_hair_sorter->sort(nhairp, [&] (int pidx, int& i, int& j, int& k) {
     const Vector3s& pos = x.segment<3>( m_parent->getDof( pidx ) );
     int pi = (int)((pos(0) - origin(0)) / dx);
     int pj = (int)((pos(1) - origin(1)) / dx);
@@ -341,7 +508,7 @@ void FluidSim3D::transferLiquidToGridParticle(const scalar& dt)
       std::vector<int> hair_indices;
       
       int count = 0;
-      m_sorter->getCellAt(i, j, k, [&] (int pidx) {
+      m_hair_sorter->getCellAt(i, j, k, [&] (int pidx) {
         int hidx = particle_to_hair[pidx];
         int local_idx = global_to_local[pidx];
         HairFlow<3>* hair = hairs[hidx];
@@ -421,7 +588,7 @@ void FluidSim3D::transferLiquidToGridParticle(const scalar& dt)
         m_pool_liquid_particle_cache[k].push_back(Particle<3>(avg_pos, avg_vel, radii_release, PT_LIQUID));
         
         // mark released liquid from hairs
-        m_sorter->getCellAt(i, j, k, [&] (int pidx) {
+        m_hair_sorter->getCellAt(i, j, k, [&] (int pidx) {
           int hidx = particle_to_hair[pidx];
           int local_idx = global_to_local[pidx];
           HairFlow<3>* hair = hairs[hidx];
@@ -466,7 +633,7 @@ void FluidSim3D::transferLiquidToGridParticle(const scalar& dt)
           scalar prop = (total_regular_liquid - actual_release_vol) / total_regular_liquid;
           
           // remove volume from hair
-          m_sorter->getCellAt(i, j, k, [&] (int pidx) {
+          m_hair_sorter->getCellAt(i, j, k, [&] (int pidx) {
             int hidx = particle_to_hair[pidx];
             int local_idx = global_to_local[pidx];
             HairFlow<3>* hair = hairs[hidx];
@@ -499,8 +666,9 @@ void FluidSim3D::transferLiquidToGridParticle(const scalar& dt)
   for(int k = 0; k < nk; ++k)
   {
     // combine released particle into global particles
-    particles.insert(particles.end(), m_pool_liquid_particle_cache[k].begin(), m_pool_liquid_particle_cache[k].end());
-    particles.insert(particles.end(), m_regular_liquid_particle_cache[k].begin(), m_regular_liquid_particle_cache[k].end());
+    particles.append(m_pool_liquid_particle_cache[k]);
+    particles.append(m_regular_liquid_particle_cache[k]);
+    m_particle_index_dirty = true;
     
     // remove liquid from hair liquid pool
     const std::vector<int>& indices = m_pool_liquid_index_cache[k];
@@ -516,7 +684,7 @@ void FluidSim3D::transferLiquidToGridParticle(const scalar& dt)
 
 void FluidSim3D::shareParticleWithHairs( VectorXs& x, scalar dt )
 {
-  m_sorter->sort(particles.size(), sorter_callback);
+  sort_particles();
   
   std::vector<HairFlow<3>*>& hairs = m_parent->getFilmFlows();
   // build bridges
@@ -529,9 +697,7 @@ void FluidSim3D::shareParticleWithHairs( VectorXs& x, scalar dt )
   m_bridges.resize(0);
 
   int np = particles.size();
-  threadutils::thread_pool::ParallelFor(0, np, [&] (int i) {
-    particles[i].bridges.resize(0);
-  });
+  particles.clear_bridges();
   m_hair_bridge_buffer.resize(nhair);
   
   VectorXs& v = m_parent->getV();
@@ -596,16 +762,15 @@ void FluidSim3D::shareParticleWithHairs( VectorXs& x, scalar dt )
           for(int r = imin_x; r <= imax_x; ++r)
           {
             m_sorter->getCellAt(r, s, t, [&] (int pidx) {
-              Particle<3>& p = particles[pidx];
-              if(p.type != PT_LIQUID) return;
+              if(particles.type[pidx] != PT_LIQUID) return;
               
-              scalar vol_particle = dropvol(p.radii);
+              scalar vol_particle = dropvol(particles.radii[pidx]);
               
               const scalar rupture_dist = std::min(search_dist, (1.0 + 0.5 * theta) * pow(vol_particle + vol_hair, 1.0 / 3.0));
               
               scalar alpha;
               
-              scalar dist = mathutils::pointedgedist(p.x, p0, p1, alpha);
+              scalar dist = mathutils::pointedgedist(particles.x[pidx], p0, p1, alpha);
               
               Vector3s pc = p0 * (1.0 - alpha) + p1 * alpha;
               
@@ -631,6 +796,7 @@ void FluidSim3D::shareParticleWithHairs( VectorXs& x, scalar dt )
   });
 
   int kidx = 0;
+  std::vector<int> bridge_particle;
   for(int i = 0; i < nhair; ++i)
   {
     HairFlow<3>* hair = hairs[i];
@@ -641,7 +807,7 @@ void FluidSim3D::shareParticleWithHairs( VectorXs& x, scalar dt )
     for(int j = 0; j < nb; ++j)
     {
       const HairParticleBridge<3>& b = buffer[j];
-      particles[b.pidx].bridges.push_back(kidx + j);
+      bridge_particle.push_back(b.pidx);
       edge_bridges[b.eidx].push_back(kidx + j);
     }
     
@@ -651,28 +817,31 @@ void FluidSim3D::shareParticleWithHairs( VectorXs& x, scalar dt )
 
   if(m_bridges.size() == 0) return;
   
+  particles.set_bridges(bridge_particle);
+  
   // distribute liquid to bridges
   threadutils::thread_pool::ParallelFor(0, np, [&] (int i)
   {
-    auto& p = particles[i];
-    if(p.type != PT_LIQUID) return;
+    if(particles.type[i] != PT_LIQUID) return;
     
-    auto& bridge_indices = p.bridges;
-    if(bridge_indices.size() == 0) return;
+    const int nb = particles.num_bridges(i);
+    if(nb == 0) return;
+    const int* bridge_indices = particles.bridges(i);
     
-    scalar vol_particle = dropvol(p.radii);
-    scalar vol_bridge = vol_particle / (scalar) bridge_indices.size();
+    scalar vol_particle = dropvol(particles.radii[i]);
+    scalar vol_bridge = vol_particle / (scalar) nb;
     
-    for(int bidx : bridge_indices)
+    for(int n = 0; n < nb; ++n)
     {
+      const int bidx = bridge_indices[n];
       assert(bidx >= 0 && bidx < (int) m_bridges.size());
       
       auto& bridge = m_bridges[bidx];
       bridge.volume = vol_bridge;
-      bridge.vel = p.v;
+      bridge.vel = particles.v[i];
     }
     
-    p.radii = 0.0;
+    particles.radii[i] = 0.0;
   });
 
   MASS_UPDATE_MODE mum = m_parent->getMassUpdateMode();
@@ -857,32 +1026,31 @@ void FluidSim3D::shareParticleWithHairs( VectorXs& x, scalar dt )
   
   // particles absorb remain liquid on bridges
   threadutils::thread_pool::ParallelFor(0, np, [&] (int i) {
-    auto& p = particles[i];
-    if(p.type != PT_LIQUID) return;
+    if(particles.type[i] != PT_LIQUID) return;
     
-    auto& bridge_indices = p.bridges;
-    if(bridge_indices.size() == 0) return;
+    const int nb = particles.num_bridges(i);
+    if(nb == 0) return;
+    const int* bridge_indices = particles.bridges(i);
     
     scalar sum_vol = 0.0;
-    for(int bidx : bridge_indices)
+    for(int n = 0; n < nb; ++n)
     {
+      const int bidx = bridge_indices[n];
       assert(bidx >= 0 && bidx < (int) m_bridges.size());
       auto& bridge = m_bridges[bidx];
       sum_vol += std::max(0.0, bridge.volume);
     }
     
-    p.radii = dropradius(sum_vol);
+    particles.radii[i] = dropradius(sum_vol);
   });
   
-  threadutils::thread_pool::ParallelFor(0, np, [&] (int i) {
-    particles[i].bridges.resize(0);
-  });
+  particles.clear_bridges();
   
-  particles.erase(std::remove_if(particles.begin(), particles.end(), [] (const Particle<3>& p) {
-    return p.type == PT_LIQUID && p.radii <= 1e-7;
-  }), particles.end());
+  particles.remove_if([&] (int i) {
+    return particles.type[i] == PT_LIQUID && particles.radii[i] <= 1e-7;
+  });
   
-  m_sorter->sort(particles.size(), sorter_callback);
+  m_particle_index_dirty = true;
 }
 
 void FluidSim3D::resample(Vector3s& p, Vector3s& u, Matrix3s& c)
@@ -902,11 +1070,10 @@ void FluidSim3D::resample(Vector3s& p, Vector3s& u, Matrix3s& c)
   const scalar re = dx;
   
   m_sorter->getNeigboringParticles_cell(ix, iy, iz, -1, 1, -1, 1, -1, 1, [&] (int pidx) {
-    Particle<3>& np = particles[pidx];
-    Vector3s diff = np.x - p;
-    scalar w = dropvol(np.radii) * rho * mathutils::linear_kernel(diff, re);
-    u += w * np.v;
-    c += w * np.c;
+    Vector3s diff = particles.x[pidx] - p;
+    scalar w = dropvol(particles.radii[pidx]) * rho * mathutils::linear_kernel(diff, re);
+    u += w * particles.v[pidx];
+    c += w * particles.c[pidx];
     wsum += w;
   });
 
@@ -925,6 +1092,8 @@ void FluidSim3D::correct(scalar dt)
   
   if(!ryoichi_correction_step ) return;
   
+  sort_particles();
+  
   int np = (int) particles.size();
   
   if(!np) return;
@@ -935,81 +1104,79 @@ void FluidSim3D::correct(scalar dt)
   const scalar maximal_radius = standard_radius * sqrt(6.0) / 2.0;
   const scalar maximal_vol = dropvol(maximal_radius);
   // merge particles
-  for(Particle<3> p : particles)
-  {
-    p.deceased = false;
-  }
+  std::fill(particles.deceased.begin(), particles.deceased.end(), 0);
   
   std::cout << "<merge particles: " << particles.size() << " -> ";
   // for each particle find its closest neighbor, ignore the ones has been deceased or with radius larger than standard
   threadutils::thread_pool::ParallelFor(0, nk, [&] (int k) {
     for(int j = 0; j < nj; ++j) for(int i = 0; i < ni; ++i) {
       m_sorter->getCellAt(i, j, k, [&] (int pidx_i) {
-        if(particles[pidx_i].type != PT_LIQUID || particles[pidx_i].deceased || particles[pidx_i].pressure * dx < 10.0) return;
-        scalar vol_i = dropvol(particles[pidx_i].radii);
+        if(particles.type[pidx_i] != PT_LIQUID || particles.deceased[pidx_i] || particles.pressure[pidx_i] * dx < 10.0) return;
+        scalar vol_i = dropvol(particles.radii[pidx_i]);
 
         m_sorter->getCellAt(i, j, k, [&] (int pidx_j) {
-          if(particles[pidx_j].type != PT_LIQUID || pidx_j <= pidx_i || particles[pidx_j].deceased || particles[pidx_j].pressure * dx < 10.0) return;
+          if(particles.type[pidx_j] != PT_LIQUID || pidx_j <= pidx_i || particles.deceased[pidx_j] || particles.pressure[pidx_j] * dx < 10.0) return;
 
           // for each pair, check their add-up volume
-          scalar vol_j = dropvol(particles[pidx_j].radii);
+          scalar vol_j = dropvol(particles.radii[pidx_j]);
           scalar combined_vol = vol_i + vol_j;
           if(combined_vol > maximal_vol) return;
    
-          scalar dist = (particles[pidx_j].x - particles[pidx_i].x).norm();
-          if(dist > particles[pidx_i].radii + particles[pidx_j].radii) return;
+          scalar dist = (particles.x[pidx_j] - particles.x[pidx_i]).norm();
+          if(dist > particles.radii[pidx_i] + particles.radii[pidx_j]) return;
 
           // combine if their distance < add-up radius and add-up volume < maximal volume
-          particles[pidx_j].deceased = true;
+          particles.deceased[pidx_j] = 1;
 
           scalar alpha = vol_j / combined_vol;
-          particles[pidx_i].x = mathutils::lerp(particles[pidx_i].x, particles[pidx_j].x, alpha);
-          particles[pidx_i].v = mathutils::lerp(particles[pidx_i].v, particles[pidx_j].v, alpha);
-          particles[pidx_i].c = mathutils::lerp(particles[pidx_i].c, particles[pidx_j].c, alpha);
+          particles.x[pidx_i] = mathutils::lerp(particles.x[pidx_i], particles.x[pidx_j], alpha);
+          particles.v[pidx_i] = mathutils::lerp(particles.v[pidx_i], particles.v[pidx_j], alpha);
+          particles.c[pidx_i] = mathutils::lerp(particles.c[pidx_i], particles.c[pidx_j], alpha);
           
           vol_i = combined_vol;
         });
         
-        particles[pidx_i].radii = dropradius(vol_i);
+        particles.radii[pidx_i] = dropradius(vol_i);
       });
     }
   });
   
-  particles.erase(std::remove_if(particles.begin(), particles.end(), [] (const Particle<3>& p) {
-    return p.deceased;
-  }), particles.end());
+  particles.remove_if([&] (int i) {
+    return particles.deceased[i] != 0;
+  });
   
-  m_sorter->sort(particles.size(), sorter_callback);
+  m_particle_index_dirty = true;
+  sort_particles();
   std::cout << particles.size() << ">\n";
 #endif
   scalar coeff = pow(ni * nj * nk, 1.0 / 3.0);
   
   threadutils::thread_pool::ParallelFor(0, np, [&] (int n)
   {
-    Particle<3> &p = particles[n];
-    
-    if(p.type != PT_LIQUID) return;
+    if(particles.type[n] != PT_LIQUID) return;
     
     if(n % ryoichi_correction_step != ryoichi_correction_counter % ryoichi_correction_step) {
       return;
     }
     
+    const Vector3s& x = particles.x[n];
+    const scalar radii = particles.radii[n];
     Vector3s spring = Vector3s::Zero();
     
-    int ix = std::max(0, std::min((int)((p.x(0) - origin(0)) / dx), ni));
-    int iy = std::max(0, std::min((int)((p.x(1) - origin(1)) / dx), nj));
-    int iz = std::max(0, std::min((int)((p.x(2) - origin(2)) / dx), nk));
+    int ix = std::max(0, std::min((int)((x(0) - origin(0)) / dx), ni));
+    int iy = std::max(0, std::min((int)((x(1) - origin(1)) / dx), nj));
+    int iz = std::max(0, std::min((int)((x(2) - origin(2)) / dx), nk));
     
     m_sorter->getNeigboringParticles_cell(ix, iy, iz, -1, 1, -1, 1, -1, 1, [&] (int pidx) {
-      const Particle<3> &np = particles[pidx];
       if(n != pidx)
       {
-        scalar re = 1.5 * sqrt(p.radii * np.radii);
-        scalar dist = (p.x - np.x).norm();
+        const Vector3s& nx = particles.x[pidx];
+        scalar re = 1.5 * sqrt(radii * particles.radii[pidx]);
+        scalar dist = (x - nx).norm();
         scalar w = coeff * mathutils::smooth_kernel(dist * dist, re);
         if( dist > 1e-4 * re )
         {
-          spring += w * (p.x - np.x) / dist * re;
+          spring += w * (x - nx) / dist * re;
         } else {
           spring(0) += re * (rand() & 0xFF) / 255.0;
           spring(1) += re * (rand() & 0xFF) / 255.0;
@@ -1018,49 +1185,48 @@ void FluidSim3D::correct(scalar dt)
       }
     });
     
-    p.buf0 = p.x + dt * spring;
+    Vector3s& buf0 = particles.buf0[n];
+    buf0 = x + dt * spring;
     
-    Vector3s pp = (p.buf0 - origin)/dx;
+    Vector3s pp = (buf0 - origin)/dx;
     scalar phi_value = interpolate_value(pp, nodal_solid_phi);
     if(phi_value < 0) {
       Vector3s normal;
       interpolate_gradient(normal, pp, nodal_solid_phi);
       normal.normalize();
-      p.buf0 -= phi_value*normal;
+      buf0 -= phi_value*normal;
     }
   });
   
   // Resample New Velocity
   threadutils::thread_pool::ParallelFor(0, np, [&] (int n) {
-    Particle<3>& p = particles[n];
-    if(p.type != PT_LIQUID) return;
+    if(particles.type[n] != PT_LIQUID) return;
     
-    p.buf1 = p.v;
-    p.buf2 = p.c;
+    particles.buf1[n] = particles.v[n];
+    particles.buf2[n] = particles.c[n];
     
     if(n % ryoichi_correction_step != ryoichi_correction_counter % ryoichi_correction_step) {
       return;
     }
     
-    resample(p.buf0, p.buf1, p.buf2);
+    resample(particles.buf0[n], particles.buf1[n], particles.buf2[n]);
   });
   
   // Update
   threadutils::thread_pool::ParallelFor(0, np, [&] (int n)
   {
-    Particle<3>& p = particles[n];
-    if(p.type != PT_LIQUID) return;
+    if(particles.type[n] != PT_LIQUID) return;
     
     if(n % ryoichi_correction_step != ryoichi_correction_counter % ryoichi_correction_step) {
       return;
     }
     
-    p.x = p.buf0;
-    p.v = p.buf1;
-    p.c = p.buf2;
+    particles.x[n] = particles.buf0[n];
+    particles.v[n] = particles.buf1[n];
+    particles.c[n] = particles.buf2[n];
   });
 
-  m_sorter->sort(particles.size(), sorter_callback);
+  m_particle_index_dirty = true;
   
   ryoichi_correction_counter++;
 }
@@ -1068,20 +1234,17 @@ void FluidSim3D::correct(scalar dt)
 void FluidSim3D::add_drag(scalar dt)
 {
   // drag
-  for(int k = 0; k < u.nk; ++k) for(int j = 0; j < u.nj; ++j) for(int i = 0; i < u.ni; ++i)
-  {
-    u_particle(i, j, k) += u_drag(i, j, k) * dt;
-  }
+  for_each_active_cell(u_particle, [&] (int i, int j, int k) {
+    u_particle.ref(i, j, k) += u_drag(i, j, k) * dt;
+  });
   
-  for(int k = 0; k < v.nk; ++k) for(int j = 0; j < v.nj; ++j) for(int i = 0; i < v.ni; ++i)
-  {
-    v_particle(i, j, k) += v_drag(i, j, k) * dt;
-  }
+  for_each_active_cell(v_particle, [&] (int i, int j, int k) {
+    v_particle.ref(i, j, k) += v_drag(i, j, k) * dt;
+  });
   
-  for(int k = 0; k < w.nk; ++k) for(int j = 0; j < w.nj; ++j) for(int i = 0; i < w.ni; ++i)
-  {
-    w_particle(i, j, k) += w_drag(i, j, k) * dt;
-  }
+  for_each_active_cell(w_particle, [&] (int i, int j, int k) {
+    w_particle.ref(i, j, k) += w_drag(i, j, k) * dt;
+  });
 }
 
 void FluidSim3D::add_gravity(scalar dt)
@@ -1096,50 +1259,41 @@ void FluidSim3D::add_gravity(scalar dt)
   temp_v = v_particle;
   temp_w = w_particle;
   
-  threadutils::thread_pool::ParallelFor(0, u.nk, [&] (int k){
-    for(int j = 0; j < u.nj; ++j) for(int i = 0; i < u.ni; ++i)
-    {
-      Vector3s pos = Vector3s(i*dx, (j+0.5)*dx, (k+0.5)*dx) + origin;
+  for_each_active_cell(u_particle, [&] (int i, int j, int k) {
+    Vector3s pos = Vector3s(i*dx, (j+0.5)*dx, (k+0.5)*dx) + origin;
 
-      Vector3s vel = get_temp_velocity(pos);
-      
-      Vector3s r0 = earth_R + Vector3s(0.0, pos(1), 0.0);
-      Vector3s acc_centri = omega.cross(omega.cross(r0));
-      Vector3s acc_coriolis = 2.0 * omega.cross(vel);
-      
-      u_particle(i, j, k) -= (-gravity(0) + acc_coriolis(0) + acc_centri(0)) * dt;
-      
-    }
+    Vector3s vel = get_temp_velocity(pos);
+    
+    Vector3s r0 = earth_R + Vector3s(0.0, pos(1), 0.0);
+    Vector3s acc_centri = omega.cross(omega.cross(r0));
+    Vector3s acc_coriolis = 2.0 * omega.cross(vel);
+    
+    u_particle.ref(i, j, k) -= (-gravity(0) + acc_coriolis(0) + acc_centri(0)) * dt;
+    
   });
 
-  threadutils::thread_pool::ParallelFor(0, v.nk, [&] (int k){
-    for(int j = 0; j < v.nj; ++j) for(int i = 0; i < v.ni; ++i)
-    {
-      Vector3s pos = Vector3s((i+0.5)*dx, j*dx, (k+0.5)*dx) + origin;
-      
-      Vector3s vel = get_temp_velocity(pos);
-      
-      Vector3s r0 = earth_R + Vector3s(0.0, pos(1), 0.0);
-      Vector3s acc_centri = omega.cross(omega.cross(r0));
-      Vector3s acc_coriolis = 2.0 * omega.cross(vel);
-      
-      v_particle(i, j, k) -= (-gravity(1) + acc_coriolis(1) + acc_centri(1)) * dt;
-    }
+  for_each_active_cell(v_particle, [&] (int i, int j, int k) {
+    Vector3s pos = Vector3s((i+0.5)*dx, j*dx, (k+0.5)*dx) + origin;
+    
+    Vector3s vel = get_temp_velocity(pos);
+    
+    Vector3s r0 = earth_R + Vector3s(0.0, pos(1), 0.0);
+    Vector3s acc_centri = omega.cross(omega.cross(r0));
+    Vector3s acc_coriolis = 2.0 * omega.cross(vel);
+    
+    v_particle.ref(i, j, k) -= (-gravity(1) + acc_coriolis(1) + acc_centri(1)) * dt;
   });
   
-  threadutils::thread_pool::ParallelFor(0, w.nk, [&] (int k){
-    for(int j = 0; j < w.nj; ++j) for(int i = 0; i < w.ni; ++i)
-    {
-      Vector3s pos = Vector3s((i+0.5)*dx, (j+0.5)*dx, k*dx) + origin;
+  for_each_active_cell(w_particle, [&] (int i, int j, int k) {
+    Vector3s pos = Vector3s((i+0.5)*dx, (j+0.5)*dx, k*dx) + origin;
 
-      Vector3s vel = get_temp_velocity(pos);
-      
-      Vector3s r0 = earth_R + Vector3s(0.0, pos(1), 0.0);
-      Vector3s acc_centri = omega.cross(omega.cross(r0));
-      Vector3s acc_coriolis = 2.0 * omega.cross(vel);
-      
-      w_particle(i, j, k) -= (-gravity(2) + acc_coriolis(2) + acc_centri(2)) * dt;
-    }
+    Vector3s vel = get_temp_velocity(pos);
+    
+    Vector3s r0 = earth_R + Vector3s(0.0, pos(1), 0.0);
+    Vector3s acc_centri = omega.cross(omega.cross(r0));
+    Vector3s acc_coriolis = 2.0 * omega.cross(vel);
+    
+    w_particle.ref(i, j, k) -= (-gravity(2) + acc_coriolis(2) + acc_centri(2)) * dt;
   });
   
 }
@@ -1156,59 +1310,53 @@ void FluidSim3D::constrain_velocity() {
   //An exact normal would do better.)
   
   //constrain u
-  threadutils::thread_pool::ParallelFor(0, u.nk, [&] (int k){
-    for(int j = 0; j < u.nj; ++j) for(int i = 0; i < u.ni; ++i) {
-      if(u_weights(i,j,k) == 0) {
-        //apply constraint
-        Vector3s pos = Vector3s(i*dx, (j+0.5)*dx, (k+0.5)*dx) + origin;
-        Vector3s vel = get_velocity(pos);
-        Vector3s normal(0,0,0);
-        interpolate_gradient(normal, Vector3s(i, j + 0.5, k + 0.5), nodal_solid_phi);
-        normal.normalize();
-        scalar perp_component = vel.dot(normal);
-        vel -= perp_component*normal;
-        Vector3s vel_sol = get_solid_velocity(pos);
-        vel += vel_sol.dot(normal) * normal;
-        temp_u(i,j,k) = vel[0];
-      }
+  for_each_active_cell(temp_u, [&] (int i, int j, int k) {
+    if(u_weights(i,j,k) == 0) {
+      //apply constraint
+      Vector3s pos = Vector3s(i*dx, (j+0.5)*dx, (k+0.5)*dx) + origin;
+      Vector3s vel = get_velocity(pos);
+      Vector3s normal(0,0,0);
+      interpolate_gradient(normal, Vector3s(i, j + 0.5, k + 0.5), nodal_solid_phi);
+      normal.normalize();
+      scalar perp_component = vel.dot(normal);
+      vel -= perp_component*normal;
+      Vector3s vel_sol = get_solid_velocity(pos);
+      vel += vel_sol.dot(normal) * normal;
+      temp_u.ref(i,j,k) = vel[0];
     }
   });
   
   //constrain v
-  threadutils::thread_pool::ParallelFor(0, v.nk, [&] (int k){
-    for(int j = 0; j < v.nj; ++j) for(int i = 0; i < v.ni; ++i) {
-      if(v_weights(i,j,k) == 0) {
-        //apply constraint
-        Vector3s pos = Vector3s((i+0.5)*dx, j*dx, (k+0.5)*dx) + origin;
-        Vector3s vel = get_velocity(pos);
-        Vector3s normal(0,0,0);
-        interpolate_gradient(normal, Vector3s(i + 0.5, j, k + 0.5), nodal_solid_phi);
-        normal.normalize();
-        scalar perp_component = vel.dot(normal);
-        vel -= perp_component*normal;
-        Vector3s vel_sol = get_solid_velocity(pos);
-        vel += vel_sol.dot(normal) * normal;
-        temp_v(i,j,k) = vel[1];
-      }
+  for_each_active_cell(temp_v, [&] (int i, int j, int k) {
+    if(v_weights(i,j,k) == 0) {
+      //apply constraint
+      Vector3s pos = Vector3s((i+0.5)*dx, j*dx, (k+0.5)*dx) + origin;
+      Vector3s vel = get_velocity(pos);
+      Vector3s normal(0,0,0);
+      interpolate_gradient(normal, Vector3s(i + 0.5, j, k + 0.5), nodal_solid_phi);
+      normal.normalize();
+      scalar perp_component = vel.dot(normal);
+      vel -= perp_component*normal;
+      Vector3s vel_sol = get_solid_velocity(pos);
+      vel += vel_sol.dot(normal) * normal;
+      temp_v.ref(i,j,k) = vel[1];
     }
   });
   
   //constrain w
-  threadutils::thread_pool::ParallelFor(0, w.nk, [&] (int k){
-    for(int j = 0; j < w.nj; ++j) for(int i = 0; i < w.ni; ++i) {
-      if(w_weights(i,j,k) == 0) {
-        //apply constraint
-        Vector3s pos = Vector3s((i+0.5)*dx, (j+0.5)*dx, k*dx) + origin;
-        Vector3s vel = get_velocity(pos);
-        Vector3s normal(0,0,0);
-        interpolate_gradient(normal, Vector3s(i + 0.5, j + 0.5, k), nodal_solid_phi);
-        normal.normalize();
-        scalar perp_component = vel.dot(normal);
-        vel -= perp_component*normal;
-        Vector3s vel_sol = get_solid_velocity(pos);
-        vel += vel_sol.dot(normal) * normal;
-        temp_w(i,j,k) = vel[2];
-      }
+  for_each_active_cell(temp_w, [&] (int i, int j, int k) {
+    if(w_weights(i,j,k) == 0) {
+      //apply constraint
+      Vector3s pos = Vector3s((i+0.5)*dx, (j+0.5)*dx, k*dx) + origin;
+      Vector3s vel = get_velocity(pos);
+      Vector3s normal(0,0,0);
+      interpolate_gradient(normal, Vector3s(i + 0.5, j + 0.5, k), nodal_solid_phi);
+      normal.normalize();
+      scalar perp_component = vel.dot(normal);
+      vel -= perp_component*normal;
+      Vector3s vel_sol = get_solid_velocity(pos);
+      vel += vel_sol.dot(normal) * normal;
+      temp_w.ref(i,j,k) = vel[2];
     }
   });
   
@@ -1223,6 +1371,7 @@ void FluidSim3D::constrain_velocity() {
 //Add a tracer particle for visualization
 void FluidSim3D::add_particle(const Particle<3>& p) {
   particles.push_back(p);
+  m_particle_index_dirty = true;
 }
 
 //move the particles in the fluid
@@ -1238,15 +1387,15 @@ void FluidSim3D::advect_particles(scalar dt) {
 
     threadutils::thread_pool::ParallelFor(0, np, [&](int p){
       // symplectic integrate air-drag
-      if(particles[p].radii < 0.5 * default_radius) {
-        const scalar beta_w = coeff * pow(particles[p].radii, -(1.0 + sirignano));
-        const scalar airdrag = beta_w * pow(particles[p].v.norm(), 1.0 - sirignano);
-        particles[p].v /= (1.0 + dt * airdrag);
-        particles[p].c /= (1.0 + dt * airdrag);
+      if(particles.radii[p] < 0.5 * default_radius) {
+        const scalar beta_w = coeff * pow(particles.radii[p], -(1.0 + sirignano));
+        const scalar airdrag = beta_w * pow(particles.v[p].norm(), 1.0 - sirignano);
+        particles.v[p] /= (1.0 + dt * airdrag);
+        particles.c[p] /= (1.0 + dt * airdrag);
       }
       
-      particles[p].x += particles[p].v * dt;
-      Vector3s pp = (particles[p].x - origin)/dx;
+      particles.x[p] += particles.v[p] * dt;
+      Vector3s pp = (particles.x[p] - origin)/dx;
       
       //Particles can still occasionally leave the domain due to truncation errors,
       //interpolation error, or large timesteps, so we project them back in for good measure.
@@ -1257,13 +1406,13 @@ void FluidSim3D::advect_particles(scalar dt) {
         Vector3s normal;
         interpolate_gradient(normal, pp, nodal_solid_phi);
         normal.normalize();
-        particles[p].x -= phi_value*normal;
+        particles.x[p] -= phi_value*normal;
       }
     });
   } else {
     threadutils::thread_pool::ParallelFor(0, np, [&](int p){
-      particles[p].x += particles[p].v * dt;
-      Vector3s pp = (particles[p].x - origin)/dx;
+      particles.x[p] += particles.v[p] * dt;
+      Vector3s pp = (particles.x[p] - origin)/dx;
       
       //Particles can still occasionally leave the domain due to truncation errors,
       //interpolation error, or large timesteps, so we project them back in for good measure.
@@ -1274,13 +1423,12 @@ void FluidSim3D::advect_particles(scalar dt) {
         Vector3s normal;
         interpolate_gradient(normal, pp, nodal_solid_phi);
         normal.normalize();
-        particles[p].x -= phi_value*normal;
+        particles.x[p] -= phi_value*normal;
       }
     });
   }
   
-  
-  sort_particles();
+  m_particle_index_dirty = true;
   
   scalar inserted_volume = 0.0;
 
@@ -1288,6 +1436,10 @@ void FluidSim3D::advect_particles(scalar dt) {
   {
     if(!s->activated) continue;
     
+    // the detectors look up the particles already in their cells; this sorts
+    // only for the first active source and after a source added particles
+    sort_particles();
+    
     scalar generate_radius = s->drop_radius_prop * default_radius;
     scalar generate_vol = dropvol(generate_radius);
     
@@ -1306,7 +1458,7 @@ void FluidSim3D::advect_particles(scalar dt) {
       
       scalar sum_vol_existed = 0.0;
       m_sorter->getCellAt(ix, iy, iz, [&] (int i) {
-        sum_vol_existed += dropvol(particles[i].radii);
+        sum_vol_existed += dropvol(particles.radii[i]);
       });
       
       int num_p_need = default_particle_in_cell();//(int)((default_vol - sum_vol_existed) / generate_vol);
@@ -1356,22 +1508,29 @@ void FluidSim3D::advect_particles(scalar dt) {
   
   scalar volume_removed = 0.0;
   
-  particles.erase( std::remove_if(particles.begin(), particles.end(), [&] (const Particle<3>& p) {
+  particles.remove_if([&] (int i) {
+    const Vector3s& x = particles.x[i];
     bool removed =
-    p.x(0) < origin(0) + 0.5 * dx || p.x(0) > origin(0) + ((scalar) ni+0.5) * dx
-    || p.x(1) < origin(1) + 0.5 * dx || p.x(1) > origin(1) + ((scalar) nj+0.5) * dx
-    || p.x(2) < origin(2) + 0.5 * dx || p.x(2) > origin(2) + ((scalar) nk+0.5) * dx;
+    x(0) < origin(0) + 0.5 * dx || x(0) > origin(0) + ((scalar) ni+0.5) * dx
+    || x(1) < origin(1) + 0.5 * dx || x(1) > origin(1) + ((scalar) nj+0.5) * dx
+    || x(2) < origin(2) + 0.5 * dx || x(2) > origin(2) + ((scalar) nk+0.5) * dx;
     
     if(removed) {
-      volume_removed += dropvol(p.radii);
+      volume_removed += dropvol(particles.radii[i]);
     }
     return removed;
-  }), particles.end());
+  });
+  
+  m_particle_index_dirty = true;
   
   m_parent->reportParticleAdded(inserted_volume);
   m_parent->reportParticleRemoved(volume_removed);
   
-  sort_particles();
+  const int reorder_interval = m_parent->getParameter().particle_reorder_interval;
+  if(reorder_interval > 0 && ++m_reorder_counter >= reorder_interval) {
+    m_reorder_counter = 0;
+    reorder_particles();
+  }
 }
 
 void FluidSim3D::constrain_hair_particles()
@@ -1385,8 +1544,8 @@ void FluidSim3D::constrain_hair_particles()
   const std::vector< int >& local_indices = m_parent->getParticleToHairLocalIndices();
   
   threadutils::thread_pool::ParallelFor(0, np, [&](int p){
-    if(particles[p].type == PT_HAIR) {
-      auto& e = edges[particles[p].edge_idx];
+    if(particles.type[p] == PT_HAIR) {
+      auto& e = edges[particles.edge_idx[p]];
       const HairFlow<3>* flow = flows[ particle_hairs[e.first] ];
       const VectorXs& eta = flow->getEta();
       const VectorXs& radii_v = flow->getRadiiV();
@@ -1396,96 +1555,345 @@ void FluidSim3D::constrain_hair_particles()
       
       const Vector3s& x0 = x.segment<3>(m_parent->getDof(e.first));
       const Vector3s& x1 = x.segment<3>(m_parent->getDof(e.second));
-      particles[p].x = mathutils::lerp(x0, x1, particles[p].edge_alpha);
+      particles.x[p] = mathutils::lerp(x0, x1, particles.edge_alpha[p]);
       
       scalar H0 = eta(local_idx0) + radii_v(local_idx0);
       scalar H1 = eta(local_idx1) + radii_v(local_idx1);
       
-      particles[p].radii = sqrt(mathutils::lerp(H0 * H0, H1 * H1, particles[p].edge_alpha));
+      particles.radii[p] = sqrt(mathutils::lerp(H0 * H0, H1 * H1, particles.edge_alpha[p]));
     }
   });
   
-  m_sorter->sort(particles.size(), sorter_callback);
+  m_particle_index_dirty = true;
 }
 
 void FluidSim3D::compute_liquid_phi()
 {
+  update_grid_topology();
+  
   liquid_phi.assign(3*dx);
   std::cout << "[Liquid-Phi: CVT]" << std::endl;
 
-  threadutils::thread_pool::ParallelFor(0, nk, [&] (int k){
-    for(int j = 0; j < nj; ++j) for(int i = 0; i < ni; ++i) {
-      Vector3s pos = Vector3s((i+0.5)*dx, (j+0.5)*dx, (k+0.5)*dx) + origin;
-      scalar phi_min = 1e+20;
-      
-      m_sorter->getNeigboringParticles_cell(i, j, k, -2, 2, -2, 2, -2, 2, [&] (int pidx) {
-        const Particle<3>& p = particles[pidx];
-        phi_min = std::min(phi_min, (pos - p.x).norm() - 1.02 * std::max(dx / sqrt(3.0), p.radii));
-      });
-      liquid_phi(i,j,k) = std::min(liquid_phi(i,j,k), phi_min);
-    }
+  // every particle lowers the cells within two cells of its own to the distance to its sphere,
+  // which are the cells whose -2..2 neighbourhood holds it
+  const scalar min_radius = dx / sqrt(3.0);
+  for_each_particle_by_blocks([&] (int pidx, int ci, int cj, int ck) {
+    const Vector3s& x = particles.x[pidx];
+    const scalar radius = 1.02 * std::max(min_radius, particles.radii[pidx]);
+    for(int k = std::max(0, ck - 2); k <= std::min(nk - 1, ck + 2); ++k)
+      for(int j = std::max(0, cj - 2); j <= std::min(nj - 1, cj + 2); ++j)
+        for(int i = std::max(0, ci - 2); i <= std::min(ni - 1, ci + 2); ++i) {
+          Vector3s pos = Vector3s((i+0.5)*dx, (j+0.5)*dx, (k+0.5)*dx) + origin;
+          gridscalar& phi = liquid_phi.ref(i, j, k);
+          phi = std::min((scalar) phi, (pos - x).norm() - radius);
+        }
   });
   
+  std::cout << "[Liquid-Phi: redistance]" << std::endl;
+  redistance_liquid_phi();
+  
   std::cout << "[Liquid-Phi: extrapolate phi into solids]" << std::endl;
-  threadutils::thread_pool::ParallelFor(0, nk, [&](int k){
-    for(int j = 0; j < nj; ++j) {
-      for(int i = 0; i < ni; ++i) {
-        if(liquid_phi(i,j,k) < 0.5*dx) {
-          float solid_phi_val = 0.125 * (
-                                        nodal_solid_phi(i,j,k) +
-                                        nodal_solid_phi(i+1,j,k) +
-                                        nodal_solid_phi(i,j+1,k) +
-                                        nodal_solid_phi(i+1,j+1,k) +
-                                        nodal_solid_phi(i,j,k+1) +
-                                        nodal_solid_phi(i+1,j,k+1) +
-                                        nodal_solid_phi(i,j+1,k+1) +
-                                        nodal_solid_phi(i+1,j+1,k+1));
-          if(solid_phi_val < 0)
-            liquid_phi(i,j,k) = -0.5*dx;
-        }
-      }
+  for_each_active_cell(liquid_phi, [&](int i, int j, int k){
+    if(liquid_phi(i,j,k) < 0.5*dx) {
+      float solid_phi_val = 0.125 * (
+                                    nodal_solid_phi(i,j,k) +
+                                    nodal_solid_phi(i+1,j,k) +
+                                    nodal_solid_phi(i,j+1,k) +
+                                    nodal_solid_phi(i+1,j+1,k) +
+                                    nodal_solid_phi(i,j,k+1) +
+                                    nodal_solid_phi(i+1,j,k+1) +
+                                    nodal_solid_phi(i,j+1,k+1) +
+                                    nodal_solid_phi(i+1,j+1,k+1));
+      if(solid_phi_val < 0)
+        liquid_phi.ref(i,j,k) = -0.5*dx;
     }
   });
   
   //write_matlab_array(std::cout, liquid_phi, "phi");
 }
 
-void FluidSim3D::combine_velocity_field()
+//The unsigned distance at a cell from the distances a <= b <= c of its closest neighbours along
+//the three axes (Godunov upwind solution of |grad phi| = 1)
+static inline scalar eikonal_update(scalar a, scalar b, scalar c, scalar h)
+{
+  if(a > b) std::swap(a, b);
+  if(b > c) std::swap(b, c);
+  if(a > b) std::swap(a, b);
+  
+  scalar x = a + h;
+  if(x <= b) return x;
+  x = 0.5 * (a + b + sqrt(2.0 * h * h - (a - b) * (a - b)));
+  if(x <= c) return x;
+  const scalar s = a + b + c;
+  return (s + sqrt(std::max(0.0, s * s - 3.0 * (a * a + b * b + c * c - h * h)))) / 3.0;
+}
+
+//Fast-sweeping redistance of liquid_phi within LIQUID_PHI_BAND cells of the surface. The cells
+//next to a sign change keep the distance to the particle spheres, the other cells of the band
+//are solved from them; cells outside the band and in unallocated tiles are left alone. A sweep
+//runs along the grid lines of one axis in parallel over the lines, and reads the neighbours on
+//the other lines from the result of the previous sweep, so the lines do not depend on each other.
+void FluidSim3D::redistance_liquid_phi()
+{
+  enum { BAND_NEGATIVE = 1, BAND_INTERFACE = 2, BAND_SOLVE = 4 };
+  const scalar band = LIQUID_PHI_BAND * dx;
+  
+  liquid_phi_sweep.assign(band);
+  for_each_active_cell(liquid_phi, [&] (int i, int j, int k) {
+    const scalar phi = liquid_phi(i, j, k);
+    char state = phi < 0 ? BAND_NEGATIVE : 0;
+    if(fabs(phi) < band) {
+      const bool inside = phi < 0;
+      const bool interface =
+      (i > 0 && (liquid_phi(i-1,j,k) < 0) != inside) || (i < ni-1 && (liquid_phi(i+1,j,k) < 0) != inside) ||
+      (j > 0 && (liquid_phi(i,j-1,k) < 0) != inside) || (j < nj-1 && (liquid_phi(i,j+1,k) < 0) != inside) ||
+      (k > 0 && (liquid_phi(i,j,k-1) < 0) != inside) || (k < nk-1 && (liquid_phi(i,j,k+1) < 0) != inside);
+      state |= interface ? BAND_INTERFACE : BAND_SOLVE;
+    }
+    liquid_phi_band.ref(i, j, k) = state;
+    liquid_phi_sweep.ref(i, j, k) = (state & BAND_SOLVE) ? band : fabs(phi);
+  });
+  
+  // liquid_phi holds the unsigned distances of every other sweep
+  SparseArray3g* src = &liquid_phi_sweep;
+  SparseArray3g* dst = &liquid_phi;
+  const int n[3] = {ni, nj, nk};
+  const int tile_mask = SparseArray3g::TILE_MASK;
+  
+  for(int sweep = 0; sweep < LIQUID_PHI_SWEEPS; ++sweep) for(int axis = 0; axis < 3; ++axis) for(int dir = 1; dir >= -1; dir -= 2) {
+    const int a1 = (axis + 1) % 3;
+    const int a2 = (axis + 2) % 3;
+    const SparseArray3g& prev = *src;
+    SparseArray3g& next = *dst;
+    
+    threadutils::thread_pool::ParallelFor(0, n[a1] * n[a2], [&] (int line) {
+      int c[3];
+      c[a1] = line % n[a1];
+      c[a2] = line / n[a1];
+      for(int t = 0; t < n[axis]; ++t) {
+        c[axis] = dir > 0 ? t : n[axis] - 1 - t;
+        const int i = c[0], j = c[1], k = c[2];
+        if(!prev.is_allocated(i, j, k)) {
+          // jump to the last cell of the tile in the sweep direction
+          t = dir > 0 ? (c[axis] | tile_mask) : n[axis] - 1 - (c[axis] & ~tile_mask);
+          continue;
+        }
+        if(!(liquid_phi_band(i, j, k) & BAND_SOLVE)) {
+          next.ref(i, j, k) = prev(i, j, k);
+          continue;
+        }
+        
+        scalar nb[3];
+        for(int b = 0; b < 3; ++b) {
+          scalar lo = band, hi = band;
+          int d[3] = {c[0], c[1], c[2]};
+          if(c[b] > 0) {
+            d[b] = c[b] - 1;
+            // the cell behind in the sweep direction is already done
+            lo = (b == axis && dir > 0) ? next(d[0], d[1], d[2]) : prev(d[0], d[1], d[2]);
+          }
+          if(c[b] < n[b] - 1) {
+            d[b] = c[b] + 1;
+            hi = (b == axis && dir < 0) ? next(d[0], d[1], d[2]) : prev(d[0], d[1], d[2]);
+          }
+          nb[b] = std::min(lo, hi);
+        }
+        next.ref(i, j, k) = std::min((scalar) prev(i, j, k), eikonal_update(nb[0], nb[1], nb[2], dx));
+      }
+    });
+    std::swap(src, dst);
+  }
+  
+  const SparseArray3g& dist = *src;
+  for_each_active_cell(liquid_phi, [&] (int i, int j, int k) {
+    const scalar d = dist(i, j, k);
+    const char state = liquid_phi_band(i, j, k);
+    liquid_phi.ref(i, j, k) = (state & BAND_NEGATIVE) ? -d : d;
+  });
+}
+
+//Calls func(pidx, i, j, k) for every particle pidx sorted into the cell (i, j, k). The cells are
+//visited in 8^3 blocks of 8 colors, in parallel over the blocks of one color. Two blocks of a
+//color are 8 cells apart, so func may write to the cells up to 4 cells away from (i, j, k).
+template<class Callable>
+void FluidSim3D::for_each_particle_by_blocks(Callable func)
 {
-  threadutils::thread_pool::ParallelFor(0, u.nk, [&](int k){
-    for(int j = 0; j < u.nj; ++j) for(int i = 0; i < u.ni; ++i) {
-      scalar weight = u_weight_particle(i, j, k) + u_weight_hair(i, j, k);
-      if(weight > 0) {
-        u(i, j, k) = (u_weight_particle(i, j, k) * u_particle(i, j, k) + u_weight_hair(i, j, k) * u_hair(i, j, k)) / weight;
-      } else {
-        u(i, j, k) = 0.0;
+  sort_particles();
+  
+  const int block_bits = SparseArray3g::TILE_BITS;
+  const int nbi = SparseArray3g::num_tiles_for(ni);
+  const int nbj = SparseArray3g::num_tiles_for(nj);
+  const int nbk = SparseArray3g::num_tiles_for(nk);
+  
+  // the blocks holding particles, by color
+  std::vector<unsigned char> occupied(nbi * nbj * nbk, 0);
+  const std::vector<uint64_t>& keys = m_sorter->array_idx;
+  const int nkeys = (int) keys.size();
+  for(int n = 0; n < nkeys; ++n) {
+    const unsigned cell = (unsigned) (keys[n] >> 32UL);
+    if(n > 0 && cell == (unsigned) (keys[n - 1] >> 32UL)) continue;
+    const int bi = (cell % ni) >> block_bits;
+    const int bj = ((cell / ni) % nj) >> block_bits;
+    const int bk = (cell / (ni * nj)) >> block_bits;
+    occupied[bi + nbi * (bj + nbj * bk)] = 1;
+  }
+  
+  std::vector<int> color_blocks[8];
+  for(int bk = 0; bk < nbk; ++bk) for(int bj = 0; bj < nbj; ++bj) for(int bi = 0; bi < nbi; ++bi) {
+    const int b = bi + nbi * (bj + nbj * bk);
+    if(occupied[b]) color_blocks[(bi & 1) | ((bj & 1) << 1) | ((bk & 1) << 2)].push_back(b);
+  }
+  
+  for(int color = 0; color < 8; ++color) {
+    const std::vector<int>& blocks = color_blocks[color];
+    threadutils::thread_pool::ParallelFor(0, (int) blocks.size(), [&] (int n) {
+      const int b = blocks[n];
+      const int ci0 = (b % nbi) << block_bits;
+      const int cj0 = ((b / nbi) % nbj) << block_bits;
+      const int ck0 = (b / (nbi * nbj)) << block_bits;
+      const int ci1 = std::min(ci0 + (1 << block_bits), ni);
+      const int cj1 = std::min(cj0 + (1 << block_bits), nj);
+      const int ck1 = std::min(ck0 + (1 << block_bits), nk);
+      for(int k = ck0; k < ck1; ++k) for(int j = cj0; j < cj1; ++j) for(int i = ci0; i < ci1; ++i) {
+        m_sorter->getCellAt(i, j, k, [&] (int pidx) { func(pidx, i, j, k); });
       }
-      u_weight_total(i, j, k) = weight;
+    });
+  }
+}
+
+//Allocate the tiles of the sparse grid fields that lie within GRID_TILE_MARGIN cells of a cell
+//holding a particle or crossed by a hair edge.
+//Tiles that stay allocated keep their values, the cells of released tiles return to the background.
+void FluidSim3D::update_grid_topology()
+{
+  sort_particles();
+  
+  m_tile_ni = SparseArray3g::num_tiles_for(ni + 1);
+  m_tile_nj = SparseArray3g::num_tiles_for(nj + 1);
+  m_tile_nk = SparseArray3g::num_tiles_for(nk + 1);
+  m_tile_mask.assign(m_tile_ni * m_tile_nj * m_tile_nk, 0);
+  
+  // the sorted keys hold the cell in their upper half, so every occupied cell starts a run
+  const std::vector<uint64_t>& keys = m_sorter->array_idx;
+  const int nkeys = (int) keys.size();
+  for(int n = 0; n < nkeys; ++n) {
+    const unsigned cell = (unsigned) (keys[n] >> 32UL);
+    if(n > 0 && cell == (unsigned) (keys[n - 1] >> 32UL)) continue;
+    const int i = cell % ni;
+    const int j = (cell / ni) % nj;
+    const int k = cell / (ni * nj);
+    // the faces of a cell are on both of its sides
+    mark_grid_tiles(i, j, k, i + 1, j + 1, k + 1);
+  }
+  
+  const VectorXs& x = m_parent->getX();
+  const std::vector< std::pair<int, int> >& edges = m_parent->getEdges();
+  for(auto& e : edges) {
+    Vector3s p0 = (x.segment<3>( m_parent->getDof( e.first ) ) - origin) / dx;
+    Vector3s p1 = (x.segment<3>( m_parent->getDof( e.second ) ) - origin) / dx;
+    Vector3s pmin = p0.cwiseMin(p1);
+    Vector3s pmax = p0.cwiseMax(p1);
+    mark_grid_tiles(std::max(0, std::min(ni - 1, (int) floor(pmin(0)))),
+                    std::max(0, std::min(nj - 1, (int) floor(pmin(1)))),
+                    std::max(0, std::min(nk - 1, (int) floor(pmin(2)))),
+                    std::max(0, std::min(ni, (int) ceil(pmax(0)))),
+                    std::max(0, std::min(nj, (int) ceil(pmax(1)))),
+                    std::max(0, std::min(nk, (int) ceil(pmax(2)))));
+  }
+  
+  apply_grid_topology();
+}
+
+//Mark the tiles around the cells [i0, i1] x [j0, j1] x [k0, k1] of the nodal grid in m_tile_mask.
+//Returns whether any of them was not marked before.
+bool FluidSim3D::mark_grid_tiles(int i0, int j0, int k0, int i1, int j1, int k1)
+{
+  const int tile_bits = SparseArray3g::TILE_BITS;
+  const int ti0 = std::max(0, i0 - GRID_TILE_MARGIN) >> tile_bits;
+  const int tj0 = std::max(0, j0 - GRID_TILE_MARGIN) >> tile_bits;
+  const int tk0 = std::max(0, k0 - GRID_TILE_MARGIN) >> tile_bits;
+  const int ti1 = std::min(ni, i1 + GRID_TILE_MARGIN) >> tile_bits;
+  const int tj1 = std::min(nj, j1 + GRID_TILE_MARGIN) >> tile_bits;
+  const int tk1 = std::min(nk, k1 + GRID_TILE_MARGIN) >> tile_bits;
+  bool grown = false;
+  for(int tk = tk0; tk <= tk1; ++tk) for(int tj = tj0; tj <= tj1; ++tj) for(int ti = ti0; ti <= ti1; ++ti) {
+    unsigned char& tile = m_tile_mask[ti + m_tile_ni * (tj + m_tile_nj * tk)];
+    grown = grown || !tile;
+    tile = 1;
+  }
+  return grown;
+}
+
+//Give every sparse grid field the tiles of m_tile_mask
+void FluidSim3D::apply_grid_topology()
+{
+  SparseArray3g* grid_fields[] = {
+    &u, &v, &w, &temp_u, &temp_v, &temp_w,
+    &u_weight_hair, &v_weight_hair, &w_weight_hair,
+    &u_weight_particle, &v_weight_particle, &w_weight_particle,
+    &u_weight_total, &v_weight_total, &w_weight_total,
+    &u_hair, &v_hair, &w_hair,
+    &u_pressure_grad, &v_pressure_grad, &w_pressure_grad,
+    &u_particle, &v_particle, &w_particle,
+    &u_drag, &v_drag, &w_drag,
+    &u_weights, &v_weights, &w_weights,
+    &liquid_phi, &liquid_phi_sweep
+  };
+  SparseArray3s* scalar_fields[] = {
+    &u_weight_scatter, &v_weight_scatter, &w_weight_scatter,
+    &u_momentum_scatter, &v_momentum_scatter, &w_momentum_scatter,
+    &u_liquid_weight_scatter, &v_liquid_weight_scatter, &w_liquid_weight_scatter
+  };
+  SparseArray3c* char_fields[] = {&u_valid, &v_valid, &w_valid, &valid, &old_valid, &liquid_phi_band};
+  
+  const int ngrid = sizeof(grid_fields) / sizeof(SparseArray3g*);
+  const int nscalar = sizeof(scalar_fields) / sizeof(SparseArray3s*);
+  const int nchar = sizeof(char_fields) / sizeof(SparseArray3c*);
+  threadutils::thread_pool::ParallelFor(0, ngrid + nscalar + nchar, [&] (int n) {
+    if(n < ngrid) grid_fields[n]->set_topology(m_tile_mask, m_tile_ni, m_tile_nj, m_tile_nk);
+    else if(n < ngrid + nscalar) scalar_fields[n - ngrid]->set_topology(m_tile_mask, m_tile_ni, m_tile_nj, m_tile_nk);
+    else char_fields[n - ngrid - nscalar]->set_topology(m_tile_mask, m_tile_ni, m_tile_nj, m_tile_nk);
+  });
+  
+  size_t bytes = 0;
+  for(SparseArray3g* grid : grid_fields) bytes += grid->memory_usage();
+  for(SparseArray3s* grid : scalar_fields) bytes += grid->memory_usage();
+  for(SparseArray3c* grid : char_fields) bytes += grid->memory_usage();
+  
+  std::cout << "[Grid tiles: " << std::count(m_tile_mask.begin(), m_tile_mask.end(), 1) << " of " << m_tile_mask.size()
+            << ", " << (bytes / (1024.0 * 1024.0)) << " MB]" << std::endl;
+}
+
+void FluidSim3D::combine_velocity_field()
+{
+  for_each_active_cell(u, [&] (int i, int j, int k) {
+    scalar weight = u_weight_particle(i, j, k) + u_weight_hair(i, j, k);
+    if(weight > 0) {
+      u.ref(i, j, k) = (u_weight_particle(i, j, k) * u_particle(i, j, k) + u_weight_hair(i, j, k) * u_hair(i, j, k)) / weight;
+    } else {
+      u.ref(i, j, k) = 0.0;
     }
+    u_weight_total.ref(i, j, k) = weight;
   });
   
-  threadutils::thread_pool::ParallelFor(0, v.nk, [&](int k){
-    for(int j = 0; j < v.nj; ++j) for(int i = 0; i < v.ni; ++i) {
-      scalar weight = v_weight_particle(i, j, k) + v_weight_hair(i, j, k);
-      if(weight > 0) {
-        v(i, j, k) = (v_weight_particle(i, j, k) * v_particle(i, j, k) + v_weight_hair(i, j, k) * v_hair(i, j, k)) / weight;
-      } else {
-        v(i, j, k) = 0.0;
-      }
-      v_weight_total(i, j, k) = weight;
+  for_each_active_cell(v, [&] (int i, int j, int k) {
+    scalar weight = v_weight_particle(i, j, k) + v_weight_hair(i, j, k);
+    if(weight > 0) {
+      v.ref(i, j, k) = (v_weight_particle(i, j, k) * v_particle(i, j, k) + v_weight_hair(i, j, k) * v_hair(i, j, k)) / weight;
+    } else {
+      v.ref(i, j, k) = 0.0;
     }
+    v_weight_total.ref(i, j, k) = weight;
   });
   
-  threadutils::thread_pool::ParallelFor(0, w.nk, [&](int k){
-    for(int j = 0; j < w.nj; ++j) for(int i = 0; i < w.ni; ++i) {
-      scalar weight = w_weight_particle(i, j, k) + w_weight_hair(i, j, k);
-      if(weight > 0) {
-        w(i, j, k) = (w_weight_particle(i, j, k) * w_particle(i, j, k) + w_weight_hair(i, j, k) * w_hair(i, j, k)) / weight;
-      } else {
-        w(i, j, k) = 0.0;
-      }
-      w_weight_total(i, j, k) = weight;
+  for_each_active_cell(w, [&] (int i, int j, int k) {
+    scalar weight = w_weight_particle(i, j, k) + w_weight_hair(i, j, k);
+    if(weight > 0) {
+      w.ref(i, j, k) = (w_weight_particle(i, j, k) * w_particle(i, j, k) + w_weight_hair(i, j, k) * w_hair(i, j, k)) / weight;
+    } else {
+      w.ref(i, j, k) = 0.0;
     }
+    w_weight_total.ref(i, j, k) = weight;
   });
 }
 
@@ -1521,18 +1929,13 @@ Vector3s FluidSim3D::get_nodal_solid_phi_gradient(const Vector3s& position) cons
   return normal;
 }
 
-Vector3s FluidSim3D::get_velocity(const Vector3s& position, const Array3s& u_, const Array3s& v_, const Array3s& w_) const
+template<class Grid>
+Vector3s FluidSim3D::get_velocity(const Vector3s& position, const Grid& u_, const Grid& v_, const Grid& w_) const
 {
-  //Interpolate the velocity from the u and v grids
-  Vector3s p = (position - origin) / dx;
-  Vector3s p0 = p - Vector3s(0, 0.5, 0.5);
-  Vector3s p1 = p - Vector3s(0.5, 0, 0.5);
-  Vector3s p2 = p - Vector3s(0.5, 0.5, 0);
-  scalar u_value = interpolate_value(p0, u_);
-  scalar v_value = interpolate_value(p1, v_);
-  scalar w_value = interpolate_value(p2, w_);
-  
-  return Vector3s(u_value, v_value, w_value);
+  //Interpolate the velocity from the u, v and w grids
+  Vector3s vel;
+  macinterp::interpolate_mac(u_, v_, w_, origin, dx, &position, 1, &vel, (Matrix3s*) NULL);
+  return vel;
 }
 
 Vector3s FluidSim3D::get_pressure_gradient(const Vector3s& position) const
@@ -1592,282 +1995,353 @@ scalar FluidSim3D::getClampedLiquidPhiValue(const Vector3s& position) const
 
 Matrix3s FluidSim3D::get_affine_matrix(const Vector3s& position) const
 {
-  Vector3s p = (position - origin) / dx;
-  Vector3s p0 = p - Vector3s(0, 0.5, 0.5);
-  Vector3s p1 = p - Vector3s(0.5, 0, 0.5);
-  Vector3s p2 = p - Vector3s(0.5, 0.5, 0);
-  
+  Vector3s vel;
   Matrix3s c;
-  c.col(0) = affine_interpolate_value(p0, u) / dx;
-  c.col(1) = affine_interpolate_value(p1, v) / dx;
-  c.col(2) = affine_interpolate_value(p2, w) / dx;
-  
+  macinterp::interpolate_mac(u, v, w, origin, dx, &position, 1, &vel, &c);
   return c;
 }
 
 //Compute finite-volume style face-weights for fluid from nodal signed distances
 void FluidSim3D::compute_weights() {
-  threadutils::thread_pool::ParallelFor(0, u_weights.nk, [&] (int k) {
-    for(int j = 0; j < u_weights.nj; ++j) for(int i = 0; i < u_weights.ni; ++i) {
-      u_weights(i,j,k) = 1 - mathutils::fraction_inside(nodal_solid_phi(i,j+1,k+1), nodal_solid_phi(i,j,k));
-      u_weights(i,j,k) = hardclamp(u_weights(i,j,k), 0.0, 1.0);
-    }
+  for_each_active_cell(u_weights, [&] (int i, int j, int k) {
+    u_weights.ref(i,j,k) = hardclamp(1.0 - mathutils::fraction_inside(nodal_solid_phi(i,j+1,k+1), nodal_solid_phi(i,j,k)), 0.0, 1.0);
   });
-  threadutils::thread_pool::ParallelFor(0, v_weights.nk, [&] (int k) {
-    for(int j = 0; j < v_weights.nj; ++j) for(int i = 0; i < v_weights.ni; ++i) {
-      v_weights(i,j,k) = 1 - mathutils::fraction_inside(nodal_solid_phi(i+1,j,k+1), nodal_solid_phi(i,j,k));
-      v_weights(i,j,k) = hardclamp(v_weights(i,j,k), 0.0, 1.0);
-    }
+  for_each_active_cell(v_weights, [&] (int i, int j, int k) {
+    v_weights.ref(i,j,k) = hardclamp(1.0 - mathutils::fraction_inside(nodal_solid_phi(i+1,j,k+1), nodal_solid_phi(i,j,k)), 0.0, 1.0);
   });
-  threadutils::thread_pool::ParallelFor(0, w_weights.nk, [&] (int k) {
-    for(int j = 0; j < w_weights.nj; ++j) for(int i = 0; i < w_weights.ni; ++i) {
-      w_weights(i,j,k) = 1 - mathutils::fraction_inside(nodal_solid_phi(i+1,j+1,k), nodal_solid_phi(i,j,k));
-      w_weights(i,j,k) = hardclamp(w_weights(i,j,k), 0.0, 1.0);
-    }
+  for_each_active_cell(w_weights, [&] (int i, int j, int k) {
+    w_weights.ref(i,j,k) = hardclamp(1.0 - mathutils::fraction_inside(nodal_solid_phi(i+1,j+1,k), nodal_solid_phi(i,j,k)), 0.0, 1.0);
   });
 }
 
 //#define USE_ROBERTS_SOLVER
 
-//An implementation of the variational pressure projection solve for static geometry
-void FluidSim3D::solve_pressure(scalar dt) {
+//Assemble the pressure system over the liquid cells directly in CSR form and solve it with AMG-PCG.
+//The liquid cells are numbered by a parallel compaction over k-slabs, then the rows are counted,
+//prefix-summed into rowstart and filled in parallel, so no row is ever reallocated.
+bool FluidSim3D::solve_pressure_amg(scalar dt, LinearSolveRecord& record) {
   //This linear system could be simplified, but I've left it as is for clarity
   //and consistency with the standard naive discretization
   
+  double t0 = timingutils::seconds();
+  
   int ni = v.ni;
   int nj = u.nj;
   int nk = u.nk;
   
   int system_size = ni*nj*nk;
-  int slice = ni*nj;
-  if((int) rhs.size() != system_size) {
-    rhs.resize(system_size);
+  if((int) pressure.size() != system_size) {
     pressure.resize(system_size);
-    matrix.resize(system_size);
   }
-  matrix.zero();
   
-  rhs.assign(rhs.size(), 0);
-  pressure.assign(pressure.size(), 0);
+  // count the liquid cells of every slab and prefix-sum them into the first dof of the slab
+  std::vector<unsigned> slab_start(nk + 1, 0);
+  threadutils::thread_pool::ParallelFor(0, nk, [&](int k) {
+    unsigned count = 0;
+    for(int j=0;j<nj;j++)for(int i=0;i<ni;i++)
+    {
+      if (liquid_phi(i,j,k)<0) ++count;
+    }
+    slab_start[k + 1] = count;
+  });
+  for(int k = 0; k < nk; ++k) slab_start[k + 1] += slab_start[k];
+  const unsigned num_dofs = slab_start[nk];
   
-  std::vector<double> x;
-  std::vector<Vector3i> dof_ijk;
-  x.resize(0);
-  x.reserve(system_size);
-  dof_ijk.resize(0);
-  dof_ijk.reserve(system_size);
+  std::vector<double> x(num_dofs);
+  std::vector<Vector3i> dof_ijk(num_dofs);
   
   Array3ui dof_index;
   dof_index.resize(ni,nj,nk);
-  dof_index.assign(0);
   
   const scalar rho = m_parent->getLiquidDensity();
   
-  for (int k=0;k<nk;k++)for(int j=0;j<nj;j++)for(int i=0;i<ni;i++)
-  {
-	   if (liquid_phi(i,j,k)<0)
-     {
-       dof_index(i,j,k) = x.size();
-       dof_ijk.push_back(Vector3i(i,j,k));
-       x.push_back(0);
-     }
-  }
+  // seed cells that stayed liquid with the last pressure (rescaled to the new dt)
+  const bool warm_start = m_parent->getParameter().warm_start_pressure && m_last_pressure_dt > 0.0;
+  const scalar warm_scale = warm_start ? (m_last_pressure_dt / dt) : 0.0;
   
-  threadutils::thread_pool::ParallelFor(0, system_size, [&](int thread_idx)
-  {
-    int k = thread_idx/slice;
-    int j = (thread_idx%slice)/ni;
-    int i = thread_idx%ni;
-    if(i>=1 && i<ni-1 && j>=1 && j<nj-1 && k>=1 && k<nk-1)
+  threadutils::thread_pool::ParallelFor(0, nk, [&](int k) {
+    unsigned idx = slab_start[k];
+    for(int j=0;j<nj;j++)for(int i=0;i<ni;i++)
     {
-      float centre_phi = liquid_phi(i,j,k);
-      unsigned dof_idx = dof_index(i,j,k);
-      if(centre_phi < 0)
+      if (liquid_phi(i,j,k)<0)
       {
-        rhs[dof_idx] = 0;
-        //right neighbour
-        float term = u_weights(i+1,j,k) * dt / sqr(dx) / rho;
-        float right_phi = liquid_phi(i+1,j,k);
-        if(right_phi < 0) {
-          matrix.add_to_element(dof_idx,
-                                dof_idx, term);
-          matrix.add_to_element(dof_idx,
-                                dof_index(i+1,j,k), -term);
-        }
-        else {
-          float theta = fraction_inside(centre_phi, right_phi);
-          if(theta < 0.01f) theta = 0.01f;
-          matrix.add_to_element(dof_idx,
-                                dof_idx, term/theta);
-        }
-        rhs[dof_idx] -= (u_weights(i+1,j,k)*u(i+1,j,k) + (1.0-u_weights(i+1,j,k)) * u_solid(i+1,j,k)) / dx;
-        
-        //left neighbour
-        term = u_weights(i,j,k) * dt / sqr(dx) / rho;
-        float left_phi = liquid_phi(i-1,j,k);
-        if(left_phi < 0) {
-          matrix.add_to_element(dof_idx,
-                                dof_idx, term);
-          matrix.add_to_element(dof_idx,
-                                dof_index(i-1,j,k), -term);
-        }
-        else {
-          float theta = fraction_inside(centre_phi, left_phi);
-          if(theta < 0.01f) theta = 0.01f;
-          matrix.add_to_element(dof_idx,
-                                dof_idx, term/theta);
-        }
-        rhs[dof_idx] += (u_weights(i,j,k)*u(i,j,k) + (1.0-u_weights(i,j,k)) * u_solid(i,j,k)) / dx;
-        
-        //top neighbour
-        term = v_weights(i,j+1,k) * dt / sqr(dx) / rho;
-        float top_phi = liquid_phi(i,j+1,k);
-        if(top_phi < 0) {
-          matrix.add_to_element(dof_idx,
-                                dof_idx, term);
-          matrix.add_to_element(dof_idx,
-                                dof_index(i,j+1,k), -term);
-        }
-        else {
-          float theta = fraction_inside(centre_phi, top_phi);
-          if(theta < 0.01f) theta = 0.01f;
-          matrix.add_to_element(dof_idx,
-                                dof_idx, term/theta);
-        }
-        rhs[dof_idx] -= (v_weights(i,j+1,k)*v(i,j+1,k) + (1.0-v_weights(i,j+1,k)) * v_solid(i,j+1,k)) / dx;
-        
-        //bottom neighbour
-        term = v_weights(i,j,k) * dt / sqr(dx) / rho;
-        float bot_phi = liquid_phi(i,j-1,k);
-        if(bot_phi < 0) {
-          matrix.add_to_element(dof_idx,
-                                dof_idx, term);
-          matrix.add_to_element(dof_idx,
-                                dof_index(i,j-1,k), -term);
-        }
-        else {
-          float theta = fraction_inside(centre_phi, bot_phi);
-          if(theta < 0.01f) theta = 0.01f;
-          matrix.add_to_element(dof_idx,
-                                dof_idx, term/theta);
-        }
-        rhs[dof_idx] += (v_weights(i,j,k)*v(i,j,k) + (1.0-v_weights(i,j,k)) * v_solid(i,j,k)) / dx;
-        
-        
-        //far neighbour
-        term = w_weights(i,j,k+1) * dt / sqr(dx) / rho;
-        float far_phi = liquid_phi(i,j,k+1);
-        if(far_phi < 0) {
-          matrix.add_to_element(dof_idx,
-                                dof_idx, term);
-          matrix.add_to_element(dof_idx,
-                                dof_index(i,j,k+1), -term);
-        }
-        else {
-          float theta = fraction_inside(centre_phi, far_phi);
-          if(theta < 0.01f) theta = 0.01f;
-          matrix.add_to_element(dof_idx,
-                                dof_idx, term/theta);
-        }
-        rhs[dof_idx] -= (w_weights(i,j,k+1)*w(i,j,k+1) + (1.0-w_weights(i,j,k+1)) * w_solid(i,j,k+1)) / dx;
-        
-        //near neighbour
-        term = w_weights(i,j,k) * dt / sqr(dx) / rho;
-        float near_phi = liquid_phi(i,j,k-1);
-        if(near_phi < 0) {
-          matrix.add_to_element(dof_idx,
-                                dof_idx, term);
-          matrix.add_to_element(dof_idx,
-                                dof_index(i,j,k-1), -term);
-        }
-        else {
-          float theta = fraction_inside(centre_phi, near_phi);
-          if(theta < 0.01f) theta = 0.01f;
-          matrix.add_to_element(dof_idx,
-                                dof_idx, term/theta);
-        }
-        rhs[dof_idx] += (w_weights(i,j,k)*w(i,j,k) + (1.0-w_weights(i,j,k)) * w_solid(i,j,k)) / dx;
+        dof_index(i,j,k) = idx;
+        dof_ijk[idx] = Vector3i(i,j,k);
+        x[idx] = warm_start ? pressure[i + ni*(j + nj*k)] * warm_scale : 0;
+        ++idx;
       }
     }
   });
   
-  //Solve the system using Robert Bridson's incomplete Cholesky PCG solver
+  pressure.assign(pressure.size(), 0);
+  rhs.assign(num_dofs, 0);
+  
+  // faces in the order of the original assembly: right, left, top, bottom, far, near
+  const int face_offset[6][3] = {{1,0,0}, {-1,0,0}, {0,1,0}, {0,-1,0}, {0,0,1}, {0,0,-1}};
+  // the same faces sorted by the column of the neighbour: near, bottom, left | right, top, far
+  const int lower_faces[3] = {5, 3, 1};
+  const int upper_faces[3] = {0, 2, 4};
+  
+  auto is_interior = [&] (int i, int j, int k) {
+    return i>=1 && i<ni-1 && j>=1 && j<nj-1 && k>=1 && k<nk-1;
+  };
+  
+  //first pass: the diagonal plus one entry per liquid neighbour
+  matrix.resize(num_dofs);
+  matrix.rowstart[0] = 0;
+  threadutils::thread_pool::ParallelFor(0, (int) num_dofs, [&](int row) {
+    const Vector3i& c = dof_ijk[row];
+    unsigned count = 0;
+    if(is_interior(c(0), c(1), c(2))) {
+      count = 1;
+      for(int f = 0; f < 6; ++f) {
+        if(liquid_phi(c(0) + face_offset[f][0], c(1) + face_offset[f][1], c(2) + face_offset[f][2]) < 0) ++count;
+      }
+    }
+    matrix.rowstart[row + 1] = count;
+  });
+  for(unsigned row = 0; row < num_dofs; ++row) matrix.rowstart[row + 1] += matrix.rowstart[row];
+  matrix.colindex.resize(matrix.rowstart[num_dofs]);
+  matrix.value.resize(matrix.rowstart[num_dofs]);
+  
+  //second pass: fill every row in increasing column order
+  threadutils::thread_pool::ParallelFor(0, (int) num_dofs, [&](int row) {
+    const int i = dof_ijk[row](0);
+    const int j = dof_ijk[row](1);
+    const int k = dof_ijk[row](2);
+    if(!is_interior(i, j, k)) return;
+    
+    float centre_phi = liquid_phi(i,j,k);
+    const float term[6] = {
+      (float) (u_weights(i+1,j,k) * dt / sqr(dx) / rho),
+      (float) (u_weights(i,j,k) * dt / sqr(dx) / rho),
+      (float) (v_weights(i,j+1,k) * dt / sqr(dx) / rho),
+      (float) (v_weights(i,j,k) * dt / sqr(dx) / rho),
+      (float) (w_weights(i,j,k+1) * dt / sqr(dx) / rho),
+      (float) (w_weights(i,j,k) * dt / sqr(dx) / rho)
+    };
+    
+    bool liquid[6];
+    double diag = 0;
+    for(int f = 0; f < 6; ++f) {
+      float neighbour_phi = liquid_phi(i + face_offset[f][0], j + face_offset[f][1], k + face_offset[f][2]);
+      liquid[f] = neighbour_phi < 0;
+      if(liquid[f]) {
+        diag += term[f];
+      }
+      else {
+        float theta = fraction_inside(centre_phi, neighbour_phi);
+        if(theta < 0.01f) theta = 0.01f;
+        diag += term[f]/theta;
+      }
+    }
+    
+    unsigned pos = matrix.rowstart[row];
+    for(int f : lower_faces) {
+      if(!liquid[f]) continue;
+      matrix.colindex[pos] = dof_index(i + face_offset[f][0], j + face_offset[f][1], k + face_offset[f][2]);
+      matrix.value[pos++] = -term[f];
+    }
+    matrix.colindex[pos] = row;
+    matrix.value[pos++] = diag;
+    for(int f : upper_faces) {
+      if(!liquid[f]) continue;
+      matrix.colindex[pos] = dof_index(i + face_offset[f][0], j + face_offset[f][1], k + face_offset[f][2]);
+      matrix.value[pos++] = -term[f];
+    }
+    
+    double b = 0;
+    b -= (u_weights(i+1,j,k)*u(i+1,j,k) + (1.0-u_weights(i+1,j,k)) * u_solid(i+1,j,k)) / dx;
+    b += (u_weights(i,j,k)*u(i,j,k) + (1.0-u_weights(i,j,k)) * u_solid(i,j,k)) / dx;
+    b -= (v_weights(i,j+1,k)*v(i,j+1,k) + (1.0-v_weights(i,j+1,k)) * v_solid(i,j+1,k)) / dx;
+    b += (v_weights(i,j,k)*v(i,j,k) + (1.0-v_weights(i,j,k)) * v_solid(i,j,k)) / dx;
+    b -= (w_weights(i,j,k+1)*w(i,j,k+1) + (1.0-w_weights(i,j,k+1)) * w_solid(i,j,k+1)) / dx;
+    b += (w_weights(i,j,k)*w(i,j,k) + (1.0-w_weights(i,j,k)) * w_solid(i,j,k)) / dx;
+    rhs[row] = b;
+  });
+  
+  record.size = (int) num_dofs;
+  record.nonzeros = matrix.rowstart[num_dofs];
+  record.setup_time = timingutils::seconds() - t0;
+  t0 = timingutils::seconds();
   
   scalar tolerance;
   int iterations;
-  
   bool success = false;
 #ifdef USE_ROBERTS_SOLVER
-  solver.set_solver_parameters(1e-18, 1000);
-  success = solver.solve(matrix, rhs, pressure, tolerance, iterations);
-#else
-  success = AMGPCGSolveSparse(matrix,rhs,x,dof_ijk,1e-6,50,tolerance,iterations,ni,nj,nk);
+  //Robert Bridson's PCG with a multicolor MIC(0) preconditioner. The dofs are
+  //numbered lexicographically and the 7-point stencil only couples the plane
+  //i+j+k to the planes next to it, so coloring by i+j+k gives the same factor
+  //as the natural ordering while every plane is factored and solved in parallel
+  std::vector<unsigned int> dof_color(num_dofs);
+  threadutils::thread_pool::ParallelFor(0, (int) num_dofs, [&](int row) {
+    dof_color[row] = (unsigned int) (dof_ijk[row](0) + dof_ijk[row](1) + dof_ijk[row](2));
+  });
+  solver.set_solver_parameters(1e-6, 1000);
+  success = solver.solve_multicolor(matrix, dof_color, rhs, x, tolerance, iterations);
   
+  record.kind = "pressure_mic";
+  record.solve_time = timingutils::seconds() - t0;
+  record.residual_history.assign(solver.residual_history.begin(), solver.residual_history.end());
+#else
+  m_amg_hierarchy->single_precision = m_parent->getParameter().amg_single_precision;
+  m_amg_hierarchy->pipelined_cg = m_parent->getParameter().pipelined_pressure_cg;
+  success = AMGPCGSolveSparse(matrix,rhs,x,dof_ijk,*m_amg_hierarchy,1e-6,50,tolerance,iterations,ni,nj,nk,warm_start);
+  
+  const char* setup_kind[] = {"full", "partial", "numeric"};
+  std::cout << "[AMG setup: " << m_amg_hierarchy->setup_time << "s (" << setup_kind[m_amg_hierarchy->last_setup]
+            << ", " << m_amg_hierarchy->rebuilt_levels << " level(s) rebuilt)]" << std::endl;
+  
+  // the hierarchy is set up inside the solve
+  record.kind = m_amg_hierarchy->pipelined_cg ? "pressure_amg_pipelined" : "pressure_amg";
+  record.setup_time += m_amg_hierarchy->setup_time;
+  record.solve_time = timingutils::seconds() - t0 - m_amg_hierarchy->setup_time;
+  record.residual_history = m_amg_hierarchy->residual_history;
 #endif
+  record.iterations = iterations;
+  record.residual = tolerance;
+  record.converged = success;
+  
+  threadutils::thread_pool::ParallelFor(0, (int) num_dofs, [&](int row) {
+    const Vector3i& c = dof_ijk[row];
+    pressure[c(0) + ni*(c(1) + nj*c(2))] = x[row];
+  });
+  
+  return success;
+}
 
-  if(!success) {
-    printf("WARNING: Pressure solve failed!************************************************\n");
-    
-    std::cout << "rhs=[";
-    for(scalar s : rhs) {
-      std::cout << s << "; ";
-    }
-    std::cout << "];" << std::endl;
-    
-    std::cout << "pressure=[";
-    for(scalar s : pressure) {
-      std::cout << s << "; ";
-    }
-    std::cout << "];" << std::endl;
-    
-    write_matlab_array(std::cout, u, "u");
-    write_matlab_array(std::cout, v, "v");
-    write_matlab_array(std::cout, w, "w");
-
-    write_matlab_array(std::cout, u_solid, "u_solid");
-    write_matlab_array(std::cout, v_solid, "v_solid");
-    write_matlab_array(std::cout, w_solid, "w_solid");
-    
-    write_matlab_array(std::cout, u_hair, "u_hair");
-    write_matlab_array(std::cout, v_hair, "v_hair");
-    write_matlab_array(std::cout, w_hair, "w_hair");
-    
-    write_matlab_array(std::cout, u_particle, "u_particle");
-    write_matlab_array(std::cout, v_particle, "v_particle");
-    write_matlab_array(std::cout, w_particle, "w_particle");
-    
-    write_matlab_array(std::cout, u_drag, "u_drag");
-    write_matlab_array(std::cout, v_drag, "v_drag");
-    write_matlab_array(std::cout, w_drag, "w_drag");
-    
-    write_matlab_array(std::cout, u_weights, "u_weights");
-    write_matlab_array(std::cout, v_weights, "v_weights");
-    write_matlab_array(std::cout, w_weights, "w_weights");
-   
-    write_matlab_array(std::cout, u_weight_particle, "u_weight_particle");
-    write_matlab_array(std::cout, v_weight_particle, "v_weight_particle");
-    write_matlab_array(std::cout, w_weight_particle, "w_weight_particle");
-    
-    write_matlab_array(std::cout, u_weight_hair, "u_weight_hair");
-    write_matlab_array(std::cout, v_weight_hair, "v_weight_hair");
-    write_matlab_array(std::cout, w_weight_hair, "w_weight_hair");
-    
-    write_matlab_array(std::cout, u_weight_total, "u_weight_total");
-    write_matlab_array(std::cout, v_weight_total, "v_weight_total");
-    write_matlab_array(std::cout, w_weight_total, "w_weight_total");
-    
-    write_matlab_array(std::cout, liquid_phi, "liquid_phi");
-    
-    
-    exit(0);
+//Solve the pressure system matrix-free on the grid with geometric multigrid PCG.
+//Only the diagonal and the face couplings (face weights and ghost-fluid theta terms)
+//of the 7-point stencil are stored; the sparse matrix is never assembled.
+bool FluidSim3D::solve_pressure_gmg(scalar dt, LinearSolveRecord& record) {
+  double t0 = timingutils::seconds();
+  
+  int ni = v.ni;
+  int nj = u.nj;
+  int nk = u.nk;
+  
+  int system_size = ni*nj*nk;
+  if((int) rhs.size() != system_size) {
+    rhs.resize(system_size);
+    pressure.resize(system_size);
+  }
+  
+  const scalar rho = m_parent->getLiquidDensity();
+  const scalar coef = dt / sqr(dx) / rho;
+  
+  // the last pressure (rescaled to the new dt) seeds the cells that stayed liquid,
+  // the solver zeroes it everywhere else
+  const bool warm_start = m_parent->getParameter().warm_start_pressure && m_last_pressure_dt > 0.0;
+  if(warm_start && m_last_pressure_dt != dt) {
+    const scalar warm_scale = m_last_pressure_dt / dt;
+    threadutils::thread_pool::ParallelFor(0, system_size, [&](int idx) {
+      pressure[idx] *= warm_scale;
+    });
   }
   
-  threadutils::thread_pool::ParallelFor(0, ni*nj*nk, [&](int idx) {
-    if(liquid_phi.a[idx]<0)
-      pressure[idx] = x[dof_index.a[idx]];
+  PoissonGridLevel<scalar>& A = m_mg_solver.finest(ni, nj, nk);
+  
+  auto is_dof = [&] (int i, int j, int k) -> bool {
+    return i>=1 && i<ni-1 && j>=1 && j<nj-1 && k>=1 && k<nk-1 && liquid_phi(i,j,k) < 0;
+  };
+  
+  // dofs and couplings of every slab, for the statistics
+  std::vector<long> slab_dofs(nk, 0), slab_couplings(nk, 0);
+  
+  threadutils::thread_pool::ParallelFor(0, nk, [&](int k) {
+    for(int j = 0; j < nj; ++j) for(int i = 0; i < ni; ++i) {
+      int idx = i + ni*(j + nj*k);
+      rhs[idx] = 0;
+      if(!is_dof(i,j,k)) continue;
+      
+      ++slab_dofs[k];
+      A.mask(i,j,k) = 1;
+      float centre_phi = liquid_phi(i,j,k);
+      scalar diag = 0;
+      
+      // liquid neighbours contribute to the diagonal (and couple through the forward faces),
+      // air neighbours contribute the ghost-fluid term/theta
+      auto add_face = [&] (scalar weight, float nbr_phi, bool forward, bool nbr_dof, scalar& coupling) {
+        scalar term = weight * coef;
+        if(nbr_phi < 0) {
+          diag += term;
+          if(forward && nbr_dof) coupling = term;
+        } else {
+          float theta = fraction_inside(centre_phi, nbr_phi);
+          if(theta < 0.01f) theta = 0.01f;
+          diag += term / theta;
+        }
+      };
+      
+      add_face(u_weights(i+1,j,k), liquid_phi(i+1,j,k), true, is_dof(i+1,j,k), A.cx(i,j,k));
+      add_face(u_weights(i,j,k), liquid_phi(i-1,j,k), false, false, A.cx(i,j,k));
+      add_face(v_weights(i,j+1,k), liquid_phi(i,j+1,k), true, is_dof(i,j+1,k), A.cy(i,j,k));
+      add_face(v_weights(i,j,k), liquid_phi(i,j-1,k), false, false, A.cy(i,j,k));
+      add_face(w_weights(i,j,k+1), liquid_phi(i,j,k+1), true, is_dof(i,j,k+1), A.cz(i,j,k));
+      add_face(w_weights(i,j,k), liquid_phi(i,j,k-1), false, false, A.cz(i,j,k));
+      A.diag(i,j,k) = diag;
+      slab_couplings[k] += (A.cx(i,j,k) != 0) + (A.cy(i,j,k) != 0) + (A.cz(i,j,k) != 0);
+      
+      rhs[idx] -= (u_weights(i+1,j,k)*u(i+1,j,k) + (1.0-u_weights(i+1,j,k)) * u_solid(i+1,j,k)) / dx;
+      rhs[idx] += (u_weights(i,j,k)*u(i,j,k) + (1.0-u_weights(i,j,k)) * u_solid(i,j,k)) / dx;
+      rhs[idx] -= (v_weights(i,j+1,k)*v(i,j+1,k) + (1.0-v_weights(i,j+1,k)) * v_solid(i,j+1,k)) / dx;
+      rhs[idx] += (v_weights(i,j,k)*v(i,j,k) + (1.0-v_weights(i,j,k)) * v_solid(i,j,k)) / dx;
+      rhs[idx] -= (w_weights(i,j,k+1)*w(i,j,k+1) + (1.0-w_weights(i,j,k+1)) * w_solid(i,j,k+1)) / dx;
+      rhs[idx] += (w_weights(i,j,k)*w(i,j,k) + (1.0-w_weights(i,j,k)) * w_solid(i,j,k)) / dx;
+    }
   });
   
-  //Apply the velocity update
+  m_mg_solver.buildHierarchy();
+  
+  record.kind = m_parent->getParameter().pipelined_pressure_cg ? "pressure_gmg_pipelined" : "pressure_gmg";
+  record.size = (int) std::accumulate(slab_dofs.begin(), slab_dofs.end(), 0L);
+  record.nonzeros = record.size + 2 * std::accumulate(slab_couplings.begin(), slab_couplings.end(), 0L);
+  record.setup_time = timingutils::seconds() - t0;
+  t0 = timingutils::seconds();
+  
+  scalar tolerance;
+  int iterations;
+  m_mg_solver.pipelined = m_parent->getParameter().pipelined_pressure_cg;
+  bool success = m_mg_solver.solve(rhs, pressure, 1e-6, 50, tolerance, iterations, warm_start);
+  
+  record.solve_time = timingutils::seconds() - t0;
+  record.iterations = iterations;
+  record.residual = tolerance;
+  record.converged = success;
+  record.residual_history = m_mg_solver.residual_history;
+  
+  return success;
+}
+
+//An implementation of the variational pressure projection solve for static geometry
+void FluidSim3D::solve_pressure(scalar dt) {
+  int ni = v.ni;
+  int nj = u.nj;
+  int slice;
+  
+  const scalar rho = m_parent->getLiquidDensity();
+  
+  LinearSolveRecord record;
+  
+  bool success = false;
+  if(m_parent->getParameter().pressure_solver_mode == PSM_GEOMETRIC_MG)
+    success = solve_pressure_gmg(dt, record);
+  else
+    success = solve_pressure_amg(dt, record);
+  
+  m_last_pressure_dt = dt;
+  
+  std::cout << "[Pressure " << (m_parent->getParameter().pipelined_pressure_cg ? "pipelined " : "") << "PCG total iter: "
+            << record.iterations << ", res: " << record.residual << "]" << std::endl;
+  
+  m_parent->recordLinearSolve(record);
+
+  // the last iterate is still used for the projection, the failure shows up in the solver statistics
+  if(!success) {
+    printf("WARNING: Pressure solve failed!************************************************\n");
+  }
+  
+  //Apply the velocity update. Faces in unallocated tiles keep the background
   u_valid.assign(0);
   u_pressure_grad.assign(0.0);
   int compute_num = u.ni*u.nj*u.nk;
@@ -1877,7 +2351,7 @@ void FluidSim3D::solve_pressure(scalar dt) {
     int k = thread_idx/slice;
     int j = (thread_idx%slice)/u.ni;
     int i = thread_idx%u.ni;
-    if(k<u.nk && j<u.nj && i<u.ni-1 && i>0)
+    if(k<u.nk && j<u.nj && i<u.ni-1 && i>0 && u.is_allocated(i,j,k))
     {
       int index = i + j*ni + k*ni*nj;
       if(u_weights(i,j,k) > 0) {
@@ -1887,12 +2361,12 @@ void FluidSim3D::solve_pressure(scalar dt) {
             theta = fraction_inside(liquid_phi(i-1,j,k), liquid_phi(i,j,k));
           if(theta < 0.01) theta = 0.01;
           scalar pressure_grad = (pressure[index] - pressure[index-1]) / dx / theta;
-          u(i,j,k) -= dt * pressure_grad / rho;
-          u_pressure_grad(i, j, k) = pressure_grad;
-          u_valid(i,j,k) = 1;
+          u.ref(i,j,k) -= dt * pressure_grad / rho;
+          u_pressure_grad.ref(i, j, k) = pressure_grad;
+          u_valid.ref(i,j,k) = 1;
         }
       } else {
-        u(i, j, k) = 0.0;
+        u.ref(i, j, k) = 0.0;
       }
     }
   });
@@ -1906,7 +2380,7 @@ void FluidSim3D::solve_pressure(scalar dt) {
     int k = thread_idx/slice;
     int j = (thread_idx%slice)/v.ni;
     int i = thread_idx%v.ni;
-    if(k<v.nk && j>0 && j<v.nj-1 && i<v.ni)
+    if(k<v.nk && j>0 && j<v.nj-1 && i<v.ni && v.is_allocated(i,j,k))
     {
       int index = i + j*ni + k*ni*nj;
       if(v_weights(i,j,k) > 0) {
@@ -1916,12 +2390,12 @@ void FluidSim3D::solve_pressure(scalar dt) {
             theta = fraction_inside(liquid_phi(i,j-1,k), liquid_phi(i,j,k));
           if(theta < 0.01) theta = 0.01;
           scalar pressure_grad = (pressure[index] - pressure[index-ni]) / dx / theta;
-          v(i,j,k) -= dt * pressure_grad / rho;
-          v_pressure_grad(i, j, k) = pressure_grad;
-          v_valid(i,j,k) = 1;
+          v.ref(i,j,k) -= dt * pressure_grad / rho;
+          v_pressure_grad.ref(i, j, k) = pressure_grad;
+          v_valid.ref(i,j,k) = 1;
         }
       } else {
-        v(i, j, k) = 0.0;
+        v.ref(i, j, k) = 0.0;
       }
     }
   });
@@ -1935,7 +2409,7 @@ void FluidSim3D::solve_pressure(scalar dt) {
     int k = thread_idx/slice;
     int j = (thread_idx%slice)/w.ni;
     int i = thread_idx%w.ni;
-    if(k>0 && k<w.nk-1 && j<w.nj && i<w.ni)
+    if(k>0 && k<w.nk-1 && j<w.nj && i<w.ni && w.is_allocated(i,j,k))
     {
       int index = i + j*ni + k*ni*nj;
       if(w_weights(i,j,k) > 0) {
@@ -1945,12 +2419,12 @@ void FluidSim3D::solve_pressure(scalar dt) {
             theta = fraction_inside(liquid_phi(i,j,k-1), liquid_phi(i,j,k));
           if(theta < 0.01) theta = 0.01;
           scalar pressure_grad = (pressure[index] - pressure[index-ni*nj]) / dx / theta;
-          w(i,j,k) -= dt * pressure_grad / rho;
-          w_pressure_grad(i, j, k) = pressure_grad;
-          w_valid(i,j,k) = 1;
+          w.ref(i,j,k) -= dt * pressure_grad / rho;
+          w_pressure_grad.ref(i, j, k) = pressure_grad;
+          w_valid.ref(i,j,k) = 1;
         }
       } else {
-        w(i, j, k) = 0.0;
+        w.ref(i, j, k) = 0.0;
       }
     }
   });
@@ -2022,11 +2496,14 @@ void FluidSim3D::init_hair_particles()
       accu_length += release_radius;
     }
   }
+  
+  m_particle_index_dirty = true;
 }
 
 void FluidSim3D::init_random_particles(const scalar& rl, const scalar& rr, const scalar& rb, const scalar& rt, const scalar& rf, const scalar& rk)
 {
   particles.clear();
+  m_particle_index_dirty = true;
   
   int num_particle = ni * nj * nk;
   
@@ -2063,7 +2540,63 @@ void FluidSim3D::init_random_particles(const scalar& rl, const scalar& rr, const
 
 void FluidSim3D::sort_particles()
 {
-  m_sorter->sort(particles.size(), sorter_callback);
+  if(!m_particle_index_dirty) return;
+  
+  m_sorter->sort(particles.size(), sorter_callback(this));
+  m_particle_index_dirty = false;
+}
+
+//Interleave the low 10 bits of i, j and k (x fastest)
+static inline uint32_t morton_code(int i, int j, int k)
+{
+  auto spread = [] (uint32_t x) {
+    x &= 0x3FF;
+    x = (x | (x << 16)) & 0x030000FF;
+    x = (x | (x << 8)) & 0x0300F00F;
+    x = (x | (x << 4)) & 0x030C30C3;
+    x = (x | (x << 2)) & 0x09249249;
+    return x;
+  };
+  return spread((uint32_t) i) | (spread((uint32_t) j) << 1) | (spread((uint32_t) k) << 2);
+}
+
+//Move the particles into the Morton order of their cells, so that the particles of a cell and of
+//the cells around it are close in memory for the neighbor loops. Particle indices stored in the
+//bridges are remapped through the old-to-new table. The sorter has to be rebuilt afterwards.
+void FluidSim3D::reorder_particles()
+{
+  const int np = (int) particles.size();
+  if(np == 0) return;
+  
+  sorter_callback cell_of(this);
+  std::vector<uint64_t> keys(np);
+  threadutils::thread_pool::ParallelFor(0, np, [&] (int n) {
+    int i, j, k;
+    cell_of(n, i, j, k);
+    keys[n] = (uint64_t) morton_code(i, j, k) << 32UL | (uint64_t) n;
+  });
+  
+  tbb::parallel_sort(keys.begin(), keys.end());
+  
+  std::vector<int> order(np);
+  std::vector<int> old_to_new(np);
+  threadutils::thread_pool::ParallelFor(0, np, [&] (int n) {
+    const int old = (int) (keys[n] & 0xFFFFFFFFUL);
+    order[n] = old;
+    old_to_new[old] = n;
+  });
+  particles.permute(order);
+  
+  for(HairParticleBridge<3>& b : m_bridges) {
+    if(b.pidx >= 0 && b.pidx < np) b.pidx = old_to_new[b.pidx];
+  }
+  for(std::vector< HairParticleBridge<3> >& buffer : m_hair_bridge_buffer) {
+    for(HairParticleBridge<3>& b : buffer) {
+      if(b.pidx >= 0 && b.pidx < np) b.pidx = old_to_new[b.pidx];
+    }
+  }
+  
+  m_particle_index_dirty = true;
 }
 
 scalar FluidSim3D::dropvol(const scalar& radii) const
@@ -2078,250 +2611,312 @@ scalar FluidSim3D::dropradius(const scalar& vol) const
 
 void FluidSim3D::map_p2g(bool with_hair_particles)
 {
+  if(m_parent->getParameter().scatter_p2g) {
+    map_p2g_scatter(with_hair_particles);
+    return;
+  }
+  
+  sort_particles();
+  
   const scalar rho = m_parent->getLiquidDensity();
   //u-component of velocity
-  threadutils::thread_pool::ParallelFor(0, nk, [&] (int k){
-    for(int j = 0; j < nj; ++j) for(int i = 0; i < ni+1; ++i) {
-      Vector3s pos = Vector3s(i*dx, (j+0.5)*dx, (k+0.5)*dx) + origin;
-      scalar sumw = 0.0;
-      scalar sumw_pure = 0.0;
-      scalar sumu = 0.0;
+  for_each_active_cell(u_particle, [&] (int i, int j, int k) {
+    Vector3s pos = Vector3s(i*dx, (j+0.5)*dx, (k+0.5)*dx) + origin;
+    scalar sumw = 0.0;
+    scalar sumw_pure = 0.0;
+    scalar sumu = 0.0;
+    
+    m_sorter->getNeigboringParticles_cell(i, j, k, -1, 0, -1, 1, -1, 1, [&] (int pidx) {
+      if(!with_hair_particles && particles.type[pidx] == PT_HAIR) return;
       
-      m_sorter->getNeigboringParticles_cell(i, j, k, -1, 0, -1, 1, -1, 1, [&] (int pidx) {
-        const Particle<3>& p = particles[pidx];
-        if(!with_hair_particles && p.type == PT_HAIR) return;
-        
-        Vector3s diff = p.x - pos;
-        
-        scalar w = dropvol(p.radii) * rho * linear_kernel(diff, dx);
-        sumu += w * (p.v(0) - p.c.col(0).dot(diff));
-        sumw += w;
-        if(p.type == PT_LIQUID) sumw_pure += w;
-      });
+      Vector3s diff = particles.x[pidx] - pos;
       
-      u_particle(i, j, k) = sumw ? sumu / sumw : 0.0;
-      u_weight_particle(i, j, k) = sumw_pure;
-    }
+      scalar w = dropvol(particles.radii[pidx]) * rho * linear_kernel(diff, dx);
+      sumu += w * (particles.v[pidx](0) - particles.c[pidx].col(0).dot(diff));
+      sumw += w;
+      if(particles.type[pidx] == PT_LIQUID) sumw_pure += w;
+    });
+    
+    u_particle.ref(i, j, k) = sumw ? sumu / sumw : 0.0;
+    u_weight_particle.ref(i, j, k) = sumw_pure;
   });
   
   //v-component of velocity
-  threadutils::thread_pool::ParallelFor(0, nk, [&] (int k){
-    for(int j = 0; j < nj+1; ++j) for(int i = 0; i < ni; ++i) {
-      Vector3s pos = Vector3s((i+0.5)*dx, j*dx, (k+0.5)*dx) + origin;
+  for_each_active_cell(v_particle, [&] (int i, int j, int k) {
+    Vector3s pos = Vector3s((i+0.5)*dx, j*dx, (k+0.5)*dx) + origin;
 
-      scalar sumw = 0.0;
-      scalar sumw_pure = 0.0;
-      scalar sumu = 0.0;
-      
-      m_sorter->getNeigboringParticles_cell(i, j, k, -1, 1, -1, 0, -1, 1, [&] (int pidx) {
-        const Particle<3>& p = particles[pidx];
-        if(!with_hair_particles && p.type == PT_HAIR) return;
-        Vector3s diff = p.x - pos;
-        
-        scalar w = dropvol(p.radii) * rho * linear_kernel(diff, dx);
-        sumu += w * (p.v(1) - p.c.col(1).dot(diff));
-        sumw += w;
-        if(p.type == PT_LIQUID) sumw_pure += w;
-      });
+    scalar sumw = 0.0;
+    scalar sumw_pure = 0.0;
+    scalar sumu = 0.0;
+    
+    m_sorter->getNeigboringParticles_cell(i, j, k, -1, 1, -1, 0, -1, 1, [&] (int pidx) {
+      if(!with_hair_particles && particles.type[pidx] == PT_HAIR) return;
+      Vector3s diff = particles.x[pidx] - pos;
       
-      v_particle(i, j, k) = sumw ? sumu / sumw : 0.0;
-      v_weight_particle(i, j, k) = sumw_pure;
-    }
+      scalar w = dropvol(particles.radii[pidx]) * rho * linear_kernel(diff, dx);
+      sumu += w * (particles.v[pidx](1) - particles.c[pidx].col(1).dot(diff));
+      sumw += w;
+      if(particles.type[pidx] == PT_LIQUID) sumw_pure += w;
+    });
+    
+    v_particle.ref(i, j, k) = sumw ? sumu / sumw : 0.0;
+    v_weight_particle.ref(i, j, k) = sumw_pure;
   });
   
   //w-component of velocity
-  threadutils::thread_pool::ParallelFor(0, nk+1, [&] (int k){
-    for(int j = 0; j < nj; ++j) for(int i = 0; i < ni; ++i) {
-      Vector3s pos = Vector3s((i+0.5)*dx, (j+0.5)*dx, k*dx) + origin;
-      
-      scalar sumw = 0.0;
-      scalar sumu = 0.0;
-      scalar sumw_pure = 0.0;
-      m_sorter->getNeigboringParticles_cell(i, j, k, -1, 1, -1, 1, -1, 0, [&] (int pidx) {
-        const Particle<3>& p = particles[pidx];
-        if(!with_hair_particles && p.type == PT_HAIR) return;
-        Vector3s diff = p.x - pos;
-        
-        scalar w = dropvol(p.radii) * rho * linear_kernel(diff, dx);
-        sumu += w * (p.v(2) - p.c.col(2).dot(diff));
-        sumw += w;
-        if(p.type == PT_LIQUID) sumw_pure += w;
-      });
+  for_each_active_cell(w_particle, [&] (int i, int j, int k) {
+    Vector3s pos = Vector3s((i+0.5)*dx, (j+0.5)*dx, k*dx) + origin;
+    
+    scalar sumw = 0.0;
+    scalar sumu = 0.0;
+    scalar sumw_pure = 0.0;
+    m_sorter->getNeigboringParticles_cell(i, j, k, -1, 1, -1, 1, -1, 0, [&] (int pidx) {
+      if(!with_hair_particles && particles.type[pidx] == PT_HAIR) return;
+      Vector3s diff = particles.x[pidx] - pos;
+      
+      scalar w = dropvol(particles.radii[pidx]) * rho * linear_kernel(diff, dx);
+      sumu += w * (particles.v[pidx](2) - particles.c[pidx].col(2).dot(diff));
+      sumw += w;
+      if(particles.type[pidx] == PT_LIQUID) sumw_pure += w;
+    });
 
-      w_particle(i, j, k) = sumw ? sumu / sumw : 0.0;
-      w_weight_particle(i, j, k) = sumw_pure;
-    }
+    w_particle.ref(i, j, k) = sumw ? sumu / sumw : 0.0;
+    w_weight_particle.ref(i, j, k) = sumw_pure;
+  });
+}
+
+//Particle-centric version of map_p2g. A particle adds its contribution to every face whose
+//gather window in map_p2g holds its cell, so both give the same fields up to the order of
+//summation, while each particle is read once instead of once per face around it. A particle
+//only writes to faces within two cells of its own, so for_each_particle_by_blocks runs it
+//without locking.
+void FluidSim3D::map_p2g_scatter(bool with_hair_particles)
+{
+  const scalar rho = m_parent->getLiquidDensity();
+  
+  for_each_active_cell(u_particle, [&] (int i, int j, int k) {
+    u_momentum_scatter.ref(i, j, k) = u_weight_scatter.ref(i, j, k) = u_liquid_weight_scatter.ref(i, j, k) = 0.0;
+  });
+  for_each_active_cell(v_particle, [&] (int i, int j, int k) {
+    v_momentum_scatter.ref(i, j, k) = v_weight_scatter.ref(i, j, k) = v_liquid_weight_scatter.ref(i, j, k) = 0.0;
+  });
+  for_each_active_cell(w_particle, [&] (int i, int j, int k) {
+    w_momentum_scatter.ref(i, j, k) = w_weight_scatter.ref(i, j, k) = w_liquid_weight_scatter.ref(i, j, k) = 0.0;
+  });
+  
+  // adds the particle pidx of cell (ci, cj, ck) to the faces
+  auto scatter = [&] (int pidx, int ci, int cj, int ck) {
+    if(!with_hair_particles && particles.type[pidx] == PT_HAIR) return;
+    
+    const Vector3s& x = particles.x[pidx];
+    const Vector3s& v = particles.v[pidx];
+    const Matrix3s& c = particles.c[pidx];
+    const scalar mass = dropvol(particles.radii[pidx]) * rho;
+    const bool liquid = particles.type[pidx] == PT_LIQUID;
+    
+    //u-component of velocity
+    for(int k = std::max(0, ck - 1); k <= std::min(nk - 1, ck + 1); ++k)
+      for(int j = std::max(0, cj - 1); j <= std::min(nj - 1, cj + 1); ++j)
+        for(int i = ci; i <= ci + 1; ++i) {
+          Vector3s diff = x - (Vector3s(i*dx, (j+0.5)*dx, (k+0.5)*dx) + origin);
+          scalar w = mass * linear_kernel(diff, dx);
+          if(w == 0.0) continue;
+          u_momentum_scatter.ref(i, j, k) += w * (v(0) - c.col(0).dot(diff));
+          u_weight_scatter.ref(i, j, k) += w;
+          if(liquid) u_liquid_weight_scatter.ref(i, j, k) += w;
+        }
+    
+    //v-component of velocity
+    for(int k = std::max(0, ck - 1); k <= std::min(nk - 1, ck + 1); ++k)
+      for(int j = cj; j <= cj + 1; ++j)
+        for(int i = std::max(0, ci - 1); i <= std::min(ni - 1, ci + 1); ++i) {
+          Vector3s diff = x - (Vector3s((i+0.5)*dx, j*dx, (k+0.5)*dx) + origin);
+          scalar w = mass * linear_kernel(diff, dx);
+          if(w == 0.0) continue;
+          v_momentum_scatter.ref(i, j, k) += w * (v(1) - c.col(1).dot(diff));
+          v_weight_scatter.ref(i, j, k) += w;
+          if(liquid) v_liquid_weight_scatter.ref(i, j, k) += w;
+        }
+    
+    //w-component of velocity
+    for(int k = ck; k <= ck + 1; ++k)
+      for(int j = std::max(0, cj - 1); j <= std::min(nj - 1, cj + 1); ++j)
+        for(int i = std::max(0, ci - 1); i <= std::min(ni - 1, ci + 1); ++i) {
+          Vector3s diff = x - (Vector3s((i+0.5)*dx, (j+0.5)*dx, k*dx) + origin);
+          scalar w = mass * linear_kernel(diff, dx);
+          if(w == 0.0) continue;
+          w_momentum_scatter.ref(i, j, k) += w * (v(2) - c.col(2).dot(diff));
+          w_weight_scatter.ref(i, j, k) += w;
+          if(liquid) w_liquid_weight_scatter.ref(i, j, k) += w;
+        }
+  };
+  
+  for_each_particle_by_blocks(scatter);
+  
+  for_each_active_cell(u_particle, [&] (int i, int j, int k) {
+    const scalar sumw = u_weight_scatter(i, j, k);
+    u_particle.ref(i, j, k) = sumw ? u_momentum_scatter(i, j, k) / sumw : 0.0;
+    u_weight_particle.ref(i, j, k) = u_liquid_weight_scatter(i, j, k);
+  });
+  for_each_active_cell(v_particle, [&] (int i, int j, int k) {
+    const scalar sumw = v_weight_scatter(i, j, k);
+    v_particle.ref(i, j, k) = sumw ? v_momentum_scatter(i, j, k) / sumw : 0.0;
+    v_weight_particle.ref(i, j, k) = v_liquid_weight_scatter(i, j, k);
+  });
+  for_each_active_cell(w_particle, [&] (int i, int j, int k) {
+    const scalar sumw = w_weight_scatter(i, j, k);
+    w_particle.ref(i, j, k) = sumw ? w_momentum_scatter(i, j, k) / sumw : 0.0;
+    w_weight_particle.ref(i, j, k) = w_liquid_weight_scatter(i, j, k);
   });
 }
 
+//The velocities and affine matrices are interpolated in one pass over runs of G2P_BATCH particles,
+//which macinterp::interpolate_mac splits into SIMD packets.
 void FluidSim3D::map_g2p_apic()
 {
-  int np = particles.size();
-  threadutils::thread_pool::ParallelFor(0, np, [&] (int k){
-    Particle<3>& p = particles[k];
-    p.v = get_velocity(p.x);
-    p.c = get_affine_matrix(p.x);
-    p.pressure = get_pressure(p.x);
+  const int np = particles.size();
+  const int nbatches = (np + G2P_BATCH - 1) / G2P_BATCH;
+  threadutils::thread_pool::ParallelFor(0, nbatches, [&] (int b){
+    const int start = b * G2P_BATCH;
+    const int count = std::min(G2P_BATCH, np - start);
+    macinterp::interpolate_mac(u, v, w, origin, dx, &particles.x[start], count, &particles.v[start], &particles.c[start]);
+    for(int k = start; k < start + count; ++k) {
+      particles.pressure[k] = get_pressure(particles.x[k]);
+    }
   });
 }
 
+void FluidSim3D::VelDragTiles::reset(int ni_, int nj_, int nk_)
+{
+  if(ni_ != ni || nj_ != nj || nk_ != nk) {
+    ni = ni_;
+    nj = nj_;
+    nk = nk_;
+    nti = SparseArray3s::num_tiles_for(ni);
+    ntj = SparseArray3s::num_tiles_for(nj);
+    tile_slot.assign((size_t) nti * ntj * SparseArray3s::num_tiles_for(nk), -1);
+  } else {
+    for(int t : active_tiles) tile_slot[t] = -1;
+  }
+  active_tiles.clear();
+  pool.clear();
+}
+
+FluidSim3D::VelDragAccumulator& FluidSim3D::get_vel_drag_accumulator(int ibuffer)
+{
+  return m_vel_drag_accumulators[ibuffer];
+}
+
 void FluidSim3D::prepare_update_from_hair()
 {
-  int nflows = m_parent->getNumFlows();
-  if(u_edge_vel_drag.size() != nflows) u_edge_vel_drag.resize(nflows);
-  if(v_edge_vel_drag.size() != nflows) v_edge_vel_drag.resize(nflows);
-  if(w_edge_vel_drag.size() != nflows) w_edge_vel_drag.resize(nflows);
-  
-  if(u_num_edge_voxel_intersections.size() != nflows) u_num_edge_voxel_intersections.resize(nflows);
-  if(v_num_edge_voxel_intersections.size() != nflows) v_num_edge_voxel_intersections.resize(nflows);
-  if(w_num_edge_voxel_intersections.size() != nflows) w_num_edge_voxel_intersections.resize(nflows);
+  m_vel_drag_accumulators.resize(m_parent->getNumFlowBuffers());
+  for(VelDragAccumulator& acc : m_vel_drag_accumulators) {
+    for(int c = 0; c < 3; ++c) acc.face[c].reset(ni, nj, nk);
+  }
 }
 
 void FluidSim3D::done_update_from_hair()
 {
-  int nflows = m_parent->getNumFlows();
-  if(!nflows) return;
-  
-  threadutils::thread_pool::ParallelFor(0, nflows, [&] (int i) {
-    u_num_edge_voxel_intersections[i] = u_edge_vel_drag[i].size();
-    v_num_edge_voxel_intersections[i] = v_edge_vel_drag[i].size();
-    w_num_edge_voxel_intersections[i] = w_edge_vel_drag[i].size();
-  });
-  
-  std::partial_sum(u_num_edge_voxel_intersections.begin(), u_num_edge_voxel_intersections.end(), u_num_edge_voxel_intersections.begin());
-  std::partial_sum(v_num_edge_voxel_intersections.begin(), v_num_edge_voxel_intersections.end(), v_num_edge_voxel_intersections.begin());
-  std::partial_sum(w_num_edge_voxel_intersections.begin(), w_num_edge_voxel_intersections.end(), w_num_edge_voxel_intersections.begin());
-  
-  int usize = u_num_edge_voxel_intersections[nflows - 1];
-  int vsize = v_num_edge_voxel_intersections[nflows - 1];
-  int wsize = w_num_edge_voxel_intersections[nflows - 1];
-  
-  if(usize == 0 && vsize == 0 && wsize == 0) return;
-  
-  u_vel_drag.resize(usize);
-  v_vel_drag.resize(vsize);
-  w_vel_drag.resize(wsize);
-  
-  threadutils::thread_pool::ParallelFor(0, nflows, [&] (int i) {
-    int u_base_idx = (i == 0) ? 0 : u_num_edge_voxel_intersections[i - 1];
-    memcpy(&u_vel_drag[u_base_idx], &u_edge_vel_drag[i][0], u_edge_vel_drag[i].size() * sizeof(EdgeVelDragIntersection<3>));
-    
-    int v_base_idx = (i == 0) ? 0 : v_num_edge_voxel_intersections[i - 1];
-    memcpy(&v_vel_drag[v_base_idx], &v_edge_vel_drag[i][0], v_edge_vel_drag[i].size() * sizeof(EdgeVelDragIntersection<3>));
-    
-    int w_base_idx = (i == 0) ? 0 : w_num_edge_voxel_intersections[i - 1];
-    memcpy(&w_vel_drag[w_base_idx], &w_edge_vel_drag[i][0], w_edge_vel_drag[i].size() * sizeof(EdgeVelDragIntersection<3>));
-  });
-
-  m_sorter->sort(u_vel_drag.size(), [&] (int pidx, int& i, int& j, int& k) {
-    i = std::max(0, std::min(m_sorter->ni - 1, u_vel_drag[pidx].coord(0)));
-    j = std::max(0, std::min(m_sorter->nj - 1, u_vel_drag[pidx].coord(1)));
-    k = std::max(0, std::min(m_sorter->nk - 1, u_vel_drag[pidx].coord(2)));
-  });
-  
-  const scalar rho_L = m_parent->getLiquidDensity();
-  
-  threadutils::thread_pool::ParallelFor(0, u.nk, [&] (int k){
-    for(int j = 0; j < u.nj; ++j) for(int i = 0; i < u.ni; ++i) {
-      scalar sum_vel = 0.0;
-      scalar sum_drag = 0.0;
-      scalar sum_weight = 0.0;
-      scalar sum_linear_weight = 0.0;
-      scalar sum_vol = 0.0;
-      
-      m_sorter->getCellAt(i, j, k, [&] (int idx) {
-        const EdgeVelDragIntersection<3>& inter = u_vel_drag[idx];
-        sum_vel += inter.vel_weighted;
-        sum_drag += inter.drag_weighted;
-        sum_weight += inter.weight;
-        sum_linear_weight += inter.linear_weight;
-        sum_vol += inter.vol_weighted;
-      });
-      
-      if(sum_weight > 0) {
-        u_hair(i, j, k) = sum_vel / sum_weight;
-        scalar multiplier2 = mathutils::clamp(m_parent->getDragRadiusMultiplier() * m_parent->getDragRadiusMultiplier(), 0.0, sum_linear_weight * dx * dx * dx / sum_vol);
-        u_drag(i, j, k) = sum_drag / (sum_linear_weight * dx * dx * dx * rho_L) * multiplier2;
-      } else {
-        u_hair(i, j, k) = 0.0;
-        u_drag(i, j, k) = 0.0;
+  // the union of the tiles the buffers touched
+  bool empty = true;
+  for(int c = 0; c < 3; ++c) {
+    VelDragTiles& total = m_vel_drag_total.face[c];
+    total.reset(ni, nj, nk);
+    for(const VelDragAccumulator& acc : m_vel_drag_accumulators) {
+      for(int t : acc.face[c].active_tiles) total.touch(t);
+    }
+    empty = empty && total.active_tiles.empty();
+  }
+  
+  if(empty) return;
+  
+  // add up the sums of the buffers tile by tile, always in the same order, and
+  // find the box of the cells a hair crossed in every tile
+  const int tile_bits = SparseArray3s::TILE_BITS;
+  std::vector<Vector3i> box_lo[3], box_hi[3];
+  for(int c = 0; c < 3; ++c) {
+    VelDragTiles& total = m_vel_drag_total.face[c];
+    const int ntiles = (int) total.active_tiles.size();
+    box_lo[c].resize(ntiles);
+    box_hi[c].resize(ntiles);
+    
+    threadutils::thread_pool::ParallelFor(0, ntiles, [&] (int n) {
+      const int t = total.active_tiles[n];
+      scalar* sums = &total.pool[(size_t) n * VelDragTiles::TILE_SUMS];
+      for(const VelDragAccumulator& acc : m_vel_drag_accumulators) {
+        const VelDragTiles& part = acc.face[c];
+        const int slot = part.tile_slot[t];
+        if(slot < 0) continue;
+        const scalar* part_sums = &part.pool[(size_t) slot * VelDragTiles::TILE_SUMS];
+        for(int m = 0; m < VelDragTiles::TILE_SUMS; ++m) sums[m] += part_sums[m];
       }
       
-      u_weight_hair(i, j, k) = sum_weight;
-    }
-  });
-  
-  m_sorter->sort(v_vel_drag.size(), [&] (int pidx, int& i, int& j, int& k) {
-    i = std::max(0, std::min(m_sorter->ni - 1, v_vel_drag[pidx].coord(0)));
-    j = std::max(0, std::min(m_sorter->nj - 1, v_vel_drag[pidx].coord(1)));
-    k = std::max(0, std::min(m_sorter->nk - 1, v_vel_drag[pidx].coord(2)));
-  });
+      const int i0 = (t % total.nti) << tile_bits;
+      const int j0 = ((t / total.nti) % total.ntj) << tile_bits;
+      const int k0 = (t / (total.nti * total.ntj)) << tile_bits;
+      Vector3i lo(ni, nj, nk);
+      Vector3i hi(-1, -1, -1);
+      for(int k = k0; k < std::min(k0 + SparseArray3s::TILE_SIZE, nk); ++k)
+        for(int j = j0; j < std::min(j0 + SparseArray3s::TILE_SIZE, nj); ++j)
+          for(int i = i0; i < std::min(i0 + SparseArray3s::TILE_SIZE, ni); ++i) {
+            const scalar* cell = sums + SparseArray3s::cell_offset(i, j, k) * VelDragTiles::NUM_SUMS;
+            bool crossed = false;
+            for(int m = 0; m < VelDragTiles::NUM_SUMS; ++m) crossed = crossed || cell[m] != 0.0;
+            if(!crossed) continue;
+            lo = lo.cwiseMin(Vector3i(i, j, k));
+            hi = hi.cwiseMax(Vector3i(i, j, k));
+          }
+      box_lo[c][n] = lo;
+      box_hi[c][n] = hi;
+    });
+  }
   
-  threadutils::thread_pool::ParallelFor(0, v.nk, [&] (int k){
-    for(int j = 0; j < v.nj; ++j) for(int i = 0; i < v.ni; ++i) {
-      scalar sum_vel = 0.0;
-      scalar sum_drag = 0.0;
-      scalar sum_weight = 0.0;
-      scalar sum_linear_weight = 0.0;
-      scalar sum_vol = 0.0;
-      
-      m_sorter->getCellAt(i, j, k, [&] (int idx) {
-        const EdgeVelDragIntersection<3>& inter = v_vel_drag[idx];
-        sum_vel += inter.vel_weighted;
-        sum_drag += inter.drag_weighted;
-        sum_weight += inter.weight;
-        sum_linear_weight += inter.linear_weight;
-        sum_vol += inter.vol_weighted;
-      });
-      
-      if(sum_weight > 0) {
-        v_hair(i, j, k) = sum_vel / sum_weight;
-        scalar multiplier2 = mathutils::clamp(m_parent->getDragRadiusMultiplier() * m_parent->getDragRadiusMultiplier(), 0.0, sum_linear_weight * dx * dx * dx / sum_vol);
-        v_drag(i, j, k) = sum_drag / (sum_linear_weight * dx * dx * dx * rho_L) * multiplier2;
-      } else {
-        v_hair(i, j, k) = 0.0;
-        v_drag(i, j, k) = 0.0;
+  // the hair has moved since the tiles were chosen in compute_liquid_phi, so add the tiles
+  // around the faces it crosses now. New tiles start at the background values, which are
+  // what the dense grids hold away from the liquid.
+  if(!m_tile_mask.empty()) {
+    bool grown = false;
+    for(int c = 0; c < 3; ++c) {
+      const int ntiles = (int) box_lo[c].size();
+      for(int n = 0; n < ntiles; ++n) {
+        const Vector3i& lo = box_lo[c][n];
+        const Vector3i& hi = box_hi[c][n];
+        if(hi(0) < 0) continue;
+        grown = mark_grid_tiles(lo(0), lo(1), lo(2), hi(0) + 1, hi(1) + 1, hi(2) + 1) || grown;
       }
-      
-      v_weight_hair(i, j, k) = sum_weight;
     }
-  });
+    if(grown) apply_grid_topology();
+  }
   
-  m_sorter->sort(w_vel_drag.size(), [&] (int pidx, int& i, int& j, int& k) {
-    i = std::max(0, std::min(m_sorter->ni - 1, w_vel_drag[pidx].coord(0)));
-    j = std::max(0, std::min(m_sorter->nj - 1, w_vel_drag[pidx].coord(1)));
-    k = std::max(0, std::min(m_sorter->nk - 1, w_vel_drag[pidx].coord(2)));
-  });
+  const scalar rho_L = m_parent->getLiquidDensity();
   
-  threadutils::thread_pool::ParallelFor(0, w.nk, [&] (int k){
-    for(int j = 0; j < w.nj; ++j) for(int i = 0; i < w.ni; ++i) {
-      scalar sum_vel = 0.0;
-      scalar sum_drag = 0.0;
-      scalar sum_weight = 0.0;
-      scalar sum_linear_weight = 0.0;
-      scalar sum_vol = 0.0;
-      
-      m_sorter->getCellAt(i, j, k, [&] (int idx) {
-        const EdgeVelDragIntersection<3>& inter = w_vel_drag[idx];
-        sum_vel += inter.vel_weighted;
-        sum_drag += inter.drag_weighted;
-        sum_weight += inter.weight;
-        sum_linear_weight += inter.linear_weight;
-        sum_vol += inter.vol_weighted;
-      });
+  SparseArray3g* hair_vel[] = {&u_hair, &v_hair, &w_hair};
+  SparseArray3g* hair_drag[] = {&u_drag, &v_drag, &w_drag};
+  SparseArray3g* hair_weight[] = {&u_weight_hair, &v_weight_hair, &w_weight_hair};
+  
+  for(int c = 0; c < 3; ++c) {
+    const VelDragTiles& total = m_vel_drag_total.face[c];
+    SparseArray3g& vel = *hair_vel[c];
+    SparseArray3g& drag = *hair_drag[c];
+    SparseArray3g& weight = *hair_weight[c];
+    
+    for_each_active_cell(vel, [&] (int i, int j, int k) {
+      const scalar* sums = total.find(i, j, k);
+      const scalar sum_weight = sums ? sums[VelDragTiles::WEIGHT] : 0.0;
       
       if(sum_weight > 0) {
-        w_hair(i, j, k) = sum_vel / sum_weight;
-        scalar multiplier2 = mathutils::clamp(m_parent->getDragRadiusMultiplier() * m_parent->getDragRadiusMultiplier(), 0.0, sum_linear_weight * dx * dx * dx / sum_vol);
-        w_drag(i, j, k) = sum_drag / (sum_linear_weight * dx * dx * dx * rho_L) * multiplier2;
+        const scalar sum_linear_weight = sums[VelDragTiles::LINEAR_WEIGHT];
+        vel.ref(i, j, k) = sums[VelDragTiles::VEL] / sum_weight;
+        scalar multiplier2 = mathutils::clamp(m_parent->getDragRadiusMultiplier() * m_parent->getDragRadiusMultiplier(), 0.0, sum_linear_weight * dx * dx * dx / sums[VelDragTiles::VOL]);
+        drag.ref(i, j, k) = sums[VelDragTiles::DRAG] / (sum_linear_weight * dx * dx * dx * rho_L) * multiplier2;
       } else {
-        w_hair(i, j, k) = 0.0;
-        w_drag(i, j, k) = 0.0;
+        vel.ref(i, j, k) = 0.0;
+        drag.ref(i, j, k) = 0.0;
       }
       
-      w_weight_hair(i, j, k) = sum_weight;
-    }
-  });
+      weight.ref(i, j, k) = sum_weight;
+    });
+  }
 }
 
 scalar FluidSim3D::get_particle_weight(const Vector3s& position) const
@@ -2338,18 +2933,32 @@ scalar FluidSim3D::get_clamped_particle_weight(const Vector3s& position) const
   return mathutils::clamp(w / criterion, 0.0, 1.0);
 }
 
+// the time a grid cell is crossed at the largest face or particle speed,
+// reduced in parallel over the allocated tiles and the particles
 scalar FluidSim3D::cfl()
 {
+  const auto max_abs = [] (const std::vector<gridscalar>& values) {
+    return tbb::parallel_reduce(tbb::blocked_range<size_t>(0, values.size()), (scalar) 0,
+      [&] (const tbb::blocked_range<size_t>& rg, scalar m) -> scalar {
+        for(size_t i = rg.begin(); i != rg.end(); ++i) m = max(m, (scalar) fabs(values[i]));
+        return m;
+      }, [] (scalar a, scalar b) { return max(a, b); });
+  };
+  
   scalar maxvel = 0;
-  const int npu = u.a.size();
-  const int npv = v.a.size();
-  const int npw = w.a.size();
-  for(int i = 0; i < npu; ++i)
-    maxvel = max(maxvel, fabs(u.a[i]));
-  for(int i = 0; i < npv; ++i)
-    maxvel = max(maxvel, fabs(v.a[i]));
-  for(int i = 0; i < npw; ++i)
-    maxvel = max(maxvel, fabs(w.a[i]));
+  const SparseArray3g* vel[] = {&u, &v, &w};
+  for(const SparseArray3g* grid : vel)
+    maxvel = max(maxvel, max((scalar) fabs(grid->background), max_abs(grid->pool)));
+  
+  const std::vector<Vector3s>& pv = particles.v;
+  const scalar maxpvel2 = tbb::parallel_reduce(tbb::blocked_range<size_t>(0, pv.size()), (scalar) 0,
+    [&] (const tbb::blocked_range<size_t>& rg, scalar m) -> scalar {
+      for(size_t i = rg.begin(); i != rg.end(); ++i) m = max(m, pv[i].squaredNorm());
+      return m;
+    }, [] (scalar a, scalar b) { return max(a, b); });
+  maxvel = max(maxvel, sqrt(maxpvel2));
+  
+  if(maxvel == 0.0) return std::numeric_limits<scalar>::max();
   return dx / maxvel;
 }
 
@@ -2428,22 +3037,7 @@ int FluidSim3D::get_w_nk() const
   return w.nk;
 }
 
-std::vector< std::vector<EdgeVelDragIntersection<3> > >& FluidSim3D::get_u_edge_vel_drag()
-{
-  return u_edge_vel_drag;
-}
-
-std::vector< std::vector<EdgeVelDragIntersection<3> > >& FluidSim3D::get_v_edge_vel_drag()
-{
-  return v_edge_vel_drag;
-}
-
-std::vector< std::vector<EdgeVelDragIntersection<3> > >& FluidSim3D::get_w_edge_vel_drag()
-{
-  return w_edge_vel_drag;
-}
-
-const std::vector<Particle<3> >& FluidSim3D::get_particles() const
+const ParticleStore<3>& FluidSim3D::get_particles() const
 {
   return particles;
 }
@@ -2479,9 +3073,12 @@ void FluidSim3D::save_particles_off(const std::string szfn)
   ofstream ofs(szfn.c_str());
   ofs << "OFF" << endl;
   ofs << particles.size() << " 0 0" << endl;
-  for(auto& p : particles)
+  const int np = particles.size();
+  for(int i = 0; i < np; ++i)
   {
-    ofs << p.x(0) << " " << p.x(1) << " " << p.x(2) << " " << p.v(0) << " " << p.v(1) << " " << p.v(2) << " " << p.radii << endl;
+    const Vector3s& x = particles.x[i];
+    const Vector3s& v = particles.v[i];
+    ofs << x(0) << " " << x(1) << " " << x(2) << " " << v(0) << " " << v(1) << " " << v(2) << " " << particles.radii[i] << endl;
   }
   ofs.close();
 }
@@ -2538,7 +3135,7 @@ void FluidSim3D::load_particles_off(const std::string szfn)
   
   ifs.close();
   
-  m_sorter->sort(particles.size(), sorter_callback);
+  m_particle_index_dirty = true;
   
   compute_liquid_phi();
 }
@@ -2553,9 +3150,9 @@ Vector3s FluidSim3D::computeParticleMomentum()
   
   for(int i = 0; i < np; ++i)
   {
-    auto& p = particles[i];
-    scalar m = 4.0 / 3.0 * M_PI * p.radii * p.radii * p.radii * rho;
-    sum += p.v * m;
+    const scalar radii = particles.radii[i];
+    scalar m = 4.0 / 3.0 * M_PI * radii * radii * radii * rho;
+    sum += particles.v[i] * m;
   }
   
   return sum;
@@ -2571,7 +3168,7 @@ Vector3s FluidSim3D::computeParticleAngularMomentum()
   
   for(int i = 0; i < np; ++i)
   {
-    auto& p = particles[i];
+    const Particle<3> p = particles.get(i);
     scalar m = 4.0 / 3.0 * M_PI * p.radii * p.radii * p.radii * rho;
     
     Vector3s ppu = (p.x - origin) / dx - Vector3s(0.0, 0.5, 0.5);
@@ -2929,10 +3526,12 @@ Vector3s FluidSim3D::computeReweightedParticleGridAngularMomentum()
 scalar FluidSim3D::computeTotalLiquidVol() const
 {
   scalar sum = 0.0;
-  for(auto& p : particles)
+  const int np = particles.size();
+  for(int i = 0; i < np; ++i)
   {
-    if(p.type != PT_LIQUID) continue;
-    sum += 4.0 / 3.0 * M_PI * p.radii * p.radii * p.radii;
+    if(particles.type[i] != PT_LIQUID) continue;
+    const scalar radii = particles.radii[i];
+    sum += 4.0 / 3.0 * M_PI * radii * radii * radii;
   }
   return sum;
 }
@@ -3133,9 +3732,9 @@ scalar FluidSim3D::computeParticleKineticEnergy()
   int np = particles.size();
   
   for( int i = 0; i < np; ++i ) {
-    auto& p = particles[i];
-    scalar m = 4.0 / 3.0 * M_PI * p.radii * p.radii * p.radii * rho;
-    T += m * p.v.squaredNorm();
+    const scalar radii = particles.radii[i];
+    scalar m = 4.0 / 3.0 * M_PI * radii * radii * radii * rho;
+    T += m * particles.v[i].squaredNorm();
   }
   return 0.5*T;
 }
@@ -3235,8 +3834,10 @@ void FluidSim3D::writeReadable(std::vector<std::ostringstream>& oss) const
   const std::vector< std::pair<int, int> >& edges = m_parent->getEdges();
   const VectorXs& radius = m_parent->getRadii();
   
-  for(auto& p : particles)
+  const int np = particles.size();
+  for(int i = 0; i < np; ++i)
   {
+    const Particle<3> p = particles.get(i);
     if(p.type == PT_HAIR) {
       const std::pair<int, int>& e = edges[ p.edge_idx ];
       const scalar radii_c = mathutils::lerp(radius(e.first), radius(e.second), p.edge_alpha);
@@ -3259,20 +3860,22 @@ void FluidSim3D::readReadable( std::ifstream& file )
     int type;
 
     file >> pos[0] >> pos[1] >> pos[2] >> radius >> type;
-    particles[np].x = pos;
-    particles[np].radii = radius;
+    particles.x[np] = pos;
+    particles.radii[np] = radius;
     ++np;
   }
 
   particles.resize(np);
+  m_particle_index_dirty = true;
 }
 
 
 void FluidSim3D::write(std::vector<scalar>& data) const
 {
-  for(auto& p : particles)
+  const int np = particles.size();
+  for(int i = 0; i < np; ++i)
   {
-    p.write(data);
+    particles.write(i, data);
   }
   
   for(auto& b : boundaries)
@@ -3281,15 +3884,13 @@ void FluidSim3D::write(std::vector<scalar>& data) const
     b->write(data);
   }
   
-  data.insert(data.end(), u.a.begin(), u.a.end());
-  data.insert(data.end(), v.a.begin(), v.a.end());
-  data.insert(data.end(), w.a.begin(), w.a.end());
-  
-  data.insert(data.end(), u_pressure_grad.a.begin(), u_pressure_grad.a.end());
-  data.insert(data.end(), v_pressure_grad.a.begin(), v_pressure_grad.a.end());
-  data.insert(data.end(), w_pressure_grad.a.begin(), w_pressure_grad.a.end());
-  
-  data.insert(data.end(), liquid_phi.a.begin(), liquid_phi.a.end());
+  // the grids are stored dense, so that the file layout does not depend on the tiles
+  const SparseArray3g* grids[] = {&u, &v, &w, &u_pressure_grad, &v_pressure_grad, &w_pressure_grad, &liquid_phi};
+  for(const SparseArray3g* grid : grids) {
+    size_t base = data.size();
+    data.resize(base + grid->size());
+    grid->copy_to_dense(&data[base]);
+  }
 }
 
 void FluidSim3D::read(const scalar* data, size_t size_particles, size_t size_boundaries)
@@ -3301,7 +3902,7 @@ void FluidSim3D::read(const scalar* data, size_t size_particles, size_t size_bou
   size_t k = 0;
   for(size_t i = 0; i < np; ++i)
   {
-    particles[i].read(data + k);
+    particles.read(i, data + k);
     k += Particle<3>::size() / sizeof(scalar);
   }
   
@@ -3315,15 +3916,16 @@ void FluidSim3D::read(const scalar* data, size_t size_particles, size_t size_bou
     ++i;
   }
   
-  memcpy(&u.a[0], data + k, u.a.size() * sizeof(scalar)); k += u.a.size();
-  memcpy(&v.a[0], data + k, v.a.size() * sizeof(scalar)); k += v.a.size();
-  memcpy(&w.a[0], data + k, w.a.size() * sizeof(scalar)); k += w.a.size();
-  
-  memcpy(&u_pressure_grad.a[0], data + k, u_pressure_grad.a.size() * sizeof(scalar)); k += u_pressure_grad.a.size();
-  memcpy(&v_pressure_grad.a[0], data + k, v_pressure_grad.a.size() * sizeof(scalar)); k += v_pressure_grad.a.size();
-  memcpy(&w_pressure_grad.a[0], data + k, w_pressure_grad.a.size() * sizeof(scalar)); k += w_pressure_grad.a.size();
+  // allocate the tiles around the particles just read before the grids are filled
+  m_particle_index_dirty = true;
+  sort_particles();
+  update_grid_topology();
   
-  memcpy(&liquid_phi.a[0], data + k, liquid_phi.a.size() * sizeof(scalar)); k += liquid_phi.a.size();
+  SparseArray3g* grids[] = {&u, &v, &w, &u_pressure_grad, &v_pressure_grad, &w_pressure_grad, &liquid_phi};
+  for(SparseArray3g* grid : grids) {
+    grid->copy_from_dense(data + k);
+    k += grid->size();
+  }
 }
 
 size_t FluidSim3D::particle_size() const
@@ -3345,7 +3947,7 @@ size_t FluidSim3D::boundary_size() const
 
 size_t FluidSim3D::crucial_grid_size() const
 {
-  return (u.a.size() + v.a.size() + w.a.size() + u_pressure_grad.a.size() + v_pressure_grad.a.size() + w_pressure_grad.a.size() + liquid_phi.a.size()) * sizeof(scalar);
+  return (u.size() + v.size() + w.size() + u_pressure_grad.size() + v_pressure_grad.size() + w_pressure_grad.size() + liquid_phi.size()) * sizeof(scalar);
 }
 
 void FluidSim3D::preCompute( const VectorXs& x, const VectorXs& v, const VectorXs& m, const scalar& dt )
@@ -3364,38 +3966,48 @@ void FluidSim3D::addGradEToTotal( const VectorXs& x, const VectorXs& v, const Ve
   });
 }
 
-//Apply several iterations of a very simple "Jacobi"-style propagation of valid velocity data in all directions
-void extrapolate(Array3s& grid, Array3s& old_grid, const Array3s& grid_weight, const Array3s& grid_liquid_weight, Array3c& valid, Array3c old_valid, const Vector3i& offset) {
+//Apply several iterations of a very simple "Jacobi"-style propagation of valid velocity data in all directions.
+//Only the allocated tiles of the grid are visited; the extrapolation never reaches past them.
+void extrapolate(SparseArray3g& grid, SparseArray3g& old_grid, const SparseArray3g& grid_weight, const SparseArray3g& grid_liquid_weight, SparseArray3c& valid, SparseArray3c old_valid, const Vector3i& offset) {
   
   //Initialize the list of valid cells
   
-  for(int k = 0; k < valid.nk; ++k) for(int j = 0; j < valid.nj; ++j) valid(0,j,k) = valid(valid.ni-1,j,k) = 0;
-  for(int k = 0; k < valid.nk; ++k) for(int i = 0; i < valid.ni; ++i) valid(i,0,k) = valid(i,valid.nj-1,k) = 0;
-  for(int j = 0; j < valid.nj; ++j) for(int i = 0; i < valid.ni; ++i) valid(i,j,0) = valid(i,j,valid.nk-1) = 0;
-  
-  for(int k = 1; k < grid.nk - 1; ++k) for(int j = 1; j < grid.nj - 1; ++j) for(int i = 1; i < grid.ni - 1; ++i)
-    valid(i,j,k) = grid_weight(i,j,k) > 0 && (grid_liquid_weight(i, j, k) < 0 || grid_liquid_weight(i + offset(0), j + offset(1), k + offset(2)) < 0 );
+  for(int k = 0; k < valid.nk; ++k) for(int j = 0; j < valid.nj; ++j) { valid.set_if_allocated(0,j,k,0); valid.set_if_allocated(valid.ni-1,j,k,0); }
+  for(int k = 0; k < valid.nk; ++k) for(int i = 0; i < valid.ni; ++i) { valid.set_if_allocated(i,0,k,0); valid.set_if_allocated(i,valid.nj-1,k,0); }
+  for(int j = 0; j < valid.nj; ++j) for(int i = 0; i < valid.ni; ++i) { valid.set_if_allocated(i,j,0,0); valid.set_if_allocated(i,j,valid.nk-1,0); }
+  
+  const int ntiles = grid.num_active_tiles();
+  
+  // the interior cells of the n-th tile
+  auto interior_range = [&] (int n, int& i0, int& j0, int& k0, int& i1, int& j1, int& k1) {
+    grid.get_tile_range(n, i0, j0, k0, i1, j1, k1);
+    i0 = std::max(i0, 1); i1 = std::min(i1, grid.ni - 1);
+    j0 = std::max(j0, 1); j1 = std::min(j1, grid.nj - 1);
+    k0 = std::max(k0, 1); k1 = std::min(k1, grid.nk - 1);
+  };
+  
+  threadutils::thread_pool::ParallelFor(0, ntiles, [&](int n) {
+    int i0, j0, k0, i1, j1, k1;
+    interior_range(n, i0, j0, k0, i1, j1, k1);
+    for(int k = k0; k < k1; ++k) for(int j = j0; j < j1; ++j) for(int i = i0; i < i1; ++i)
+      valid.ref(i,j,k) = grid_weight(i,j,k) > 0 && (grid_liquid_weight(i, j, k) < 0 || grid_liquid_weight(i + offset(0), j + offset(1), k + offset(2)) < 0 );
+  });
   
-  Array3s* pgrid[2] = {&grid, &old_grid};
-  Array3c* pvalid[2] = {&valid, &old_valid};
+  SparseArray3g* pgrid[2] = {&grid, &old_grid};
+  SparseArray3c* pvalid[2] = {&valid, &old_valid};
   
   for(int layers = 0; layers < 4; ++layers) {
-    int num = grid.ni*grid.nj*grid.nk;
-    int slice =  grid.ni*grid.nj;
-    Array3s* pgrid_source = pgrid[layers & 1];
-    Array3s* pgrid_target = pgrid[!(layers & 1)];
+    SparseArray3g* pgrid_source = pgrid[layers & 1];
+    SparseArray3g* pgrid_target = pgrid[!(layers & 1)];
     
-    Array3c* pvalid_source = pvalid[layers & 1];
-    Array3c* pvalid_target = pvalid[!(layers & 1)];
+    SparseArray3c* pvalid_source = pvalid[layers & 1];
+    SparseArray3c* pvalid_target = pvalid[!(layers & 1)];
     
-    threadutils::thread_pool::ParallelFor(0,num, [&](int thread_idx)
+    threadutils::thread_pool::ParallelFor(0, ntiles, [&](int n)
     {
-      int k = thread_idx/slice;
-      int j = (thread_idx%slice)/grid.ni;
-      int i = thread_idx%grid.ni;
-      //for(int k = 1; k < grid.nk-1; ++k) for(int j = 1; j < grid.nj-1; ++j) for(int i = 1; i < grid.ni-1; ++i) {
-      if(i>0&&i<grid.ni-1 &&j>0&&j<grid.nj-1 &&k>0&&k<grid.nk-1)
-      {
+      int i0, j0, k0, i1, j1, k1;
+      interior_range(n, i0, j0, k0, i1, j1, k1);
+      for(int k = k0; k < k1; ++k) for(int j = j0; j < j1; ++j) for(int i = i0; i < i1; ++i) {
         scalar sum = 0;
         int count = 0;
         
@@ -3429,8 +4041,8 @@ void extrapolate(Array3s& grid, Array3s& old_grid, const Array3s& grid_weight, c
           //If any of neighbour cells were valid,
           //assign the cell their average value and tag it as valid
           if(count > 0) {
-            (*pgrid_target)(i,j,k) = sum / (scalar)count;
-            (*pvalid_target)(i,j,k) = 1;
+            (*pgrid_target).ref(i,j,k) = sum / (scalar)count;
+            (*pvalid_target).ref(i,j,k) = 1;
           }
         }
       }
@@ -3440,5 +4052,3 @@ void extrapolate(Array3s& grid, Array3s& old_grid, const Array3s& grid_weight, c
     *pgrid_source = *pgrid_target;
   }
 }
-                    
-
@@ -23,7 +23,10 @@
 #include "fluidsim.h"
 #include "MathUtilities.h"
 #include "array3.h"
+#include "sparse_array3.h"
 #include "pcgsolver/pcg_solver.h"
+#include "GeometricMultigrid.h"
+#include "SolverTelemetry.h"
 
 //#define USE_SURFACE_TENSION
 
@@ -33,6 +36,10 @@ template<int DIM>
 class TwoDScene;
 
 class Sorter;
+class HashedSorter;
+
+template<class T>
+struct AMGSparseHierarchy;
 
 template<int DIM>
 class FluidDragForce;
@@ -44,6 +51,81 @@ public:
   
   EIGEN_MAKE_ALIGNED_OPERATOR_NEW
   
+  // the samples of a root boundary on the nodes and on the u, v, w faces
+  // inside its box of nodes [lo, hi], see update_boundary
+  struct BoundaryCache
+  {
+    BoundaryCache() : boundary(NULL) {}
+    
+    const Boundary<3>* boundary;
+    std::vector<scalar> state;
+    Vector3i lo, hi;
+    Array3g phi[4];
+    Array3g vel[3];
+  };
+  
+  // the sums of the hair intersections with the faces of one direction, in
+  // 8x8x8 tiles over the cells that are allocated when a hair first crosses
+  // them. Coordinates are clamped into the cells, so the last layer of faces
+  // collects what lies beyond it
+  struct VelDragTiles
+  {
+    enum { VEL, DRAG, WEIGHT, LINEAR_WEIGHT, VOL, NUM_SUMS };
+    static const int TILE_SUMS = SparseArray3s::TILE_CELLS * NUM_SUMS;
+    
+    int ni, nj, nk;
+    int nti, ntj;
+    std::vector<int> tile_slot;
+    std::vector<int> active_tiles;
+    std::vector<scalar> pool;
+    
+    VelDragTiles() : ni(0), nj(0), nk(0), nti(0), ntj(0) {}
+    
+    // releases all tiles, and resizes the tile table if the grid changed
+    void reset(int ni_, int nj_, int nk_);
+    
+    // the slot of tile t, which is allocated with zero sums if needed
+    int touch(int t)
+    {
+      int& slot = tile_slot[t];
+      if(slot < 0) {
+        slot = (int) active_tiles.size();
+        active_tiles.push_back(t);
+        pool.resize(pool.size() + TILE_SUMS, 0.0);
+      }
+      return slot;
+    }
+    
+    void add(const EdgeVelDragIntersection<3>& inter)
+    {
+      const int i = std::max(0, std::min(ni - 1, inter.coord(0)));
+      const int j = std::max(0, std::min(nj - 1, inter.coord(1)));
+      const int k = std::max(0, std::min(nk - 1, inter.coord(2)));
+      const int t = (i >> SparseArray3s::TILE_BITS) + nti * ((j >> SparseArray3s::TILE_BITS) + ntj * (k >> SparseArray3s::TILE_BITS));
+      scalar* sums = &pool[(size_t) touch(t) * TILE_SUMS + SparseArray3s::cell_offset(i, j, k) * NUM_SUMS];
+      sums[VEL] += inter.vel_weighted;
+      sums[DRAG] += inter.drag_weighted;
+      sums[WEIGHT] += inter.weight;
+      sums[LINEAR_WEIGHT] += inter.linear_weight;
+      sums[VOL] += inter.vol_weighted;
+    }
+    
+    // the sums of cell (i,j,k), or NULL if no hair crossed its tile
+    const scalar* find(int i, int j, int k) const
+    {
+      if(i >= ni || j >= nj || k >= nk) return NULL;
+      const int slot = tile_slot[(i >> SparseArray3s::TILE_BITS) + nti * ((j >> SparseArray3s::TILE_BITS) + ntj * (k >> SparseArray3s::TILE_BITS))];
+      if(slot < 0) return NULL;
+      return &pool[(size_t) slot * TILE_SUMS + SparseArray3s::cell_offset(i, j, k) * NUM_SUMS];
+    }
+  };
+  
+  // the intersections with the u, v and w faces
+  struct VelDragAccumulator
+  {
+    VelDragTiles face[3];
+  };
+  
   FluidSim3D(const Vector3s& origin_, scalar width, int ni_, int nj_, int nk_,
              const std::vector< Boundary<3>* >& boundaries_, const std::vector< SourceBoundary<3>* >& sources_, TwoDScene<3>* scene);
 
@@ -51,11 +133,14 @@ public:
   
   virtual void advect_boundary(const scalar& dt);
   virtual void update_boundary();
+  virtual void get_boundary_box(const Boundary<3>* b, Vector3i& lo, Vector3i& hi) const;
+  virtual void sample_boundary(BoundaryCache& cache) const;
+  virtual void combine_boundaries(const Vector3i& lo, const Vector3i& hi);
   virtual void init_random_particles(const scalar& rl, const scalar& rr, const scalar& rb, const scalar& rt, const scalar& rf, const scalar& rk);
   virtual void init_hair_particles();
   virtual void controlSources(const scalar& current_time, const scalar& dt);
   
-  const std::vector<Particle<3> >& get_particles() const;
+  const ParticleStore<3>& get_particles() const;
   const std::vector< Boundary<3>* >& get_boundaries() const;
   const std::vector< SourceBoundary<3>* >& get_sources() const;
   const Vector3s& get_origin() const;
@@ -77,7 +162,8 @@ public:
   
   scalar compute_phi_vel(const Vector3s& pos, Vector3s& vel) const;
   
-  Vector3s get_velocity(const Vector3s& position, const Array3s& u, const Array3s& v, const Array3s& w) const;
+  template<class Grid>
+  Vector3s get_velocity(const Vector3s& position, const Grid& u, const Grid& v, const Grid& w) const;
   Vector3s get_velocity(const Vector3s& position) const;
   scalar get_nodal_solid_phi(const Vector3s& position) const;
   Vector3s get_nodal_solid_phi_gradient(const Vector3s& position) const;
@@ -90,9 +176,9 @@ public:
   Vector3s get_particle_drag(const Vector3s& position) const;
   Matrix3s get_affine_matrix(const Vector3s& position) const;
   
-  std::vector< std::vector<EdgeVelDragIntersection<3> > >& get_u_edge_vel_drag();
-  std::vector< std::vector<EdgeVelDragIntersection<3> > >& get_v_edge_vel_drag();
-  std::vector< std::vector<EdgeVelDragIntersection<3> > >& get_w_edge_vel_drag();
+  // the accumulator of buffer ibuffer of TwoDScene::updateHairFlowsToGrid,
+  // between prepare_update_from_hair and done_update_from_hair
+  VelDragAccumulator& get_vel_drag_accumulator(int ibuffer);
   
   scalar getLiquidPhiValue(const Vector3s& position) const;
   scalar getClampedLiquidPhiValue(const Vector3s& position) const;
@@ -110,6 +196,8 @@ public:
   virtual void project(scalar dt);
   virtual void compute_weights();
   virtual void solve_pressure(scalar dt);
+  virtual bool solve_pressure_amg(scalar dt, LinearSolveRecord& record);
+  virtual bool solve_pressure_gmg(scalar dt, LinearSolveRecord& record);
   virtual scalar get_particle_weight(const Vector3s& position) const;
   virtual scalar get_clamped_particle_weight(const Vector3s& position) const;
   
@@ -127,6 +215,7 @@ public:
   virtual void add_particle(const Particle<3>& p);
   
   virtual void map_p2g(bool with_hair_particles);
+  virtual void map_p2g_scatter(bool with_hair_particles);
   virtual void map_g2p_apic();
   
   virtual void combine_velocity_field();
@@ -139,12 +228,21 @@ public:
   virtual void transferLiquidToGridParticle(const scalar& dt);
   
   virtual void compute_liquid_phi();
+  virtual void redistance_liquid_phi();
+  
+  virtual void update_grid_topology();
+  virtual void apply_grid_topology();
+  virtual bool mark_grid_tiles(int i0, int j0, int k0, int i1, int j1, int k1);
+  
+  template<class Callable>
+  void for_each_particle_by_blocks(Callable func);
   
   virtual void save_pressure(const std::string szfn);
   virtual void save_particles_off(const std::string szfn);
   virtual void load_particles_off(const std::string szfn);
   
   virtual void sort_particles();
+  virtual void reorder_particles();
   
   virtual Vector3s computeParticleMomentum();
   
@@ -232,67 +330,86 @@ protected:
   int ni,nj,nk;
   scalar dx;
   
-  // Fluid velocity
-  Array3s u, v, w;
-  Array3s temp_u, temp_v, temp_w;
-  
-  Array3s u_weight_hair;
-  Array3s v_weight_hair;
-  Array3s w_weight_hair;
-  
-  Array3s u_weight_particle;
-  Array3s v_weight_particle;
-  Array3s w_weight_particle;
-  
-  Array3s u_weight_total;
-  Array3s v_weight_total;
-  Array3s w_weight_total;
+  // Grid tiles allocated for the sparse fields (over the tiles of the nodal grid)
+  std::vector<unsigned char> m_tile_mask;
+  int m_tile_ni, m_tile_nj, m_tile_nk;
   
-  Array3s u_hair, v_hair, w_hair;
-  Array3s u_pressure_grad, v_pressure_grad, w_pressure_grad;
-  Array3s u_particle, v_particle, w_particle;
-  Array3s u_solid, v_solid, w_solid;
-  
-  // Hair -> Voxel Intersections
-  std::vector< std::vector<EdgeVelDragIntersection<3> > > u_edge_vel_drag;
-  std::vector< std::vector<EdgeVelDragIntersection<3> > > v_edge_vel_drag;
-  std::vector< std::vector<EdgeVelDragIntersection<3> > > w_edge_vel_drag;
-  
-  std::vector< int > u_num_edge_voxel_intersections;
-  std::vector< int > v_num_edge_voxel_intersections;
-  std::vector< int > w_num_edge_voxel_intersections;
-  
-  std::vector< EdgeVelDragIntersection<3> > u_vel_drag;
-  std::vector< EdgeVelDragIntersection<3> > v_vel_drag;
-  std::vector< EdgeVelDragIntersection<3> > w_vel_drag;
+  // Fluid velocity
+  SparseArray3g u, v, w;
+  SparseArray3g temp_u, temp_v, temp_w;
+  
+  SparseArray3g u_weight_hair;
+  SparseArray3g v_weight_hair;
+  SparseArray3g w_weight_hair;
+  
+  SparseArray3g u_weight_particle;
+  SparseArray3g v_weight_particle;
+  SparseArray3g w_weight_particle;
+  
+  SparseArray3g u_weight_total;
+  SparseArray3g v_weight_total;
+  SparseArray3g w_weight_total;
+  
+  SparseArray3g u_hair, v_hair, w_hair;
+  SparseArray3g u_pressure_grad, v_pressure_grad, w_pressure_grad;
+  SparseArray3g u_particle, v_particle, w_particle;
+  // the sums of map_p2g_scatter, accumulated in double and written to
+  // u_particle and u_weight_particle etc. once all particles are in
+  SparseArray3s u_weight_scatter, v_weight_scatter, w_weight_scatter;
+  SparseArray3s u_momentum_scatter, v_momentum_scatter, w_momentum_scatter;
+  SparseArray3s u_liquid_weight_scatter, v_liquid_weight_scatter, w_liquid_weight_scatter;
+  Array3g u_solid, v_solid, w_solid;
+  
+  // Hair -> Voxel Intersections, scattered into the tiles of one accumulator
+  // per hair flow buffer and added up in buffer order in done_update_from_hair
+  std::vector<VelDragAccumulator> m_vel_drag_accumulators;
+  VelDragAccumulator m_vel_drag_total;
   
   // Tracer particles
-  std::vector<Particle<3> > particles;
+  ParticleStore<3> particles;
   
   // Static geometry representation
-  Array3s nodal_solid_phi;
-  Array3s u_weights, v_weights, w_weights;
-  Array3c u_valid, v_valid, w_valid;
+  Array3g nodal_solid_phi;
   
-  Array3s liquid_phi;
+  std::vector<BoundaryCache> m_boundary_caches;
+  SparseArray3g u_weights, v_weights, w_weights;
+  SparseArray3c u_valid, v_valid, w_valid;
   
-  Array3s u_drag;
-  Array3s v_drag;
-  Array3s w_drag;
+  SparseArray3g liquid_phi;
+  
+  // scratch space of redistance_liquid_phi
+  SparseArray3g liquid_phi_sweep;
+  SparseArray3c liquid_phi_band;
+  
+  SparseArray3g u_drag;
+  SparseArray3g v_drag;
+  SparseArray3g w_drag;
   
   // Data arrays for extrapolation
-  Array3c valid, old_valid;
+  SparseArray3c valid, old_valid;
   
   std::vector<FluidDragForce<3>*> drag_forces;
   
   // Solver data
   robertbridson::PCGSolver<scalar> solver;
-  robertbridson::SparseMatrix<scalar> matrix;
+  robertbridson::FixedSparseMatrix<scalar> matrix;
   std::vector<double> rhs;
   std::vector<double> pressure;
+  scalar m_last_pressure_dt;
+  GeometricMGPCGSolver<scalar> m_mg_solver;
+  AMGSparseHierarchy<scalar>* m_amg_hierarchy;
   
   TwoDScene<3>* m_parent;
+  
+  // the particles by cell. Everything that moves, adds or removes particles
+  // sets m_particle_index_dirty, and sort_particles() only sorts again then,
+  // so the passes of a substep share one index
   Sorter* m_sorter;
+  bool m_particle_index_dirty;
+  
+  // the hair vertices, kept apart from the particle index so that sorting
+  // them does not discard it
+  HashedSorter* m_hair_sorter;
   
   std::vector< std::vector<int> > m_pool_liquid_index_cache;
   std::vector< std::vector<Particle<3> > > m_pool_liquid_particle_cache;
@@ -305,6 +422,7 @@ protected:
   std::vector<int> m_hair_particle_affected;
   
   int ryoichi_correction_counter;
+  int m_reorder_counter;
   
 };
 
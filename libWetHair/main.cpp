@@ -105,6 +105,7 @@ std::string g_short_file_name;
 
 bool g_simulate_initstate = false;
 std::string g_initstate_file_name;
+std::string g_solver_log_file_name;
 std::ifstream g_binary_input;
 
 
@@ -734,6 +735,9 @@ void parseCommandLine( int argc, char** argv )
     // File to load for init
     TCLAP::ValueArg<std::string> init("j", "initfile", "Binary file to load simulation state from for initialization", false, "", "string", cmd);
     
+    // Per-substep linear solver statistics
+    TCLAP::ValueArg<std::string> solverlog("l", "solverlog", "File to write linear solver statistics of every substep to (CSV if it ends with .csv, JSON lines otherwise)", false, "", "string", cmd);
+    
     cmd.parse(argc, argv);
     
     if(!scene.isSet()) {
@@ -752,6 +756,8 @@ void parseCommandLine( int argc, char** argv )
       g_initstate_file_name = init.getValue();
     }
     
+    g_solver_log_file_name = solverlog.getValue();
+    
     
   }
   catch (TCLAP::ArgException& e)
@@ -834,6 +840,10 @@ int main( int argc, char** argv )
     loadScene(g_xml_scene_file, NULL);
   }
   
+  if(!g_solver_log_file_name.empty()) {
+    g_executable_simulation->setSolverLog(g_solver_log_file_name);
+  }
+  
   // Initialization for OpenGL and GLUT
   if( g_rendering_enabled ) initializeOpenGLandGLUT(argc,argv);
   
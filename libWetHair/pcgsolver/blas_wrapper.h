@@ -66,6 +66,12 @@ inline void add_scaled(double alpha, const std::vector<double> &x, std::vector<d
    for(int i = 0; i < y.size(); ++i)
       y[i] += alpha*x[i];
 }
+
+inline void add_scaled(float alpha, const std::vector<float> &x, std::vector<float> &y)
+{ 
+   for(int i = 0; i < y.size(); ++i)
+      y[i] += alpha*x[i];
+}
 }
 }
 #endif
@@ -240,6 +240,142 @@ void solve_lower_transpose_in_place(const SparseColumnLowerFactor<T> &factor, st
    }while(i!=0);
 }
 
+//============================================================================
+// Multicolor ordered modified incomplete Cholesky, level zero.
+// Every unknown gets a color such that no two unknowns of the same color are
+// coupled, and the unknowns are eliminated color by color. The factor is
+// M = (D+L) D^-1 (D+L^T), where L is the part of the matrix that couples an
+// unknown to lower colors, so the only unknowns of the factorization are the
+// pivots D; the factorization and both substitutions are parallel over the
+// unknowns of one color.
+// The fill-in between two later neighbours of an unknown is assumed to be
+// dropped (lumped into the diagonal for the modified version), which is exact
+// for grid stencils without triangles such as the 7-point Laplacian. There,
+//  - color = (i+j+k)%2 is the red-black ordering: two parallel sweeps, but
+//    considerably more CG iterations than the natural ordering;
+//  - color = i+j+k (hyperplanes) reproduces the factor of the natural
+//    lexicographic ordering, with i+j+k parallel sweeps of one plane each.
+
+template<class T>
+struct MulticolorLowerFactor
+{
+   std::vector<T> invdiag; // reciprocals of the pivots
+   std::vector<unsigned int> colorstart; // where each color begins in rows (plus an extra entry at the end)
+   std::vector<unsigned int> rows; // unknowns sorted by color
+   // couplings of rows[q] to lower (L) and higher (U) colors, in color order
+   std::vector<unsigned int> lowerstart, lowerindex, upperstart, upperindex;
+   std::vector<T> lowervalue, uppervalue;
+};
+
+template<class T>
+void factor_multicolor_modified_incomplete_cholesky0(const FixedSparseMatrix<T> &matrix, const std::vector<unsigned int> &color,
+                                                     MulticolorLowerFactor<T> &factor,
+                                                     T modification_parameter=0.97, T min_diagonal_ratio=0.25)
+{
+   unsigned int n=matrix.n;
+   factor.invdiag.resize(n);
+   
+   // counting sort of the unknowns by color
+   unsigned int ncolors=0;
+   for(unsigned int i=0; i<n; ++i) ncolors=std::max(ncolors, color[i]+1);
+   factor.colorstart.assign(ncolors+1, 0);
+   for(unsigned int i=0; i<n; ++i) ++factor.colorstart[color[i]+1];
+   for(unsigned int c=0; c<ncolors; ++c) factor.colorstart[c+1]+=factor.colorstart[c];
+   factor.rows.resize(n);
+   std::vector<unsigned int> fill(factor.colorstart.begin(), factor.colorstart.end()-1);
+   for(unsigned int i=0; i<n; ++i) factor.rows[fill[color[i]]++]=i;
+   
+   // split the off-diagonal couplings by color, and gather the diagonal
+   // and the sum of the couplings to higher colors for the modification
+   std::vector<T> adiag(n), latersum(n);
+   factor.lowerstart.resize(n+1);
+   factor.upperstart.resize(n+1);
+   factor.lowerstart[0]=factor.upperstart[0]=0;
+   tbb::parallel_for(0u, n, 1u, [&](unsigned int q){
+      unsigned int i=factor.rows[q];
+      unsigned int nlower=0, nupper=0;
+      T d=0, sum=0;
+      for(unsigned int p=matrix.rowstart[i]; p<matrix.rowstart[i+1]; ++p){
+         unsigned int j=matrix.colindex[p];
+         if(j==i) d+=matrix.value[p];
+         else if(color[j]<color[i]) ++nlower;
+         else{ ++nupper; sum+=matrix.value[p]; }
+      }
+      adiag[i]=d;
+      latersum[i]=sum;
+      factor.lowerstart[q+1]=nlower;
+      factor.upperstart[q+1]=nupper;
+   });
+   for(unsigned int q=0; q<n; ++q){
+      factor.lowerstart[q+1]+=factor.lowerstart[q];
+      factor.upperstart[q+1]+=factor.upperstart[q];
+   }
+   factor.lowerindex.resize(factor.lowerstart[n]);
+   factor.lowervalue.resize(factor.lowerstart[n]);
+   factor.upperindex.resize(factor.upperstart[n]);
+   factor.uppervalue.resize(factor.upperstart[n]);
+   tbb::parallel_for(0u, n, 1u, [&](unsigned int q){
+      unsigned int i=factor.rows[q];
+      unsigned int l=factor.lowerstart[q], u=factor.upperstart[q];
+      for(unsigned int p=matrix.rowstart[i]; p<matrix.rowstart[i+1]; ++p){
+         unsigned int j=matrix.colindex[p];
+         if(j==i) continue;
+         if(color[j]<color[i]){ factor.lowerindex[l]=j; factor.lowervalue[l++]=matrix.value[p]; }
+         else{ factor.upperindex[u]=j; factor.uppervalue[u++]=matrix.value[p]; }
+      }
+   });
+   
+   for(unsigned int c=0; c<ncolors; ++c){
+      tbb::parallel_for(factor.colorstart[c], factor.colorstart[c+1], 1u, [&](unsigned int q){
+         unsigned int i=factor.rows[q];
+         if(adiag[i]==0){ factor.invdiag[i]=0; return; } // null row/column
+         T d=adiag[i];
+         for(unsigned int p=factor.lowerstart[q]; p<factor.lowerstart[q+1]; ++p){
+            unsigned int j=factor.lowerindex[p];
+            T a=factor.lowervalue[p];
+            T multiplier=a*factor.invdiag[j];
+            // eliminated entry, plus the dropped fill-in towards the other later neighbours of j
+            d-=multiplier*(a+modification_parameter*(latersum[j]-a));
+         }
+         if(d<min_diagonal_ratio*adiag[i])
+            d=adiag[i]; // drop to Gauss-Seidel here if the pivot looks dangerously small
+         factor.invdiag[i]=1/d;
+      });
+   }
+}
+
+// solve (D+L) D^-1 (D+L^T) result = rhs
+template<class T>
+void solve_multicolor_factor(const MulticolorLowerFactor<T> &factor, const std::vector<T> &rhs, std::vector<T> &result)
+{
+   result.resize(rhs.size());
+   unsigned int ncolors=(unsigned int)factor.colorstart.size()-1;
+   // forward: (D+L) y = rhs
+   for(unsigned int c=0; c<ncolors; ++c){
+      tbb::parallel_for(tbb::blocked_range<unsigned int>(factor.colorstart[c], factor.colorstart[c+1]), [&](const tbb::blocked_range<unsigned int> &range){
+         for(unsigned int q=range.begin(); q!=range.end(); ++q){
+            unsigned int i=factor.rows[q];
+            T sum=rhs[i];
+            for(unsigned int p=factor.lowerstart[q]; p<factor.lowerstart[q+1]; ++p)
+               sum-=factor.lowervalue[p]*result[factor.lowerindex[p]];
+            result[i]=sum*factor.invdiag[i];
+         }
+      });
+   }
+   // backward: (D+L^T) result = D y
+   for(unsigned int c=ncolors; c-->0; ){
+      tbb::parallel_for(tbb::blocked_range<unsigned int>(factor.colorstart[c], factor.colorstart[c+1]), [&](const tbb::blocked_range<unsigned int> &range){
+         for(unsigned int q=range.begin(); q!=range.end(); ++q){
+            unsigned int i=factor.rows[q];
+            T sum=0;
+            for(unsigned int p=factor.upperstart[q]; p<factor.upperstart[q+1]; ++p)
+               sum+=factor.uppervalue[p]*result[factor.upperindex[p]];
+            result[i]-=sum*factor.invdiag[i];
+         }
+      });
+   }
+}
+
 //============================================================================
 // Encapsulates the Conjugate Gradient algorithm with incomplete Cholesky
 // factorization preconditioner.
@@ -261,6 +397,8 @@ struct PCGSolver
       min_diagonal_ratio=min_diagonal_ratio_;
    }
 
+   std::vector<T> residual_history; // max-norm residual before and after every iteration of the last solve
+
    bool solve(const SparseMatrix<T> &matrix, const std::vector<T> &rhs, std::vector<T> &result, T &residual_out, int &iterations_out) 
    {
       unsigned int n=matrix.n;
@@ -268,6 +406,7 @@ struct PCGSolver
       zero(result);
       r=rhs;
       residual_out=BLAS::abs_max(r);
+      residual_history.assign(1, residual_out);
       if(residual_out<1e-30) {
          iterations_out=0;
          return true;
@@ -275,7 +414,42 @@ struct PCGSolver
       double tol=tolerance_factor*residual_out;
 
       form_preconditioner(matrix);
-      apply_preconditioner(r, z);
+      fixed_matrix.construct_from_matrix(matrix);
+      return iterate(fixed_matrix, tol, result, residual_out, iterations_out,
+                     [this](const std::vector<T> &x, std::vector<T> &res){ apply_preconditioner(x, res); });
+   }
+
+   // Same as solve, with the multicolor MIC(0) preconditioner; no two unknowns
+   // of one color may be coupled.
+   bool solve_multicolor(const FixedSparseMatrix<T> &matrix, const std::vector<unsigned int> &color,
+                        const std::vector<T> &rhs, std::vector<T> &result, T &residual_out, int &iterations_out)
+   {
+      unsigned int n=matrix.n;
+      if(m.size()!=n){ m.resize(n); s.resize(n); z.resize(n); r.resize(n); }
+      result.resize(n);
+      zero(result);
+      r=rhs;
+      residual_out=BLAS::abs_max(r);
+      residual_history.assign(1, residual_out);
+      if(residual_out<1e-30) {
+         iterations_out=0;
+         return true;
+      }
+      double tol=tolerance_factor*residual_out;
+
+      factor_multicolor_modified_incomplete_cholesky0(matrix, color, mc_factor,
+                                                      modified_incomplete_cholesky_parameter, min_diagonal_ratio);
+      return iterate(matrix, tol, result, residual_out, iterations_out,
+                     [&](const std::vector<T> &x, std::vector<T> &res){ solve_multicolor_factor(mc_factor, x, res); });
+   }
+
+   protected:
+
+   // PCG iterations from result=0, with r=rhs
+   template<class Precond>
+   bool iterate(const FixedSparseMatrix<T> &matrix, double tol, std::vector<T> &result, T &residual_out, int &iterations_out, Precond apply)
+   {
+      apply(r, z);
       double rho=BLAS::dot(z, r);
       if(rho==0 || rho!=rho) {
          iterations_out=0;
@@ -283,19 +457,19 @@ struct PCGSolver
       }
 
       s=z;
-      fixed_matrix.construct_from_matrix(matrix);
       int iteration;
       for(iteration=0; iteration<max_iterations; ++iteration){
-         multiply(fixed_matrix, s, z);
+         multiply(matrix, s, z);
          double alpha=rho/BLAS::dot(s, z);
          BLAS::add_scaled(alpha, s, result);
          BLAS::add_scaled(-alpha, z, r);
          residual_out=BLAS::abs_max(r);
+         residual_history.push_back(residual_out);
          if(residual_out<=tol) {
             iterations_out=iteration+1;
             return true; 
          }
-         apply_preconditioner(r, z);
+         apply(r, z);
          double rho_new=BLAS::dot(z, r);
          double beta=rho_new/rho;
          BLAS::add_scaled(beta, s, z); s.swap(z); // s=beta*s+z
@@ -305,10 +479,9 @@ struct PCGSolver
       return false;
    }
 
-   protected:
-
    // internal structures
    SparseColumnLowerFactor<T> ic_factor; // modified incomplete cholesky factor
+   MulticolorLowerFactor<T> mc_factor; // multicolor modified incomplete cholesky factor
    std::vector<T> m, z, s, r; // temporary vectors for PCG
    FixedSparseMatrix<T> fixed_matrix; // used within loop
 
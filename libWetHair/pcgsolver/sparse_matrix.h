@@ -257,6 +257,14 @@ namespace robertbridson {
       rowstart.resize(n+1);
     }
     
+    void swap(FixedSparseMatrix<T> &other)
+    {
+      std::swap(n, other.n);
+      value.swap(other.value);
+      colindex.swap(other.colindex);
+      rowstart.swap(other.rowstart);
+    }
+    
     void construct_from_matrix(const SparseMatrix<T> &matrix)
     {
       resize(matrix.n);
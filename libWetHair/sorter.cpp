@@ -25,7 +25,7 @@
 using namespace std;
 
 Sorter::Sorter( int ni_, int nj_, int nk_ )
-: ni(ni_), nj(nj_), nk(nk_)
+: BucketSorter<Sorter>(ni_, nj_, nk_)
 {
   resize(ni, nj, nk);
 }
@@ -38,3 +38,36 @@ void Sorter::resize( int ni_, int nj_, int nk_ )
   array_sup.resize(ni_ * nj_ * nk_);
   ni = ni_; nj = nj_; nk = nk_;
 }
+
+HashedSorter::HashedSorter( int ni_, int nj_, int nk_ )
+: BucketSorter<HashedSorter>(ni_, nj_, nk_), num_slots(0), slot_mask(0), hash_shift(64)
+{
+}
+
+HashedSorter::~HashedSorter() {
+}
+
+void HashedSorter::resize( int ni_, int nj_, int nk_ )
+{
+  ni = ni_; nj = nj_; nk = nk_;
+}
+
+void HashedSorter::reset_buckets( int np )
+{
+  int bits = 4;
+  while((1 << bits) < 2 * np) ++bits;
+  
+  // grow when the table would be more than half full, and shrink once it is
+  // more than twice the size it needs, so a table sized for one large
+  // sort is not kept and cleared by every later small one
+  if((1 << bits) > num_slots || num_slots > (2 << bits)) {
+    num_slots = 1 << bits;
+    slot_mask = (uint64_t) num_slots - 1;
+    hash_shift = 64 - bits;
+    slot_key.reset(new std::atomic<uint64_t>[num_slots]);
+  }
+  
+  tbb::parallel_for(0, num_slots, [&] (int slot) {
+    slot_key[slot].store(EMPTY_KEY, std::memory_order_relaxed);
+  });
+}
@@ -18,64 +18,122 @@
 
 #include "MathDefs.h"
 #include <vector>
+#include <algorithm>
+#include <atomic>
+#include <memory>
 #include <tbb/tbb.h>
 
 #ifndef _SORTER_H
 #define _SORTER_H
 
-class Sorter {
+// The counting sort shared by Sorter and HashedSorter, which differ only in
+// how a cell maps to a bucket. Derived supplies that mapping:
+//
+//   void reset_buckets(int np);                 // before a sort of np particles
+//   int num_buckets() const;
+//   int insert_bucket(int i, int j, int k);     // may be called concurrently
+//   int find_bucket(int i, int j, int k) const; // -1 if the cell is empty
+//
+// The sort is a least-significant-digit radix sort of the bucket indices, a
+// few bits per pass. Every pass is a stable counting sort: the particles are
+// cut into one contiguous block per thread, every block counts its digits, an
+// exclusive scan over the digits, and the blocks within a digit, gives every
+// block the first slot of each of its digits, and every block then writes its
+// particles in order. array_idx comes out sorted by bucket then index without
+// sorting inside the buckets, and the counts of a pass cost only a few
+// thousand entries per block however many buckets there are.
+template<typename Derived>
+class BucketSorter {
 public:
-  Sorter( int ni_, int nj_, int nk_ );
-  void resize( int ni_, int nj_, int nk_ );
-  ~Sorter();
-  
-  inline uint64_t hash(int i, int j, int k, int pidx)
+  BucketSorter( int ni_, int nj_, int nk_ )
+  : ni(ni_), nj(nj_), nk(nk_)
   {
-    int high_part = k * ni * nj + j * ni + i;
-    return (uint64_t) high_part << 32UL | (uint64_t) pidx;
   }
   
   template<typename Callable>
   void sort( size_t total_size, Callable func )
   {
+    Derived& self = static_cast<Derived&>(*this);
+    
     if(array_idx.size() != total_size) {
       array_idx.resize(total_size);
     }
-    
-    memset(&array_sup[0], 0, array_sup.size() * sizeof(std::pair<int, int>));
+    if(array_scratch.size() != total_size) {
+      array_scratch.resize(total_size);
+    }
     
     const int np = (int) total_size;
+    self.reset_buckets(np);
+    
+    const int nbuckets = self.num_buckets();
+    if((int) array_sup.size() != nbuckets) {
+      array_sup.resize(nbuckets);
+    }
     
     tbb::parallel_for(0, np, 1, [&] (int pidx) {
-      
       int i, j, k;
       func(pidx, i, j, k);
-      array_idx[pidx] = hash(i, j, k, pidx);
+      const int bucket = self.insert_bucket(i, j, k);
+      array_scratch[pidx] = (uint64_t) bucket << 32UL | (uint64_t) pidx;
     });
-
-    tbb::parallel_sort(array_idx.begin(), array_idx.end());
-
-    tbb::parallel_for(0, np, 1, [&] (int pidx) {
-      unsigned int G_ID = (unsigned int) pidx;
-      unsigned int G_ID_PREV = (G_ID == 0)? (unsigned int) np : G_ID; G_ID_PREV--;
-      unsigned int G_ID_NEXT = G_ID + 1; if (G_ID_NEXT == (unsigned int) np) { G_ID_NEXT = 0; }
+    
+    // as few passes as the bucket bits need, of at most 12 bits each
+    int bits = 0;
+    while(bits < 31 && (1 << bits) < nbuckets) ++bits;
+    const int npasses = (bits + 11) / 12;
+    const int digit_bits = npasses ? (bits + npasses - 1) / npasses : 0;
+    const int ndigits = 1 << digit_bits;
+    
+    const int nblocks = std::max(1, std::min(np / 4096, tbb::this_task_arena::max_concurrency()));
+    block_offset.resize((size_t) nblocks * ndigits);
+    
+    for(int pass = 0; pass < npasses; ++pass) {
+      const int shift = 32 + pass * digit_bits;
+      const uint64_t mask = (uint64_t) ndigits - 1;
+      const std::vector<uint64_t>& src = array_scratch;
+      std::vector<uint64_t>& dst = array_idx;
       
-      unsigned int cell = (unsigned int) ( array_idx[G_ID] >> 32UL );
-      unsigned int cell_prev = (unsigned int) ( array_idx[G_ID_PREV] >> 32UL );
-      unsigned int cell_next = (unsigned int) ( array_idx[G_ID_NEXT] >> 32UL );
-      if (cell != cell_prev)
-      {
-        // I'm the start of a cell
-        array_sup[cell].first = G_ID;
-      }
-      if (cell != cell_next)
-      {
-        // I'm the end of a cell
-        array_sup[cell].second = G_ID + 1;
+      tbb::parallel_for(0, nblocks, 1, [&] (int block) {
+        int* count = &block_offset[(size_t) block * ndigits];
+        std::fill(count, count + ndigits, 0);
+        const int last = block_end(np, nblocks, block);
+        for(int n = block_end(np, nblocks, block - 1); n < last; ++n) {
+          ++count[(src[n] >> shift) & mask];
+        }
+      });
+      
+      int sum = 0;
+      for(int digit = 0; digit < ndigits; ++digit) {
+        for(int block = 0; block < nblocks; ++block) {
+          int& offset = block_offset[(size_t) block * ndigits + digit];
+          const int count = offset;
+          offset = sum;
+          sum += count;
+        }
       }
-    });
+      
+      tbb::parallel_for(0, nblocks, 1, [&] (int block) {
+        int* next = &block_offset[(size_t) block * ndigits];
+        const int last = block_end(np, nblocks, block);
+        for(int n = block_end(np, nblocks, block - 1); n < last; ++n) {
+          const uint64_t key = src[n];
+          dst[next[(key >> shift) & mask]++] = key;
+        }
+      });
+      
+      array_idx.swap(array_scratch);
+    }
+    array_idx.swap(array_scratch);
     
+    tbb::parallel_for(0, nbuckets, [&] (int bucket) {
+      array_sup[bucket].first = array_sup[bucket].second = 0;
+    });
     
+    tbb::parallel_for(0, np, [&] (int n) {
+      const int bucket = (int) (array_idx[n] >> 32UL);
+      if(n == 0 || (int) (array_idx[n - 1] >> 32UL) != bucket) array_sup[bucket].first = n;
+      if(n == np - 1 || (int) (array_idx[n + 1] >> 32UL) != bucket) array_sup[bucket].second = n + 1;
+    });
   }
   
   template<typename Callable>
@@ -90,8 +148,9 @@ public:
   void getCellAt( int i, int j, int k, Callable func )
   {
     if( i < 0 || i > ni-1 || j < 0 || j > nj-1 || k < 0 || k > nk-1 ) return;
-    unsigned int G_CELL = (unsigned int) (k * (ni * nj) + j * ni + i);
-    const std::pair<int, int>& G_START_END = array_sup[G_CELL];
+    const int bucket = static_cast<const Derived&>(*this).find_bucket(i, j, k);
+    if(bucket < 0) return;
+    const std::pair<int, int>& G_START_END = array_sup[bucket];
     for(int N_ID = G_START_END.first; N_ID < G_START_END.second; ++N_ID)
     {
       func((int) (array_idx[N_ID] & 0xFFFFFFFFUL));
@@ -101,9 +160,102 @@ public:
   std::vector<uint64_t> array_idx;
   std::vector< std::pair<int, int> > array_sup;
   
+  // the keys of the previous radix pass, and the count then the next free
+  // slot of every digit in every block, while sorting
+  std::vector<uint64_t> array_scratch;
+  std::vector<int> block_offset;
+  
   int ni;
   int nj;
   int nk;
+  
+private:
+  // one past the last particle of block, 0 for block -1
+  static int block_end(int np, int nblocks, int block)
+  {
+    return (int) ((int64_t) np * (block + 1) / nblocks);
+  }
+};
+
+// Sorts the particles by the cells of an ni * nj * nk grid; a bucket is a
+// cell.
+class Sorter : public BucketSorter<Sorter> {
+public:
+  Sorter( int ni_, int nj_, int nk_ );
+  void resize( int ni_, int nj_, int nk_ );
+  ~Sorter();
+  
+  inline uint64_t hash(int i, int j, int k, int pidx)
+  {
+    int high_part = k * ni * nj + j * ni + i;
+    return (uint64_t) high_part << 32UL | (uint64_t) pidx;
+  }
+  
+  void reset_buckets(int) {}
+  
+  int num_buckets() const { return ni * nj * nk; }
+  
+  int insert_bucket(int i, int j, int k) const { return k * ni * nj + j * ni + i; }
+  
+  int find_bucket(int i, int j, int k) const { return k * ni * nj + j * ni + i; }
+};
+
+// A Sorter over an unbounded grid: only the occupied cells are stored, in an
+// open-addressing hash table sized from the number of particles, so that the
+// memory and the reset cost of a sort do not depend on ni * nj * nk. A bucket
+// is a slot of the table.
+class HashedSorter : public BucketSorter<HashedSorter> {
+public:
+  HashedSorter( int ni_, int nj_, int nk_ );
+  void resize( int ni_, int nj_, int nk_ );
+  ~HashedSorter();
+  
+  inline uint64_t cell_key(int i, int j, int k) const
+  {
+    return (uint64_t) i + (uint64_t) ni * ((uint64_t) j + (uint64_t) nj * (uint64_t) k);
+  }
+  
+  inline uint64_t slot_hash(uint64_t key) const
+  {
+    return (key * 0x9E3779B97F4A7C15ULL) >> hash_shift;
+  }
+  
+  // empties the table, which is kept at two to eight times the particle
+  // count (and at least 16 slots)
+  void reset_buckets(int np);
+  
+  int num_buckets() const { return num_slots; }
+  
+  // the slot of the cell, which is claimed if the cell is not in the table yet
+  int insert_bucket(int i, int j, int k)
+  {
+    const uint64_t key = cell_key(i, j, k);
+    for(uint64_t h = slot_hash(key); ; h = (h + 1) & slot_mask) {
+      uint64_t cur = slot_key[h].load(std::memory_order_relaxed);
+      if(cur == EMPTY_KEY && slot_key[h].compare_exchange_strong(cur, key, std::memory_order_relaxed)) return (int) h;
+      if(cur == key) return (int) h;
+    }
+  }
+  
+  // the slot of the cell, or -1 if no particle is in that cell
+  int find_bucket(int i, int j, int k) const
+  {
+    if(!num_slots) return -1;
+    const uint64_t key = cell_key(i, j, k);
+    for(uint64_t h = slot_hash(key); ; h = (h + 1) & slot_mask) {
+      const uint64_t cur = slot_key[h].load(std::memory_order_relaxed);
+      if(cur == key) return (int) h;
+      if(cur == EMPTY_KEY) return -1;
+    }
+  }
+  
+  static const uint64_t EMPTY_KEY = ~0ULL;
+  
+  // the table: the cell key of every slot
+  int num_slots;
+  uint64_t slot_mask;
+  int hash_shift;
+  std::unique_ptr< std::atomic<uint64_t>[] > slot_key;
 };
 
 #endif
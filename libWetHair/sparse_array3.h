@@ -0,0 +1,252 @@
+//
+// This file is part of the libWetHair open source project
+//
+// Copyright 2017 Yun (Raymond) Fei, Henrique Teles Maia, Christopher Batty,
+// Changxi Zheng, and Eitan Grinspun
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#ifndef SPARSE_ARRAY3_H
+#define SPARSE_ARRAY3_H
+
+#include "MathDefs.h"
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+#include <vector>
+#include <tbb/tbb.h>
+
+// In this file:
+//   SparseArray3<T>: a 3D array stored in 8x8x8 tiles, with the same element
+//   read access as Array3. Only the tiles switched on by set_topology() own
+//   memory; every other cell reads as the background value. Writes go through
+//   ref(), which asserts that the cell is allocated, so the topology has to
+//   cover every cell a grid pass produces a value for before that pass runs.
+//   Passes that sweep the whole array write with set_if_allocated().
+//
+// The tile table maps the linear index of a tile to its slot in the pool, or
+// to -1. Tiles are laid out x-fastest inside, and the pool keeps the allocated
+// tiles in increasing tile order, so arrays of the same size that were given
+// the same topology have the same slots.
+
+template<class T>
+struct SparseArray3
+{
+   typedef T value_type;
+   typedef T& reference;
+   typedef const T& const_reference;
+   typedef size_t size_type;
+
+   static const int TILE_BITS = 3;
+   static const int TILE_SIZE = 1 << TILE_BITS;
+   static const int TILE_MASK = TILE_SIZE - 1;
+   static const int TILE_CELLS = TILE_SIZE * TILE_SIZE * TILE_SIZE;
+
+   // the actual representation
+
+   int ni, nj, nk;
+   int nti, ntj, ntk;
+   T background;
+   std::vector<int> tile_slot;
+   std::vector<int> active_tiles;
+   std::vector<T> pool;
+
+   // the interface
+
+   SparseArray3(void)
+      : ni(0), nj(0), nk(0), nti(0), ntj(0), ntk(0), background()
+   {}
+
+   SparseArray3(int ni_, int nj_, int nk_)
+      : ni(0), nj(0), nk(0), nti(0), ntj(0), ntk(0), background()
+   { resize(ni_, nj_, nk_); }
+
+   static int num_tiles_for(int n)
+   { return (n + TILE_MASK) >> TILE_BITS; }
+
+   int tile_index(int i, int j, int k) const
+   { return (i >> TILE_BITS) + nti * ((j >> TILE_BITS) + ntj * (k >> TILE_BITS)); }
+
+   static int cell_offset(int i, int j, int k)
+   { return (i & TILE_MASK) | ((j & TILE_MASK) << TILE_BITS) | ((k & TILE_MASK) << (2 * TILE_BITS)); }
+
+   const T& operator()(int i, int j, int k) const
+   {
+      assert(i>=0 && i<ni && j>=0 && j<nj && k>=0 && k<nk);
+      const int slot = tile_slot[tile_index(i, j, k)];
+      if(slot < 0) return background;
+      return pool[(size_t) slot * TILE_CELLS + cell_offset(i, j, k)];
+   }
+
+   const T& at(int i, int j, int k) const
+   { return (*this)(i, j, k); }
+
+   // the writable cell (i,j,k), whose tile has to be allocated
+   T& ref(int i, int j, int k)
+   {
+      assert(is_allocated(i, j, k));
+      return pool[(size_t) tile_slot[tile_index(i, j, k)] * TILE_CELLS + cell_offset(i, j, k)];
+   }
+
+   void set_if_allocated(int i, int j, int k, const T& value)
+   {
+      assert(i>=0 && i<ni && j>=0 && j<nj && k>=0 && k<nk);
+      const int slot = tile_slot[tile_index(i, j, k)];
+      if(slot >= 0) pool[(size_t) slot * TILE_CELLS + cell_offset(i, j, k)] = value;
+   }
+
+   bool is_allocated(int i, int j, int k) const
+   {
+      assert(i>=0 && i<ni && j>=0 && j<nj && k>=0 && k<nk);
+      return tile_slot[tile_index(i, j, k)] >= 0;
+   }
+
+   // sets every cell, allocated or not, to value
+   void assign(const T& value)
+   {
+      background = value;
+      std::fill(pool.begin(), pool.end(), value);
+   }
+
+   void set_zero(void)
+   { assign(T()); }
+
+   // changes the size and releases all tiles
+   void resize(int ni_, int nj_, int nk_)
+   {
+      assert(ni_>=0 && nj_>=0 && nk_>=0);
+      ni = ni_;
+      nj = nj_;
+      nk = nk_;
+      nti = num_tiles_for(ni);
+      ntj = num_tiles_for(nj);
+      ntk = num_tiles_for(nk);
+      tile_slot.assign((size_t) nti * ntj * ntk, -1);
+      active_tiles.clear();
+      pool.clear();
+   }
+
+   void clear(void)
+   { resize(0, 0, 0); }
+
+   // the number of cells of the dense array
+   size_type size(void) const
+   { return (size_type) ni * nj * nk; }
+
+   int num_active_tiles(void) const
+   { return (int) active_tiles.size(); }
+
+   int num_tiles(void) const
+   { return nti * ntj * ntk; }
+
+   size_t memory_usage(void) const
+   { return pool.size() * sizeof(T) + (tile_slot.size() + active_tiles.size()) * sizeof(int); }
+
+   // the first cell of the n-th allocated tile and the end of its range,
+   // clipped to the array
+   void get_tile_range(int n, int& i0, int& j0, int& k0, int& i1, int& j1, int& k1) const
+   {
+      const int t = active_tiles[n];
+      i0 = (t % nti) << TILE_BITS;
+      j0 = ((t / nti) % ntj) << TILE_BITS;
+      k0 = (t / (nti * ntj)) << TILE_BITS;
+      i1 = std::min(i0 + TILE_SIZE, ni);
+      j1 = std::min(j0 + TILE_SIZE, nj);
+      k1 = std::min(k0 + TILE_SIZE, nk);
+   }
+
+   T* tile_data(int n)
+   { return &pool[(size_t) n * TILE_CELLS]; }
+
+   const T* tile_data(int n) const
+   { return &pool[(size_t) n * TILE_CELLS]; }
+
+   /*
+   Allocates exactly the tiles (ti,tj,tk) with mask[ti + mti*(tj + mtj*tk)]
+   set. The mask may cover more tiles than the array (a face-centred array has
+   one layer of cells more than a cell-centred one, and they share a mask).
+   Tiles that stay allocated keep their values, new ones start at the
+   background.
+   */
+   void set_topology(const std::vector<unsigned char>& mask, int mti, int mtj, int mtk)
+   {
+      assert(mti >= nti && mtj >= ntj && mtk >= ntk);
+      (void) mtk;
+      std::vector<int> new_active;
+      for(int tk = 0; tk < ntk; ++tk) for(int tj = 0; tj < ntj; ++tj) for(int ti = 0; ti < nti; ++ti) {
+         if(mask[ti + mti * (tj + mtj * tk)]) new_active.push_back(ti + nti * (tj + ntj * tk));
+      }
+      if(new_active == active_tiles) return;
+
+      std::vector<int> new_slot(tile_slot.size(), -1);
+      const int nactive = (int) new_active.size();
+      for(int n = 0; n < nactive; ++n) new_slot[new_active[n]] = n;
+
+      std::vector<T> new_pool((size_t) nactive * TILE_CELLS, background);
+      tbb::parallel_for(0, nactive, [&] (int n) {
+         const int old = tile_slot[new_active[n]];
+         if(old >= 0) std::copy(pool.begin() + (size_t) old * TILE_CELLS, pool.begin() + (size_t) (old + 1) * TILE_CELLS,
+                                new_pool.begin() + (size_t) n * TILE_CELLS);
+      });
+
+      tile_slot.swap(new_slot);
+      active_tiles.swap(new_active);
+      pool.swap(new_pool);
+   }
+
+   // copies all cells into a dense x-fastest buffer of size() entries, which
+   // may be of another precision
+   template<class S>
+   void copy_to_dense(S* data) const
+   {
+      tbb::parallel_for(0, nk, [&] (int k) {
+         for(int j = 0; j < nj; ++j) for(int i = 0; i < ni; ++i)
+            data[i + ni * (j + nj * k)] = (S) (*this)(i, j, k);
+      });
+   }
+
+   // the inverse of copy_to_dense for the allocated cells
+   template<class S>
+   void copy_from_dense(const S* data)
+   {
+      const int nactive = num_active_tiles();
+      tbb::parallel_for(0, nactive, [&] (int n) {
+         int i0, j0, k0, i1, j1, k1;
+         get_tile_range(n, i0, j0, k0, i1, j1, k1);
+         T* tile = tile_data(n);
+         for(int k = k0; k < k1; ++k) for(int j = j0; j < j1; ++j) for(int i = i0; i < i1; ++i)
+            tile[cell_offset(i, j, k)] = (T) data[i + ni * (j + nj * k)];
+      });
+   }
+
+   void swap(SparseArray3<T>& x)
+   {
+      std::swap(ni, x.ni);
+      std::swap(nj, x.nj);
+      std::swap(nk, x.nk);
+      std::swap(nti, x.nti);
+      std::swap(ntj, x.ntj);
+      std::swap(ntk, x.ntk);
+      std::swap(background, x.background);
+      tile_slot.swap(x.tile_slot);
+      active_tiles.swap(x.active_tiles);
+      pool.swap(x.pool);
+   }
+};
+
+typedef SparseArray3<scalar> SparseArray3s;
+typedef SparseArray3<gridscalar> SparseArray3g;
+typedef SparseArray3<char> SparseArray3c;
+
+#endif